@@ -0,0 +1,469 @@
+#pragma once
+
+#include <cctype>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "Log.hpp"
+#include "RateLimiter.hpp"
+#include "Stats.hpp"
+#include "utils.hpp"
+
+/* Userspace stand-in for tc netem on loopback, which needs no privileges.
+   Relays TCP connections from a local port to an upstream server and holds
+   every read back for the configured one-way delay (plus jitter) before
+   passing it on. A "lost" read is held for an extra retransmission timeout,
+   and everything behind it waits too, as it would behind a TCP retransmit.
+   A fault script (see Fault) changes single connections while they run:
+   their delay or downstream bandwidth, freezing them or cutting them at an
+   exact byte of the download. */
+class NetProxy {
+public:
+    /* One script line: "<connection> <when> <action> [<value>]".
+       <connection> counts accepted connections from 0, "*" is every one.
+       <when> is "<n>ms" after the connection was accepted, or a byte count
+       (K/M/G suffixes allowed) sent downstream to the client; a byte
+       trigger fires exactly at that byte.
+       <action> is "delay <ms>" (one-way, both directions), "rate <bytes/s>"
+       (downstream, 0 lifts the cap), "freeze" (stop relaying, keep the
+       connection open), "thaw" or "disconnect". */
+    struct Fault {
+        enum Action { DELAY, RATE, FREEZE, THAW, DISCONNECT };
+
+        static const int ALL{-1};
+
+        int connection{ALL};
+        bool byBytes{false};
+        /* Milliseconds or bytes, see byBytes. */
+        u_int64_t at{0};
+        Action action{FREEZE};
+        u_int64_t value{0};
+    };
+
+    static std::vector<Fault> loadScript(const std::string &path) {
+        std::ifstream file(path);
+        if (!file)
+            throw std::runtime_error("Cannot read " + path);
+        std::vector<Fault> faults;
+        std::string line;
+        for (unsigned lineNo = 1; std::getline(file, line); ++lineNo) {
+            line = line.substr(0, line.find('#'));
+            std::istringstream fields(line);
+            std::string connection, when, action, value;
+            if (!(fields >> connection))
+                continue;
+            try {
+                if (!(fields >> when >> action))
+                    throw std::runtime_error("missing fields");
+                Fault fault;
+                if (connection != "*")
+                    fault.connection = static_cast<int>(parseField("connection", connection, false));
+                if (when.size() > 2 && when.compare(when.size() - 2, 2, "ms") == 0) {
+                    fault.at = parseField("time", when.substr(0, when.size() - 2), false);
+                } else {
+                    fault.byBytes = true;
+                    fault.at = parseField("byte count", when, true);
+                }
+                if (action == "delay" || action == "rate") {
+                    if (!(fields >> value))
+                        throw std::runtime_error(action + " needs a value");
+                    fault.action = action == "delay" ? Fault::DELAY : Fault::RATE;
+                    fault.value = parseField(action.c_str(), value, action == "rate");
+                } else if (action == "freeze") {
+                    fault.action = Fault::FREEZE;
+                } else if (action == "thaw") {
+                    fault.action = Fault::THAW;
+                } else if (action == "disconnect") {
+                    fault.action = Fault::DISCONNECT;
+                } else {
+                    throw std::runtime_error("unknown action " + action);
+                }
+                faults.push_back(fault);
+            } catch (const std::exception &e) {
+                throw std::runtime_error(path + ":" + std::to_string(lineNo) + ": " + e.what());
+            }
+        }
+        return faults;
+    }
+
+    /* A number of a script line, with K/M/G suffixes if `sizeSuffix`. The
+       error names the field. */
+    static u_int64_t parseField(const char *field, const std::string &text, bool sizeSuffix) {
+        if (!text.empty() && isdigit(static_cast<unsigned char>(text[0]))) {
+            try {
+                size_t end{0};
+                const u_int64_t value = sizeSuffix ? RateLimits::parseRate(text) : std::stoull(text, &end);
+                if (sizeSuffix || end == text.size())
+                    return value;
+            } catch (const std::exception &) {
+            }
+        }
+        throw std::runtime_error(std::string("invalid ") + field + " '" + text + "'");
+    }
+
+    struct Options {
+        std::string listenPort;
+        std::string upstreamHost;
+        std::string upstreamPort;
+        unsigned delayMs{0};
+        unsigned jitterMs{0};
+        double loss{0};
+        unsigned rtoMs{200};
+        std::vector<Fault> faults;
+    };
+
+    explicit NetProxy(const Options &options) : options(options) {
+        epFd = epoll_create1(0);
+        if (epFd == -1)
+            throw std::runtime_error("Cannot create epoll");
+        listenSock = listenOn(options.listenPort);
+        watch(listenSock, EPOLLIN, EPOLL_CTL_ADD);
+    }
+
+    void run() {
+        epoll_event events[MAX_EVENTS];
+        while (true) {
+            int readyCount = epoll_wait(epFd, events, MAX_EVENTS, nextTimeoutMs());
+            if (readyCount == -1) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error("epoll_wait failed");
+            }
+            for (int i = 0; i < readyCount; ++i) {
+                const int fd = events[i].data.fd;
+                if (fd == listenSock) {
+                    acceptClients();
+                    continue;
+                }
+                auto it = sessions.find(fd);
+                if (it == sessions.end())
+                    continue;
+                Session &session = *it->second;
+                if (session.frozen) {
+                    /* Nothing is read from a frozen connection, but an end hanging up ends it. */
+                    if (events[i].events & (EPOLLHUP | EPOLLERR))
+                        session.failed = true;
+                    continue;
+                }
+                for (Pipe *pipe : {&session.up, &session.down})
+                    if (pipe->from == fd && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                        receive(*pipe);
+            }
+            flushAll();
+        }
+    }
+
+private:
+    struct Segment {
+        steady_clock::time_point due;
+        std::vector<u_int8_t> data;
+        size_t offset{0};
+    };
+
+    /* One direction of a relayed connection. */
+    struct Pipe {
+        int from{-1};
+        int to{-1};
+        std::deque<Segment> queue;
+        size_t queuedBytes{0};
+        u_int64_t sentBytes{0};
+        bool eof{false};
+        bool blocked{false};
+        bool shutDown{false};
+        steady_clock::time_point lastDue;
+        /* Waiting for bandwidth until then. */
+        steady_clock::time_point throttledUntil;
+    };
+
+    struct Session {
+        Pipe up, down;
+        bool failed{false};
+        u_int64_t index{0};
+        steady_clock::time_point accepted;
+        unsigned delayMs{0};
+        bool frozen{false};
+        TokenBucket downRate;
+        /* Script lines for this connection that have not fired yet. */
+        std::vector<Fault> faults;
+    };
+
+    void acceptClients() {
+        while (true) {
+            int clientSock = accept4(listenSock, nullptr, nullptr, SOCK_NONBLOCK);
+            if (clientSock == -1)
+                return;
+            int upstreamSock = connectUpstream();
+            if (upstreamSock == -1) {
+                close(clientSock);
+                continue;
+            }
+
+            auto session = std::make_shared<Session>();
+            session->index = nextIndex++;
+            session->accepted = steady_clock::now();
+            session->delayMs = options.delayMs;
+            for (const Fault &fault : options.faults)
+                if (fault.connection == Fault::ALL || fault.connection == static_cast<int>(session->index))
+                    session->faults.push_back(fault);
+            session->up.from = clientSock;
+            session->up.to = upstreamSock;
+            session->down.from = upstreamSock;
+            session->down.to = clientSock;
+            sessions[clientSock] = session;
+            sessions[upstreamSock] = session;
+            watch(clientSock, EPOLLIN, EPOLL_CTL_ADD);
+            watch(upstreamSock, EPOLLIN, EPOLL_CTL_ADD);
+            LOG_INFO("Relaying connection %lu: %d <-> %d", session->index, clientSock, upstreamSock);
+        }
+    }
+
+    void receive(Pipe &pipe) {
+        if (pipe.eof || pipe.queuedBytes >= MAX_QUEUED)
+            return;
+        Segment segment;
+        segment.data.resize(READ_SIZE);
+        ssize_t rv = recv(pipe.from, segment.data.data(), READ_SIZE, 0);
+        if (rv == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            sessions.at(pipe.from)->failed = true;
+            return;
+        }
+        if (rv == 0) {
+            pipe.eof = true;
+            return;
+        }
+        segment.data.resize(static_cast<size_t>(rv));
+
+        const auto now = steady_clock::now();
+        auto delay = std::chrono::milliseconds(sessions.at(pipe.from)->delayMs);
+        if (options.jitterMs > 0)
+            delay += std::chrono::milliseconds(static_cast<unsigned>(uniform(rng) * options.jitterMs));
+        if (options.loss > 0 && uniform(rng) < options.loss)
+            delay += std::chrono::milliseconds(options.rtoMs);
+        /* TCP delivers in order, so nothing overtakes an earlier segment. */
+        segment.due = std::max(now + delay, pipe.lastDue);
+        pipe.lastDue = segment.due;
+        pipe.queuedBytes += segment.data.size();
+        pipe.queue.push_back(std::move(segment));
+    }
+
+    /* `session.down` is rate limited and counts towards byte triggers. */
+    void flush(Session &session, Pipe &pipe, steady_clock::time_point now) {
+        pipe.blocked = false;
+        const bool downstream = &pipe == &session.down;
+        while (!pipe.queue.empty() && pipe.queue.front().due <= now && !session.failed) {
+            Segment &segment = pipe.queue.front();
+            size_t len = segment.data.size() - segment.offset;
+            if (downstream) {
+                const u_int64_t tokens = session.downRate.available(now);
+                if (tokens == 0) {
+                    pipe.throttledUntil = now + session.downRate.waitFor(len, now);
+                    return;
+                }
+                len = std::min<u_int64_t>(len, std::min(tokens, bytesToTrigger(session)));
+            }
+            ssize_t rv = send(pipe.to, segment.data.data() + segment.offset, len, MSG_NOSIGNAL);
+            if (rv == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    pipe.blocked = true;
+                    return;
+                }
+                session.failed = true;
+                return;
+            }
+            segment.offset += rv;
+            pipe.queuedBytes -= rv;
+            pipe.sentBytes += rv;
+            if (downstream) {
+                session.downRate.consume(static_cast<u_int64_t>(rv));
+                fireDue(session, now);
+                if (session.frozen)
+                    return;
+            }
+            if (segment.offset == segment.data.size())
+                pipe.queue.pop_front();
+        }
+        if (pipe.eof && pipe.queue.empty() && !pipe.shutDown) {
+            shutdown(pipe.to, SHUT_WR);
+            pipe.shutDown = true;
+        }
+    }
+
+    /* Bytes the client can get before the next byte trigger. */
+    u_int64_t bytesToTrigger(const Session &session) const {
+        u_int64_t left = ~u_int64_t{0};
+        for (const Fault &fault : session.faults)
+            if (fault.byBytes && fault.at > session.down.sentBytes)
+                left = std::min(left, fault.at - session.down.sentBytes);
+        return left;
+    }
+
+    /* Applies the script lines whose time or byte count has come. */
+    void fireDue(Session &session, steady_clock::time_point now) {
+        for (auto it = session.faults.begin(); it != session.faults.end();) {
+            const bool due = it->byBytes ? session.down.sentBytes >= it->at
+                                         : now >= session.accepted + std::chrono::milliseconds(it->at);
+            if (!due) {
+                ++it;
+                continue;
+            }
+            apply(session, *it);
+            it = session.faults.erase(it);
+        }
+    }
+
+    void apply(Session &session, const Fault &fault) {
+        switch (fault.action) {
+            case Fault::DELAY:
+                session.delayMs = static_cast<unsigned>(fault.value);
+                LOG_INFO("Connection %lu: delay %lu ms", session.index, fault.value);
+                break;
+            case Fault::RATE:
+                session.downRate.setRate(fault.value);
+                LOG_INFO("Connection %lu: rate %lu B/s", session.index, fault.value);
+                break;
+            case Fault::FREEZE:
+                session.frozen = true;
+                LOG_INFO("Connection %lu: frozen after %lu bytes", session.index, session.down.sentBytes);
+                break;
+            case Fault::THAW:
+                session.frozen = false;
+                LOG_INFO("Connection %lu: thawed", session.index);
+                break;
+            case Fault::DISCONNECT:
+                session.failed = true;
+                LOG_INFO("Connection %lu: disconnected after %lu bytes", session.index, session.down.sentBytes);
+                break;
+        }
+    }
+
+    /* Delivers whatever is due, drops finished sessions and syncs every
+       socket's epoll interest with its pipes. */
+    void flushAll() {
+        const auto now = steady_clock::now();
+        std::vector<int> finished;
+        for (auto &entry : sessions) {
+            Session &session = *entry.second;
+            if (entry.first != session.up.from)
+                continue;
+            fireDue(session, now);
+            if (!session.frozen) {
+                flush(session, session.up, now);
+                flush(session, session.down, now);
+            }
+            const bool done = session.failed || (session.up.shutDown && session.down.shutDown);
+            if (done) {
+                finished.push_back(session.up.from);
+                continue;
+            }
+            watch(session.up.from, session.frozen ? 0 : interest(session.up, session.down), EPOLL_CTL_MOD);
+            watch(session.down.from, session.frozen ? 0 : interest(session.down, session.up), EPOLL_CTL_MOD);
+        }
+        for (int fd : finished) {
+            std::shared_ptr<Session> session = sessions.at(fd);
+            LOG_INFO("Connection %lu closed, %lu bytes down, %lu up", session->index,
+                     session->down.sentBytes, session->up.sentBytes);
+            sessions.erase(session->up.from);
+            sessions.erase(session->down.from);
+            close(session->up.from);
+            close(session->down.from);
+        }
+    }
+
+    /* Interest of the socket `reading.from`, which `writing` sends to. */
+    u_int32_t interest(const Pipe &reading, const Pipe &writing) const {
+        u_int32_t events{0};
+        if (!reading.eof && reading.queuedBytes < MAX_QUEUED)
+            events |= EPOLLIN;
+        if (writing.blocked)
+            events |= EPOLLOUT;
+        return events;
+    }
+
+    int nextTimeoutMs() const {
+        const auto now = steady_clock::now();
+        steady_clock::time_point next = steady_clock::time_point::max();
+        for (const auto &entry : sessions) {
+            const Session &session = *entry.second;
+            for (const Fault &fault : session.faults)
+                if (!fault.byBytes)
+                    next = std::min(next, session.accepted + std::chrono::milliseconds(fault.at));
+            if (session.frozen)
+                continue;
+            for (const Pipe *pipe : {&session.up, &session.down}) {
+                if (pipe->queue.empty() || pipe->blocked)
+                    continue;
+                next = std::min(next, std::max(pipe->queue.front().due, pipe->throttledUntil));
+            }
+        }
+        if (next == steady_clock::time_point::max())
+            return -1;
+        if (next <= now)
+            return 0;
+        return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count()) + 1;
+    }
+
+    void watch(int fd, u_int32_t events, int op) {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(epFd, op, fd, &event) == -1)
+            LOG_ERROR("epoll_ctl: %s", strerror(errno));
+    }
+
+    int listenOn(const std::string &port) {
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        int enable = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(static_cast<u_int16_t>(std::stoul(port)));
+        if (bind(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1 || listen(sock, 128) == -1) {
+            LOG_ERROR("bind: %s", strerror(errno));
+            throw std::runtime_error("Cannot listen on port " + port);
+        }
+        return sock;
+    }
+
+    int connectUpstream() {
+        addrinfo hints{}, *info = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(options.upstreamHost.c_str(), options.upstreamPort.c_str(), &hints, &info) != 0)
+            return -1;
+        int sock = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (sock != -1 && connect(sock, info->ai_addr, info->ai_addrlen) == -1) {
+            LOG_ERROR("connect: %s", strerror(errno));
+            close(sock);
+            sock = -1;
+        }
+        freeaddrinfo(info);
+        if (sock != -1)
+            fcntl(sock, F_SETFL, O_NONBLOCK);
+        return sock;
+    }
+
+    static const int MAX_EVENTS{64};
+    static const size_t READ_SIZE{64 * 1024};
+    /* Bytes held per direction before the proxy stops reading. */
+    static const size_t MAX_QUEUED{8 * 1024 * 1024};
+
+    const Options options;
+    int epFd{-1};
+    int listenSock{-1};
+    std::unordered_map<int, std::shared_ptr<Session>> sessions;
+    u_int64_t nextIndex{0};
+    std::mt19937 rng{42};
+    std::uniform_real_distribution<double> uniform{0.0, 1.0};
+};
@@ -0,0 +1,73 @@
+#include <benchmark/benchmark.h>
+#include <fstream>
+#include <random>
+#include <string>
+#include "ChunkAssembler.hpp"
+#include "Gzip.hpp"
+#include "Log.hpp"
+#include "MsgMetadata.hpp"
+#include "SavedChunks.hpp"
+
+/* ChunkAssembler building a 64 MiB file from 16 saved chunks, as the client
+   does after a download: STORED copies the chunk files, BLOCKS inflates a
+   compressed block per chunk. The chunk files stay in the page cache; the
+   time includes the output's final fdatasync. */
+static const std::string DIR{"/tmp/microbench_assemble"};
+static const u_int64_t CHUNKS{16};
+
+/* Half random, half compressible, like the gzip benchmarks. */
+static std::vector<u_int8_t> chunkData(u_int64_t chunkNo) {
+    std::mt19937_64 rng(chunkNo);
+    std::vector<u_int8_t> data(CHUNK_SIZE, 'c');
+    for (size_t i = 0; i < data.size() / 2; i += 8) {
+        const u_int64_t value = rng();
+        memcpy(data.data() + i, &value, sizeof(value));
+    }
+    return data;
+}
+
+/* Chunk files of one mode, written once. */
+static const SavedChunks &chunkFiles(ChunkAssembler::Mode mode) {
+    const bool blocks = mode == ChunkAssembler::Mode::BLOCKS;
+    static SavedChunks stored(DIR + "/stored");
+    static SavedChunks compressed(DIR + "/blocks");
+    SavedChunks &files = blocks ? compressed : stored;
+    if (files.size() != 0)
+        return files;
+    mkdir(DIR.c_str(), S_IRWXU);
+    mkdir(files.getDir().c_str(), S_IRWXU);
+    files.resize(CHUNKS);
+    for (u_int64_t chunkNo = 0; chunkNo < CHUNKS; ++chunkNo) {
+        std::vector<u_int8_t> data = chunkData(chunkNo);
+        if (blocks)
+            data = Gzip::compressBuffer(data.data(), data.size());
+        files.save(chunkNo, 0);
+        std::ofstream(files.path(chunkNo), std::ios::binary | std::ios::trunc)
+                .write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+    }
+    return files;
+}
+
+static void BM_Assemble(benchmark::State &state) {
+    const auto mode = static_cast<ChunkAssembler::Mode>(state.range(0));
+    const SavedChunks &files = chunkFiles(mode);
+    ChunkAssembler::Plan plan;
+    plan.mode = mode;
+    plan.outPath = DIR + "/assembled";
+    plan.rawSize = CHUNKS * CHUNK_SIZE;
+    plan.keepChunks = true;
+    Log::setLevel(HA_LOG_WARN);
+    for (auto _ : state) {
+        ChunkAssembler assembler(files);
+        assembler.start(plan);
+        assembler.finish();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * CHUNKS * CHUNK_SIZE));
+}
+BENCHMARK(BM_Assemble)
+        ->Arg(static_cast<int>(ChunkAssembler::Mode::STORED))
+        ->Arg(static_cast<int>(ChunkAssembler::Mode::BLOCKS))
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,69 @@
+#include <benchmark/benchmark.h>
+#include <memory>
+#include "ChunkScheduler.hpp"
+#include "MetaDataProvider.hpp"
+
+/* One getChunkToDownload() plus markChunkAsDone() per iteration, with
+   `sources` servers that all have every chunk. The scheduler starts over,
+   untimed, once every chunk is saved. */
+struct SchedulerFixture {
+    SchedulerFixture(u_int64_t chunks, int sources) : chunks(chunks), sources(sources) {
+        metaDataProvider.setMetaData("file", chunks * CHUNK_SIZE);
+    }
+
+    void reset() {
+        scheduler = std::make_unique<ChunkScheduler>(metaDataProvider);
+        ChunkBitmap all(chunks);
+        all.setAll();
+        for (int source = 0; source < sources; ++source)
+            scheduler->updateAvailability(source, all);
+    }
+
+    const u_int64_t chunks;
+    const int sources;
+    MetaDataProvider metaDataProvider;
+    std::unique_ptr<ChunkScheduler> scheduler;
+};
+
+static void BM_GetChunkToDownload(benchmark::State &state) {
+    SchedulerFixture fixture(static_cast<u_int64_t>(state.range(0)), static_cast<int>(state.range(1)));
+    fixture.reset();
+    int source{0};
+    for (auto _ : state) {
+        u_int64_t chunkNo;
+        if (!fixture.scheduler->getChunkToDownload(source, chunkNo)) {
+            state.SkipWithError("No chunk to download before all were saved");
+            break;
+        }
+        /* The reset after the last chunk is not part of the measurement. */
+        try {
+            fixture.scheduler->markChunkAsDone(chunkNo, source);
+        } catch (const ChunkScheduler::AllChunksDownloaded &) {
+            state.PauseTiming();
+            fixture.reset();
+            state.ResumeTiming();
+        }
+        source = (source + 1) % fixture.sources;
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+BENCHMARK(BM_GetChunkToDownload)
+        ->Args({1024, 1})->Args({1024, 8})
+        ->Args({16 * 1024, 1})->Args({16 * 1024, 8})
+        ->Args({256 * 1024, 8});
+
+static void BM_UpdateAvailability(benchmark::State &state) {
+    SchedulerFixture fixture(static_cast<u_int64_t>(state.range(0)), 0);
+    ChunkBitmap all(fixture.chunks);
+    all.setAll();
+    for (auto _ : state) {
+        state.PauseTiming();
+        ChunkScheduler scheduler(fixture.metaDataProvider);
+        state.ResumeTiming();
+        scheduler.updateAvailability(0, all);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * fixture.chunks));
+}
+BENCHMARK(BM_UpdateAvailability)->Arg(1024)->Arg(256 * 1024);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,85 @@
+#include <benchmark/benchmark.h>
+#include <fstream>
+#include <random>
+#include <string>
+#include "Gzip.hpp"
+#include "MsgMetadata.hpp"
+
+/* Gzip::compress/decompress on a half compressible 16 MiB file at several
+   levels and buffer sizes. Bytes per second are counted on the
+   uncompressed side. */
+static const size_t INPUT_SIZE{16 * 1024 * 1024};
+static const std::string INPUT_PATH{"/tmp/microbench_gzip.bin"};
+
+static void writeInput() {
+    static bool written{false};
+    if (written)
+        return;
+    std::mt19937_64 rng(1);
+    std::ofstream out(INPUT_PATH, std::ios::binary | std::ios::trunc);
+    std::vector<char> block(4096, 'a');
+    for (size_t done = 0; done < INPUT_SIZE; done += block.size()) {
+        for (size_t i = 0; i < block.size() / 2; i += 8) {
+            const u_int64_t value = rng();
+            memcpy(block.data() + i, &value, sizeof(value));
+        }
+        out.write(block.data(), static_cast<std::streamsize>(block.size()));
+    }
+    written = true;
+}
+
+static void BM_Compress(benchmark::State &state) {
+    writeInput();
+    const int level = static_cast<int>(state.range(0));
+    const size_t bufSize = static_cast<size_t>(state.range(1));
+    for (auto _ : state)
+        Gzip::compress(INPUT_PATH, level, INPUT_PATH + ".gzip", bufSize);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * INPUT_SIZE));
+}
+BENCHMARK(BM_Compress)->ArgsProduct({{1, 6, 9}, {16 * 1024, 256 * 1024, 1024 * 1024}})
+        ->Unit(benchmark::kMillisecond);
+
+static void BM_Decompress(benchmark::State &state) {
+    writeInput();
+    const int level = static_cast<int>(state.range(0));
+    const size_t bufSize = static_cast<size_t>(state.range(1));
+    Gzip::compress(INPUT_PATH, level, INPUT_PATH + ".gzip");
+    for (auto _ : state)
+        Gzip::decompress(INPUT_PATH + ".gzip", INPUT_PATH + ".out", bufSize);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * INPUT_SIZE));
+}
+BENCHMARK(BM_Decompress)->ArgsProduct({{1, 6, 9}, {16 * 1024, 256 * 1024, 1024 * 1024}})
+        ->Unit(benchmark::kMillisecond);
+
+/* One 4 MiB chunk compressed on its own, as delta sync does. */
+static void BM_CompressBuffer(benchmark::State &state) {
+    writeInput();
+    std::vector<u_int8_t> input(CHUNK_SIZE);
+    std::ifstream(INPUT_PATH, std::ios::binary).read(reinterpret_cast<char *>(input.data()), CHUNK_SIZE);
+    const int level = static_cast<int>(state.range(0));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(Gzip::compressBuffer(input.data(), input.size(), level));
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * input.size()));
+}
+BENCHMARK(BM_CompressBuffer)->Arg(1)->Arg(6)->Arg(9)->Unit(benchmark::kMillisecond);
+
+/* The same chunk pushed through DeflateStream in `range(1)` sized pieces
+   with a full flush at the end of each chunk. */
+static void BM_DeflateStream(benchmark::State &state) {
+    writeInput();
+    std::vector<u_int8_t> input(CHUNK_SIZE);
+    std::ifstream(INPUT_PATH, std::ios::binary).read(reinterpret_cast<char *>(input.data()), CHUNK_SIZE);
+    const size_t pieceSize = static_cast<size_t>(state.range(1));
+    DeflateStream stream(static_cast<int>(state.range(0)));
+    std::vector<u_int8_t> out(CHUNK_SIZE + 1024);
+    for (auto _ : state) {
+        for (size_t offset = 0; offset < input.size(); offset += pieceSize)
+            stream.push(input.data() + offset, std::min(pieceSize, input.size() - offset));
+        stream.flush();
+        benchmark::DoNotOptimize(stream.pull(out.data(), out.size()));
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * input.size()));
+}
+BENCHMARK(BM_DeflateStream)->ArgsProduct({{1, 6}, {64 * 1024, 1024 * 1024}})->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
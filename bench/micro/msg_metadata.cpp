@@ -0,0 +1,28 @@
+#include <benchmark/benchmark.h>
+#include "MsgMetadata.hpp"
+
+static void BM_MetadataEncode(benchmark::State &state) {
+    const std::string filename(static_cast<size_t>(state.range(0)), 'f');
+    u_int8_t buf[MsgMetadata::MSG_SIZE];
+    for (auto _ : state) {
+        MsgMetadata msg(filename, 123456789);
+        msg.encode(buf);
+        benchmark::DoNotOptimize(buf);
+    }
+}
+BENCHMARK(BM_MetadataEncode)->Arg(8)->Arg(64)->Arg(255);
+
+static void BM_MetadataDecode(benchmark::State &state) {
+    const std::string filename(static_cast<size_t>(state.range(0)), 'f');
+    MsgMetadata source(filename, 123456789);
+    u_int8_t buf[MsgMetadata::MSG_SIZE];
+    source.encode(buf);
+    for (auto _ : state) {
+        MsgMetadata msg(buf);
+        benchmark::DoNotOptimize(msg.getFilesize());
+        benchmark::DoNotOptimize(msg.getFilename());
+    }
+}
+BENCHMARK(BM_MetadataDecode)->Arg(8)->Arg(64)->Arg(255);
+
+BENCHMARK_MAIN();
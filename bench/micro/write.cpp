@@ -0,0 +1,46 @@
+#include <benchmark/benchmark.h>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+#include "utils.hpp"
+
+/* tryWriteAll() of `range(0)` bytes per call into a pipe or a socketpair
+   that a second thread keeps draining. */
+static void drain(int fd) {
+    std::vector<char> buf(1024 * 1024);
+    while (read(fd, buf.data(), buf.size()) > 0) {
+    }
+}
+
+static void writeLoop(benchmark::State &state, int writeFd, int readFd) {
+    std::thread reader(drain, readFd);
+    std::vector<u_int8_t> buf(static_cast<size_t>(state.range(0)), 'x');
+    for (auto _ : state)
+        tryWriteAll(writeFd, buf.data(), buf.size());
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * buf.size()));
+    close(writeFd);
+    reader.join();
+    close(readFd);
+}
+
+static void BM_WriteAllPipe(benchmark::State &state) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        state.SkipWithError("pipe failed");
+        return;
+    }
+    writeLoop(state, fds[1], fds[0]);
+}
+BENCHMARK(BM_WriteAllPipe)->Arg(4096)->Arg(64 * 1024)->Arg(1024 * 1024);
+
+static void BM_WriteAllSocketpair(benchmark::State &state) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        state.SkipWithError("socketpair failed");
+        return;
+    }
+    writeLoop(state, fds[1], fds[0]);
+}
+BENCHMARK(BM_WriteAllSocketpair)->Arg(4096)->Arg(64 * 1024)->Arg(1024 * 1024);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,166 @@
+#!/bin/bash
+# Load test for haserver/haclient over loopback. Run through the `bench`
+# CMake target, which passes the binaries in HASERVER, HACLIENT, NETPROXY,
+# GENDATA and MEASURE. Knobs (environment):
+#   BENCH_SIZE_MB          input size in MiB (default 256)
+#   BENCH_COMPRESSIBILITY  0..1, share of the input gzip can squeeze (default 0.5)
+#   BENCH_SERVERS          number of haserver instances (default 1)
+#   BENCH_DELAY_MS, BENCH_JITTER_MS, BENCH_LOSS
+#                          when any is set, a second run goes through bench_netproxy
+#   BENCH_SERVER_ARGS, BENCH_CLIENT_ARGS
+#                          extra options, e.g. "--io=mmap" or "--log-level=warn"
+#   BENCH_SOCKET_ARGS      socket options for both sides, e.g. "--bdp=100M:40 --cork=1"
+#   BENCH_LABEL            prefix of the scenario name in the report and results.csv
+#   BENCH_PORT             first port to use (default 19000)
+# Every run appends one line to results.csv in the work directory.
+set -eu
+
+WORK=$1
+SIZE_MB=${BENCH_SIZE_MB:-256}
+COMPRESSIBILITY=${BENCH_COMPRESSIBILITY:-0.5}
+SERVERS=${BENCH_SERVERS:-1}
+DELAY_MS=${BENCH_DELAY_MS:-0}
+JITTER_MS=${BENCH_JITTER_MS:-0}
+LOSS=${BENCH_LOSS:-0}
+SERVER_ARGS=${BENCH_SERVER_ARGS:-}
+CLIENT_ARGS=${BENCH_CLIENT_ARGS:-}
+SOCKET_ARGS=${BENCH_SOCKET_ARGS:-}
+LABEL=${BENCH_LABEL:+$BENCH_LABEL }
+PORT=${BENCH_PORT:-19000}
+
+mkdir -p "$WORK"
+cd "$WORK"
+
+input=input-${SIZE_MB}m-c${COMPRESSIBILITY}.bin
+if [ ! -f "$input" ]; then
+    echo "Generating $input"
+    "$GENDATA" "$input" "$SIZE_MB" "$COMPRESSIBILITY"
+fi
+
+pids=()
+stop_all() {
+    for pid in "${pids[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    pids=()
+}
+trap stop_all EXIT
+
+# wait_for_port <port> <pid> <seconds>: until a socket listens on the port.
+# Looks it up in /proc/net instead of connecting, which would count as a
+# client of the server or the proxy's first connection. Gives up early if
+# the process exits; haserver only listens once its data is prepared.
+wait_for_port() {
+    local i hex
+    hex=$(printf '%04X' "$1")
+    for ((i = 0; i < $3 * 10; ++i)); do
+        grep -qE ":$hex [0-9A-F]+:[0-9A-F]{4} 0A " /proc/net/tcp /proc/net/tcp6 2>/dev/null && return 0
+        if ! kill -0 "$2" 2>/dev/null; then
+            echo "Process $2 exited before listening on port $1" >&2
+            return 1
+        fi
+        sleep 0.1
+    done
+    echo "Timed out waiting for port $1" >&2
+    return 1
+}
+
+# value <file> <key>
+value() {
+    sed -n "s/^$2=//p" "$1" | tail -1
+}
+
+# phase_ms <log> <phase>
+phase_ms() {
+    local ms
+    ms=$(sed -n "s/.*Phase $2 took \([0-9]*\) ms.*/\1/p" "$1" | tail -1)
+    echo "${ms:--}"
+}
+
+# run <scenario> <proxied 0|1>
+run() {
+    local scenario="$LABEL$1" proxied=$2 i targets=()
+    rm -f "$input.gzip" ./*.rusage ./*.log
+    echo
+    echo "== $scenario: ${SIZE_MB} MiB, compressibility $COMPRESSIBILITY, $SERVERS server(s)"
+
+    # The first server compresses the input; the others reuse its artifact.
+    for ((i = 0; i < SERVERS; ++i)); do
+        "$MEASURE" "server$i.rusage" -- "$HASERVER" "$input" $((PORT + i)) --stats-interval=0 $SERVER_ARGS $SOCKET_ARGS \
+            > "server$i.log" 2>&1 &
+        pids+=($!)
+        wait_for_port $((PORT + i)) $! 3600
+        targets+=("127.0.0.1:$((PORT + i))")
+    done
+
+    if [ "$proxied" = 1 ]; then
+        targets=()
+        for ((i = 0; i < SERVERS; ++i)); do
+            "$NETPROXY" $((PORT + 100 + i)) "127.0.0.1:$((PORT + i))" --delay-ms="$DELAY_MS" \
+                --jitter-ms="$JITTER_MS" --loss="$LOSS" > "proxy$i.log" 2>&1 &
+            pids+=($!)
+            wait_for_port $((PORT + 100 + i)) $! 10
+            targets+=("127.0.0.1:$((PORT + 100 + i))")
+        done
+    fi
+
+    rm -rf client
+    mkdir client
+    (cd client && "$MEASURE" ../client.rusage -- "$HACLIENT" --stats-interval=0 $CLIENT_ARGS $SOCKET_ARGS "${targets[@]}" \
+        > ../client.log 2>&1) || true
+    stop_all
+
+    local status=FAILED
+    if cmp -s "client/$input" "$input"; then
+        status=OK
+    fi
+
+    local raw_bytes gz_bytes wall_ms client_cpu_ms server_cpu_ms=0 server_rss_kb=0 download_ms
+    raw_bytes=$(stat -c %s "$input")
+    gz_bytes=0  # no artifact with --on-demand or when sent uncompressed
+    [ -f "$input.gzip" ] && gz_bytes=$(stat -c %s "$input.gzip")
+    wall_ms=$(value client.rusage wall_ms)
+    client_cpu_ms=$(($(value client.rusage user_ms) + $(value client.rusage sys_ms)))
+    for ((i = 0; i < SERVERS; ++i)); do
+        server_cpu_ms=$((server_cpu_ms + $(value "server$i.rusage" user_ms) + $(value "server$i.rusage" sys_ms)))
+        server_rss_kb=$(( $(value "server$i.rusage" max_rss_kb) > server_rss_kb ?
+                          $(value "server$i.rusage" max_rss_kb) : server_rss_kb ))
+    done
+    download_ms=$(phase_ms client.log download)
+
+    awk -v raw="$raw_bytes" -v gz="$gz_bytes" -v wall="$wall_ms" -v dl="$download_ms" \
+        -v ccpu="$client_cpu_ms" -v scpu="$server_cpu_ms" \
+        -v crss="$(value client.rusage max_rss_kb)" -v srss="$server_rss_kb" \
+        -v compress="$(phase_ms server0.log compress)" -v finish="$(phase_ms client.log finish)" \
+        -v status="$status" 'BEGIN {
+        gb = raw / (1024 * 1024 * 1024)
+        printf "  result           %s\n", status
+        if (gz > 0)
+            printf "  compressed       %.1f MiB (%.0f%% of input)\n", gz / 1048576, 100 * gz / raw
+        else
+            printf "  compressed       no artifact (on demand or stored)\n"
+        printf "  client wall      %d ms, %.1f MiB/s of input\n", wall, raw / 1048576 / (wall / 1000)
+        if (dl != "-" && dl > 0 && gz > 0)
+            printf "  download         %d ms, %.1f MiB/s on the wire\n", dl, gz / 1048576 / (dl / 1000)
+        printf "  client cpu       %.2f s/GiB, peak rss %.1f MiB\n", ccpu / 1000 / gb, crss / 1024
+        printf "  server cpu       %.2f s/GiB (incl. compress), peak rss %.1f MiB\n", scpu / 1000 / gb, srss / 1024
+        printf "  phases (ms)      compress %s, download %s, finish %s\n", compress, dl, finish
+    }'
+
+    if [ ! -f results.csv ]; then
+        echo "date,scenario,size_mb,compressibility,servers,delay_ms,loss,status,wall_ms,download_ms,client_cpu_ms,server_cpu_ms,client_rss_kb,server_rss_kb,compress_ms,finish_ms" \
+            > results.csv
+    fi
+    echo "$(date +%FT%T),$scenario,$SIZE_MB,$COMPRESSIBILITY,$SERVERS,$DELAY_MS,$LOSS,$status,$wall_ms,$download_ms,$client_cpu_ms,$server_cpu_ms,$(value client.rusage max_rss_kb),$server_rss_kb,$(phase_ms server0.log compress),$(phase_ms client.log finish)" \
+        >> results.csv
+    rm -rf client "$input.gzip"
+    [ "$status" = OK ]
+}
+
+run loopback 0
+if [ "$DELAY_MS" != 0 ] || [ "$JITTER_MS" != 0 ] || [ "$LOSS" != 0 ]; then
+    run "netproxy delay=${DELAY_MS}ms jitter=${JITTER_MS}ms loss=$LOSS" 1
+fi
+echo
+echo "Results appended to $WORK/results.csv"
@@ -0,0 +1,186 @@
+#!/bin/bash
+# Fault scenarios: haclient against several haservers, each behind its own
+# bench_netproxy running a fault script (see NetProxy::Fault). Every
+# connection is capped at BENCH_FAULT_RATE so a download lasts long enough
+# for the faults to land; a scenario's script lines follow that cap. Run
+# through the `bench-faults` CMake target, which passes the binaries like
+# the `bench` target. Knobs (environment):
+#   BENCH_SIZE_MB          input size in MiB (default 48)
+#   BENCH_SERVERS          number of servers and proxies (default 3)
+#   BENCH_FAULT_RATE       per-connection bandwidth cap (default 8M)
+#   BENCH_SCENARIOS        scenarios to run, space separated (default all)
+#   BENCH_SERVER_ARGS, BENCH_CLIENT_ARGS
+#                          extra options, e.g. "--on-demand"
+#   BENCH_PORT             first port to use (default 19500)
+#   BENCH_MAX_SLOWDOWN     a scenario may take this many times the baseline's
+#                          wall time (default 2)
+#   BENCH_MAX_WASTED_PCT   and waste this share of the input more than the
+#                          baseline did, in percent (default 30)
+# Reports completion time and wasted bytes (received, then thrown away:
+# aborted chunks and duplicates) per scenario and appends them to
+# faults.csv in the work directory. The baseline always runs first; a
+# scenario fails (FAILED, SLOW or WASTE) if its download fails or it
+# exceeds the limits above.
+set -eu
+
+WORK=$1
+SIZE_MB=${BENCH_SIZE_MB:-48}
+SERVERS=${BENCH_SERVERS:-3}
+RATE=${BENCH_FAULT_RATE:-8M}
+SERVER_ARGS=${BENCH_SERVER_ARGS:-}
+CLIENT_ARGS=${BENCH_CLIENT_ARGS:-}
+PORT=${BENCH_PORT:-19500}
+MAX_SLOWDOWN=${BENCH_MAX_SLOWDOWN:-2}
+MAX_WASTED_PCT=${BENCH_MAX_WASTED_PCT:-30}
+
+# scenario_script <scenario> <proxy index>: the script lines after the cap.
+scenario_script() {
+    case "$1" in
+        baseline) ;;
+        latency)
+            [ "$2" = 0 ] && echo "* 0ms delay 50" ;;
+        slow-server)
+            [ "$2" = 0 ] && echo "* 0ms rate 1M" ;;
+        disconnect)
+            # Half way into the connection's second chunk.
+            [ "$2" = 0 ] && echo "* 6M disconnect" ;;
+        freeze)
+            [ "$2" = 0 ] && echo "* 500ms freeze" ;;
+        freeze-thaw)
+            [ "$2" = 0 ] && printf '%s\n' "* 500ms freeze" "* 1500ms thaw" ;;
+        pause-all)
+            # Shorter than the client's timeout for a silent download.
+            printf '%s\n' "* 500ms freeze" "* 1500ms thaw" ;;
+        *)
+            echo "Unknown scenario: $1" >&2
+            return 1 ;;
+    esac
+    return 0
+}
+SCENARIOS=${BENCH_SCENARIOS:-"latency slow-server disconnect freeze freeze-thaw pause-all"}
+SCENARIOS="baseline ${SCENARIOS//baseline/}"
+
+mkdir -p "$WORK"
+cd "$WORK"
+
+input=input-${SIZE_MB}m-c0.bin
+if [ ! -f "$input" ]; then
+    echo "Generating $input"
+    "$GENDATA" "$input" "$SIZE_MB" 0
+fi
+
+pids=()
+stop_all() {
+    for pid in "${pids[@]}"; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    pids=()
+}
+trap stop_all EXIT
+
+# wait_for_port <port> <pid> <seconds>: until a socket listens on the port.
+# Looks it up in /proc/net instead of connecting, which would count as a
+# client of the server or the proxy's first connection. Gives up early if
+# the process exits; haserver only listens once its data is prepared.
+wait_for_port() {
+    local i hex
+    hex=$(printf '%04X' "$1")
+    for ((i = 0; i < $3 * 10; ++i)); do
+        grep -qE ":$hex [0-9A-F]+:[0-9A-F]{4} 0A " /proc/net/tcp /proc/net/tcp6 2>/dev/null && return 0
+        if ! kill -0 "$2" 2>/dev/null; then
+            echo "Process $2 exited before listening on port $1" >&2
+            return 1
+        fi
+        sleep 0.1
+    done
+    echo "Timed out waiting for port $1" >&2
+    return 1
+}
+
+# value <file> <key>
+value() {
+    sed -n "s/^$2=//p" "$1" | tail -1
+}
+
+# judge <wall_ms> <wasted bytes>: OK, SLOW or WASTE against the baseline.
+baseline_wall=
+baseline_wasted=
+judge() {
+    awk -v wall="$1" -v wasted="$2" -v base_wall="$baseline_wall" -v base_wasted="$baseline_wasted" \
+        -v max_slowdown="$MAX_SLOWDOWN" -v max_wasted="$MAX_WASTED_PCT" -v raw="$(stat -c %s "$input")" 'BEGIN {
+        if (base_wall == "")
+            print "OK"
+        else if (wall > base_wall * max_slowdown)
+            print "SLOW"
+        else if (wasted - base_wasted > raw * max_wasted / 100)
+            print "WASTE"
+        else
+            print "OK"
+    }'
+}
+
+# run <scenario>
+run() {
+    local scenario=$1 i targets=()
+    rm -f "$input.gzip" ./*.rusage ./*.log ./*.faults
+    for ((i = 0; i < SERVERS; ++i)); do
+        { echo "* 0ms rate $RATE"; scenario_script "$scenario" "$i"; } > "proxy$i.faults"
+        "$HASERVER" "$input" $((PORT + i)) --stats-interval=0 $SERVER_ARGS > "server$i.log" 2>&1 &
+        pids+=($!)
+        wait_for_port $((PORT + i)) $! 3600
+        "$NETPROXY" $((PORT + 100 + i)) "127.0.0.1:$((PORT + i))" --script="proxy$i.faults" > "proxy$i.log" 2>&1 &
+        pids+=($!)
+        wait_for_port $((PORT + 100 + i)) $! 10
+        targets+=("127.0.0.1:$((PORT + 100 + i))")
+    done
+
+    rm -rf client
+    mkdir client
+    (cd client && "$MEASURE" ../client.rusage -- "$HACLIENT" --stats-interval=0 $CLIENT_ARGS "${targets[@]}" \
+        > ../client.log 2>&1) || true
+    stop_all
+
+    local status=FAILED received=- wasted=- download_ms wall
+    # "All chunks are downloaded: <received> bytes received, <wasted> wasted"
+    read -r received wasted < <(sed -n 's/.*All chunks are downloaded: \([0-9]*\) bytes received, \([0-9]*\) wasted.*/\1 \2/p' \
+        client.log | tail -1) || true
+    download_ms=$(sed -n 's/.*Phase download took \([0-9]*\) ms.*/\1/p' client.log | tail -1)
+    wall=$(value client.rusage wall_ms)
+    if cmp -s "client/$input" "$input"; then
+        status=$(judge "$wall" "${wasted:-0}")
+        if [ "$scenario" = baseline ]; then
+            baseline_wall=$wall
+            baseline_wasted=${wasted:-0}
+        fi
+    fi
+
+    awk -v name="$scenario" -v status="$status" -v wall="$wall" \
+        -v dl="${download_ms:--}" -v raw="$(stat -c %s "$input")" -v received="${received:--}" \
+        -v wasted="${wasted:--}" 'BEGIN {
+        if (wasted == "-")
+            printf "  %-12s %-6s %8s %8s %10s %10s\n", name, status, wall, dl, "-", "-"
+        else
+            printf "  %-12s %-6s %8s %8s %10.1f %6.1f %5.1f%%\n", name, status, wall, dl,
+                   received / 1048576, wasted / 1048576, 100 * wasted / raw
+    }'
+
+    if [ ! -f faults.csv ]; then
+        echo "date,scenario,size_mb,servers,rate,status,wall_ms,download_ms,received_bytes,wasted_bytes" > faults.csv
+    fi
+    echo "$(date +%FT%T),$scenario,$SIZE_MB,$SERVERS,$RATE,$status,$wall,${download_ms:--},${received:--},${wasted:--}" \
+        >> faults.csv
+    if [ "$status" != OK ]; then
+        sed 's/^/    /' client.log | grep -E " [EW] " | tail -3
+    fi
+    rm -rf client
+    [ "$status" = OK ]
+}
+
+echo "${SIZE_MB} MiB, $SERVERS server(s) behind proxies capped at $RATE/s each"
+printf "  %-12s %-6s %8s %8s %10s %6s %6s\n" scenario status wall_ms dl_ms recv_MiB wasted "%"
+failed=0
+for scenario in $SCENARIOS; do
+    run "$scenario" || failed=1
+done
+exit $failed
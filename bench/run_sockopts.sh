@@ -0,0 +1,39 @@
+#!/bin/bash
+# Runs run_bench.sh once per socket option set over an emulated long link,
+# so the effect of each option shows up side by side in results.csv. Same
+# environment as run_bench.sh; BENCH_DELAY_MS (one way) defaults to 25 here,
+# and BENCH_SOCKOPT_SETS can replace the list below ("label=options;...").
+# The link is emulated with netem on the loopback device, so client and
+# servers talk directly and their socket buffers bound the window. That
+# needs root and sch_netem, and delays all loopback traffic while it runs;
+# BENCH_NETEM=0 opts out. Without it the runs go through bench_netproxy,
+# which relays in user space and hides the endpoints' windows: buffer
+# sizing then shows no effect.
+set -eu
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+DELAY_MS=${BENCH_DELAY_MS:-25}
+SETS=${BENCH_SOCKOPT_SETS:-"default=;no-nodelay=--nodelay=0;cork=--cork=1;small-buffers=--sndbuf=64K --rcvbuf=64K;bdp=--bdp=200M:$((2 * DELAY_MS));bbr=--congestion=bbr;busy-poll=--busy-poll=50"}
+
+# run_bench.sh runs over plain loopback first, then through the proxy if a
+# delay is set.
+runs=2
+if [ "${BENCH_NETEM:-1}" != 0 ] && tc qdisc add dev lo root netem delay "${DELAY_MS}ms" 2>/dev/null; then
+    trap 'tc qdisc del dev lo root netem' EXIT
+    echo "Loopback delayed by ${DELAY_MS} ms each way with netem"
+    export BENCH_DELAY_MS=0
+    runs=1
+else
+    echo "netem is not available, going through bench_netproxy: buffer sizes will show no effect" >&2
+    export BENCH_DELAY_MS=$DELAY_MS
+fi
+
+IFS=';' read -ra sets <<< "$SETS"
+status=0
+for set in "${sets[@]}"; do
+    BENCH_LABEL="[${set%%=*}]" BENCH_SOCKET_ARGS="${set#*=}" bash "$HERE/run_bench.sh" "$1" || status=1
+done
+echo
+echo "Last runs (scenario, status, wall ms, download ms):"
+tail -n $((${#sets[@]} * runs)) "$1/results.csv" | awk -F, '{ printf "  %-45s %-6s %8s %8s\n", $2, $8, $9, $10 }'
+exit $status
@@ -0,0 +1,241 @@
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ChunkAssembler.hpp"
+#include "ChunkScheduler.hpp"
+#include "ChunkStore.hpp"
+#include "DiskWriter.hpp"
+#include "Gzip.hpp"
+#include "MetaDataProvider.hpp"
+#include "MsgAvailability.hpp"
+#include "MsgMetadata.hpp"
+#include "MsgRequest.hpp"
+#include "Worker.hpp"
+
+/* Counts heap allocations on the per-chunk path in steady state: metadata
+   encode/decode, the request word, scheduling, creating, writing, closing
+   and marking a chunk done on the client, and acquiring and reading a chunk
+   on the server. Then a Worker downloads a BLOCKS file from a local server
+   thread, with ChunkAssembler inflating the blocks as they are saved.
+   Exits non-zero if any allocation happens after warm-up. Runs in a
+   scratch directory under /tmp. */
+static std::atomic<bool> counting{false};
+static std::atomic<u_int64_t> allocations{0};
+
+void *operator new(size_t size) {
+    if (counting.load(std::memory_order_relaxed))
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = malloc(size == 0 ? 1 : size))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+/* Once inlined into a delete expression, GCC sees free() paired with the
+   replaced operator new and reports a mismatch; both go through malloc. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+#pragma GCC diagnostic pop
+
+static const u_int64_t CHUNKS{4096};
+static const u_int64_t WARMUP_CHUNKS{64};
+static const u_int64_t MEASURED_CHUNKS{1024};
+static const int SOURCES{2};
+
+struct Pipeline {
+    Pipeline() : scheduler(metaDataProvider), diskWriter(metaDataProvider, scheduler) {
+        metaDataProvider.setMetaData("file", CHUNKS * CHUNK_SIZE);
+        ChunkBitmap all(CHUNKS);
+        all.setAll();
+        for (int source = 0; source < SOURCES; ++source)
+            scheduler.updateAvailability(source, all);
+    }
+
+    void chunk(int source, ChunkStore &store) {
+        MsgMetadata metadata("file", CHUNKS * CHUNK_SIZE, MsgMetadata::BLOCKS);
+        metadata.encode(metadataBuf);
+        MsgMetadata decoded(metadataBuf);
+        if (decoded.getFilesize() != metadata.getFilesize())
+            throw std::logic_error("metadata round trip failed");
+
+        u_int64_t chunkNo;
+        if (!scheduler.getChunkToDownload(source, chunkNo))
+            throw std::logic_error("scheduler ran dry");
+        volatile u_int64_t request = MsgRequest::make(MsgRequest::RAW_CHUNK, chunkNo);
+        (void) request;
+
+        ChunkSource::ChunkRef ref = store.acquire(chunkNo % 2);
+        size_t len = sizeof(scratch);
+        const u_int8_t *bytes = store.bytes(ref, 0, len, scratch);
+
+        const int fd = diskWriter.createFileFd(source, chunkNo);
+        diskWriter.writeBuf(fd, const_cast<u_int8_t *>(bytes), 16);
+        diskWriter.closeChunk(fd);
+    }
+
+    MetaDataProvider metaDataProvider;
+    ChunkScheduler scheduler;
+    DiskWriter diskWriter;
+    u_int8_t metadataBuf[MsgMetadata::MSG_SIZE];
+    u_int8_t scratch[8192];
+};
+
+static const u_int64_t DOWNLOAD_WARMUP_CHUNKS{8};
+static const u_int64_t DOWNLOAD_MEASURED_CHUNKS{32};
+static const u_int64_t DOWNLOAD_CHUNKS{DOWNLOAD_WARMUP_CHUNKS + DOWNLOAD_MEASURED_CHUNKS};
+
+static void readAll(int sock, void *buf, size_t len) {
+    if (recv(sock, buf, len, MSG_WAITALL) != static_cast<ssize_t>(len))
+        throw std::runtime_error("Connection closed");
+}
+
+/* One connection of a server for a BLOCKS file whose blocks are all the
+   compressed block in "block", read through a ChunkStore. */
+static void serveBlocks(int listenFd, u_int64_t blockSize) {
+    int sock = accept(listenFd, nullptr, nullptr);
+    if (sock == -1)
+        return;
+    try {
+        u_int8_t metadata[MsgMetadata::MSG_SIZE];
+        MsgMetadata("file", DOWNLOAD_CHUNKS * CHUNK_SIZE, MsgMetadata::BLOCKS).encode(metadata);
+        tryWriteAll(sock, metadata, sizeof(metadata));
+
+        u_int64_t request;
+        readAll(sock, &request, sizeof(request));
+        ChunkBitmap all(DOWNLOAD_CHUNKS);
+        all.setAll();
+        std::vector<u_int8_t> reply;
+        MsgAvailability::encode(AvailabilityLog::of(all), 0, reply);
+        tryWriteAll(sock, reply.data(), reply.size());
+
+        ChunkStore store("block", blockSize, ChunkStore::Mode::READ, 0);
+        u_int8_t scratch[8192];
+        while (recv(sock, &request, sizeof(request), MSG_WAITALL) == sizeof(request)) {
+            ChunkSource::ChunkRef ref = store.acquire(0);
+            tryWriteAll(sock, &ref.size, sizeof(ref.size));
+            for (u_int64_t offset = 0; offset < ref.size;) {
+                size_t len = sizeof(scratch);
+                const u_int8_t *bytes = store.bytes(ref, offset, len, scratch);
+                tryWriteAll(sock, bytes, len);
+                offset += len;
+            }
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Server: " << e.what() << std::endl;
+    }
+    close(sock);
+}
+
+/* Allocations while the Worker downloads the measured chunks and the
+   assembler writes them out. */
+static u_int64_t countDownload() {
+    {
+        std::vector<u_int8_t> raw(CHUNK_SIZE, 'b');
+        std::vector<u_int8_t> block = Gzip::compressBuffer(raw.data(), raw.size());
+        int fd = open("block", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+        tryWriteAll(fd, block.data(), block.size());
+        tryClose(fd, "Cannot close block");
+    }
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    if (listenFd == -1 || bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        listen(listenFd, 1) != 0 || getsockname(listenFd, reinterpret_cast<sockaddr *>(&addr), &addrLen) != 0)
+        throw std::runtime_error("Cannot listen on the loopback interface");
+    std::thread server(serveBlocks, listenFd, getFileSize("block"));
+
+    u_int64_t before{0};
+    u_int64_t after{0};
+    {
+        int epfd = epoll_create1(0);
+        MetaDataProvider metaDataProvider;
+        ChunkScheduler scheduler(metaDataProvider);
+        DiskWriter diskWriter(metaDataProvider, scheduler);
+        ChunkAssembler assembler(scheduler.getSavedChunks());
+        u_int64_t saved{0};
+        scheduler.addChunkDoneListener([&](u_int64_t chunkNo) {
+            if (!assembler.isStarted()) {
+                ChunkAssembler::Plan plan;
+                plan.mode = ChunkAssembler::Mode::BLOCKS;
+                plan.outPath = "output";
+                plan.rawSize = metaDataProvider.getFilesize();
+                assembler.start(plan);
+            }
+            assembler.chunkSaved(chunkNo);
+            if (++saved == DOWNLOAD_WARMUP_CHUNKS) {
+                while (assembler.getAssembled() < DOWNLOAD_WARMUP_CHUNKS)
+                    std::this_thread::yield();
+                before = allocations.load();
+                counting = true;
+            }
+        });
+
+        Worker worker(epfd, "127.0.0.1", std::to_string(ntohs(addr.sin_port)), scheduler,
+                      metaDataProvider, diskWriter, SocketOptions());
+        try {
+            while (true) {
+                epoll_event event{};
+                if (epoll_wait(epfd, &event, 1, -1) == 1)
+                    worker.notify();
+            }
+        } catch (const ChunkScheduler::AllChunksDownloaded &) {
+        }
+        while (assembler.getAssembled() < DOWNLOAD_CHUNKS)
+            std::this_thread::yield();
+        counting = false;
+        after = allocations.load();
+        assembler.finish();
+        tryClose(epfd, "Cannot close epfd");
+    }
+    server.join();
+    tryClose(listenFd, "Cannot close the listening socket");
+    return after - before;
+}
+
+int main() {
+    char dir[] = "/tmp/bench_allocsXXXXXX";
+    if (mkdtemp(dir) == nullptr || chdir(dir) != 0) {
+        std::cerr << "Cannot create a scratch directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+    {
+        std::vector<u_int8_t> artifact(2 * CHUNK_SIZE, 'a');
+        int fd = open("artifact", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+        tryWriteAll(fd, artifact.data(), artifact.size());
+        tryClose(fd, "Cannot close artifact");
+    }
+
+    u_int64_t measured;
+    {
+        ChunkStore store("artifact", 2 * CHUNK_SIZE, ChunkStore::Mode::READ, 0);
+        Pipeline pipeline;
+        for (u_int64_t i = 0; i < WARMUP_CHUNKS; ++i)
+            pipeline.chunk(static_cast<int>(i % SOURCES), store);
+
+        counting = true;
+        for (u_int64_t i = 0; i < MEASURED_CHUNKS; ++i)
+            pipeline.chunk(static_cast<int>(i % SOURCES), store);
+        counting = false;
+        measured = allocations.load();
+    }
+    std::cout << measured << " allocations in " << MEASURED_CHUNKS << " chunks ("
+              << static_cast<double>(measured) / MEASURED_CHUNKS << " per chunk)" << std::endl;
+
+    const u_int64_t downloaded = countDownload();
+    removeRecursively(dir);
+    std::cout << downloaded << " allocations in " << DOWNLOAD_MEASURED_CHUNKS << " downloaded chunks ("
+              << static_cast<double>(downloaded) / DOWNLOAD_MEASURED_CHUNKS << " per chunk)" << std::endl;
+    return measured == 0 && downloaded == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,45 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+/* Writes a synthetic input file of <size MiB> whose gzip ratio roughly
+   follows <compressibility>: that share of every 4 KiB block is repetitive
+   text, the rest random bytes. */
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        std::cout << "Usage: " << argv[0] << " <path> <size MiB> <compressibility 0..1>" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const std::string path(argv[1]);
+    const unsigned long long size = std::stoull(argv[2]) * 1024 * 1024;
+    const double compressibility = std::stod(argv[3]);
+
+    const size_t BLOCK_SIZE{4096};
+    const size_t randomBytes = static_cast<size_t>(BLOCK_SIZE * (1.0 - std::min(std::max(compressibility, 0.0), 1.0)));
+    const std::string text = "timestamp=2024-01-01T00:00:00Z level=info msg=\"chunk transferred\" bytes=4194304\n";
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "Cannot open " << path << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::mt19937_64 rng(1);
+    std::vector<char> block(BLOCK_SIZE);
+    for (unsigned long long written = 0; written < size; written += BLOCK_SIZE) {
+        size_t i = 0;
+        for (; i + 8 <= randomBytes; i += 8) {
+            const u_int64_t value = rng();
+            std::copy(reinterpret_cast<const char *>(&value), reinterpret_cast<const char *>(&value) + 8,
+                      block.begin() + static_cast<long>(i));
+        }
+        for (size_t j = 0; i < BLOCK_SIZE; ++i, ++j)
+            block[i] = text[j % text.size()];
+        const size_t len = static_cast<size_t>(std::min<unsigned long long>(BLOCK_SIZE, size - written));
+        out.write(block.data(), static_cast<std::streamsize>(len));
+    }
+    return out ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,60 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+
+/* Runs a command and appends its wall time, CPU time and peak RSS to a file
+   as key=value lines. SIGTERM and SIGINT are passed on to the command, so a
+   long running server can be stopped and still be measured. */
+static pid_t child{-1};
+
+int main(int argc, char **argv) {
+    if (argc < 4 || std::string(argv[2]) != "--") {
+        std::cout << "Usage: " << argv[0] << " <report file> -- <command> [args...]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    child = fork();
+    if (child == -1) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+    if (child == 0) {
+        execvp(argv[3], argv + 3);
+        perror("execvp");
+        _exit(127);
+    }
+
+    struct sigaction action{};
+    action.sa_handler = [](int signo) { kill(child, signo); };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGINT, &action, nullptr);
+
+    int status{0};
+    rusage usage{};
+    while (wait4(child, &status, 0, &usage) == -1) {
+        if (errno != EINTR) {
+            perror("wait4");
+            return EXIT_FAILURE;
+        }
+    }
+    const auto wallMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    std::ofstream report(argv[1], std::ios::app);
+    report << "wall_ms=" << wallMs << std::endl
+           << "user_ms=" << usage.ru_utime.tv_sec * 1000 + usage.ru_utime.tv_usec / 1000 << std::endl
+           << "sys_ms=" << usage.ru_stime.tv_sec * 1000 + usage.ru_stime.tv_usec / 1000 << std::endl
+           << "max_rss_kb=" << usage.ru_maxrss << std::endl
+           << "exit=" << (WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status)) << std::endl;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
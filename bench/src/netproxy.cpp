@@ -0,0 +1,60 @@
+#include <iostream>
+#include "NetProxy.hpp"
+
+static void printUsage(const char *name) {
+    std::cout << "Usage: " << name << " [options] <listen port> <upstream host>:<port>" << std::endl
+              << "Options:" << std::endl
+              << "  --delay-ms=<ms>   one-way delay added in both directions (default 0)" << std::endl
+              << "  --jitter-ms=<ms>  random extra delay up to <ms> (default 0)" << std::endl
+              << "  --loss=<0..1>     share of reads held back one retransmission timeout (default 0)" << std::endl
+              << "  --rto-ms=<ms>     retransmission timeout used for --loss (default 200)" << std::endl
+              << "  --script=<file>   faults for single connections, one per line:" << std::endl
+              << "                    <connection|*> <n>ms|<bytes> delay <ms>|rate <bytes/s>|freeze|thaw|disconnect" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    NetProxy::Options options;
+    std::string scriptPath;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        std::string value;
+        if (arg.compare(0, 2, "--") != 0)
+            positional.push_back(arg);
+        else if (matchOption(arg, "delay-ms", value))
+            options.delayMs = static_cast<unsigned>(std::stoul(value));
+        else if (matchOption(arg, "jitter-ms", value))
+            options.jitterMs = static_cast<unsigned>(std::stoul(value));
+        else if (matchOption(arg, "loss", value))
+            options.loss = std::stod(value);
+        else if (matchOption(arg, "rto-ms", value))
+            options.rtoMs = static_cast<unsigned>(std::stoul(value));
+        else if (matchOption(arg, "script", value))
+            scriptPath = value;
+        else {
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (positional.size() != 2 || positional[1].find(':') == std::string::npos) {
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    options.listenPort = positional[0];
+    const size_t colon = positional[1].find_last_of(':');
+    options.upstreamHost = positional[1].substr(0, colon);
+    options.upstreamPort = positional[1].substr(colon + 1);
+
+    try {
+        if (!scriptPath.empty())
+            options.faults = NetProxy::loadScript(scriptPath);
+        NetProxy proxy(options);
+        LOG_INFO("Proxying port %s to %s (delay %u ms, jitter %u ms, loss %.3f, %zu scripted faults)",
+                 options.listenPort.c_str(), positional[1].c_str(), options.delayMs, options.jitterMs,
+                 options.loss, options.faults.size());
+        proxy.run();
+    } catch (const std::exception &e) {
+        LOG_ERROR("%s", e.what());
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ChunkMerger.hpp"
+#include "DeltaSync.hpp"
+#include "Gzip.hpp"
+#include "Log.hpp"
+#include "MsgManifest.hpp"
+#include "OutputFile.hpp"
+#include "SavedChunks.hpp"
+#include "TreeUnpacker.hpp"
+#include "utils.hpp"
+
+/* Builds the output from the saved chunks while the download is running.
+   A background thread takes the chunks in file order as soon as each one
+   is saved, copies or inflates it into the output and removes its file,
+   so when the last chunk arrives only the chunks after the first gap are
+   left to do. finish() waits for those, checks the result and makes it
+   durable with a single sync. */
+class ChunkAssembler {
+public:
+    enum class Mode {
+        /* Chunks are pieces of the file (MsgMetadata::STORED). */
+        STORED,
+        /* Chunks are pieces of one zlib stream of the file. */
+        STREAM,
+        /* Every chunk is a compressed block (MsgMetadata::BLOCKS). */
+        BLOCKS,
+        /* Blocks, the unchanged ones taken from the old copy. */
+        DELTA
+    };
+
+    struct Plan {
+        Mode mode{Mode::STREAM};
+        /* The file, or the directory a tree is unpacked into. */
+        std::string outPath;
+        /* Size of the output, unknown for STREAM. */
+        u_int64_t rawSize{OutputFile::UNKNOWN_SIZE};
+        /* Set for a tree (MsgMetadata::TREE). */
+        const std::vector<MsgManifest::Entry> *tree{nullptr};
+        DeltaSync *deltaSync{nullptr};
+        /* Peers still read the chunk files, leave them in place. */
+        bool keepChunks{false};
+    };
+
+    explicit ChunkAssembler(const SavedChunks &savedChunks) : savedChunks(savedChunks) {}
+
+    ~ChunkAssembler() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            aborted = true;
+        }
+        ready.notify_one();
+        if (thread.joinable())
+            thread.join();
+    }
+
+    ChunkAssembler(const ChunkAssembler &) = delete;
+    ChunkAssembler &operator=(const ChunkAssembler &) = delete;
+
+    bool isStarted() const {
+        return thread.joinable();
+    }
+
+    /* Chunks already written to the output. */
+    u_int64_t getAssembled() const {
+        return assembled.load();
+    }
+
+    /* Call on the download thread once the chunk count is known. Chunks
+       saved before (delta sync's unchanged blocks) are picked up here. */
+    void start(const Plan &newPlan) {
+        plan = newPlan;
+        chunks = savedChunks.size();
+        sources.assign(chunks, SavedChunks::NONE);
+        for (u_int64_t chunkNo = 0; chunkNo < chunks; ++chunkNo)
+            sources[chunkNo] = savedChunks.source(chunkNo);
+        thread = std::thread(&ChunkAssembler::run, this);
+    }
+
+    /* Call on the download thread after SavedChunks has the chunk. */
+    void chunkSaved(u_int64_t chunkNo) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            sources[chunkNo] = savedChunks.source(chunkNo);
+        }
+        ready.notify_one();
+    }
+
+    /* Waits for the remaining chunks and commits the output. Throws what
+       went wrong in the background. */
+    void finish() {
+        if (!isStarted())
+            throw std::logic_error("The assembler was not started");
+        LOG_INFO("%lu of %lu chunks were assembled during the download", assembled.load(), chunks);
+        thread.join();
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    /* The chunk files in order as one stream; read() waits for chunks that
+       are not saved yet. */
+    class ChunkStream : public ByteSource {
+    public:
+        explicit ChunkStream(ChunkAssembler &assembler) : assembler(assembler) {}
+
+        ~ChunkStream() override {
+            if (fd != -1)
+                close(fd);
+        }
+
+        size_t read(u_int8_t *buf, size_t len) override {
+            while (true) {
+                if (fd == -1 && !open())
+                    return 0;
+                ssize_t rv = ::read(fd, buf, len);
+                if (rv > 0)
+                    return static_cast<size_t>(rv);
+                if (rv == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    LOG_ERROR("read: %s: %s", path, strerror(errno));
+                    throw std::runtime_error(std::string("Cannot read ") + path);
+                }
+                tryClose(fd, std::string("Cannot close ") + path);
+                fd = -1;
+                ++chunkNo;
+                assembler.consumed(path);
+            }
+        }
+
+        /* True once every chunk was read to its end. */
+        bool atEnd() {
+            u_int8_t byte;
+            return read(&byte, 1) == 0;
+        }
+
+    private:
+        bool open() {
+            int source;
+            if (chunkNo == assembler.chunks || !assembler.waitFor(chunkNo, source))
+                return false;
+            assembler.savedChunks.formatPath(path, chunkNo, source);
+            fd = ::open(path, O_RDONLY);
+            if (fd == -1) {
+                LOG_ERROR("open: %s: %s", path, strerror(errno));
+                throw std::runtime_error(std::string("Cannot open ") + path);
+            }
+            return true;
+        }
+
+        ChunkAssembler &assembler;
+        u_int64_t chunkNo{0};
+        char path[SavedChunks::PATH_SIZE];
+        int fd{-1};
+    };
+
+    void run() {
+        try {
+            if (plan.tree)
+                output = std::make_unique<TreeUnpacker>(*plan.tree, plan.outPath);
+            else
+                output = std::make_unique<OutputFile>(plan.outPath, plan.rawSize);
+
+            if (plan.mode == Mode::STORED || plan.mode == Mode::STREAM) {
+                ChunkStream stream(*this);
+                if (plan.mode == Mode::STREAM)
+                    Inflater().decompress(stream, *output);
+                else
+                    copy(stream);
+                if (!stream.atEnd())
+                    throw std::runtime_error("Data after the end of the compressed stream");
+            } else {
+                assembleBlocks();
+            }
+            if (!aborted)
+                output->commit();
+        } catch (...) {
+            if (!aborted)
+                error = std::current_exception();
+        }
+        output.reset();
+    }
+
+    /* Returns false if the assembler is being destroyed. */
+    bool waitFor(u_int64_t chunkNo, int &source) {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [&] { return aborted || sources[chunkNo] != SavedChunks::NONE; });
+        source = sources[chunkNo];
+        return !aborted;
+    }
+
+    void consumed(const char *path) {
+        if (!plan.keepChunks && path != nullptr)
+            unlink(path);
+        ++assembled;
+    }
+
+    void copy(ChunkStream &stream) {
+        std::vector<u_int8_t> buf(BUF_SIZE);
+        while (size_t n = stream.read(buf.data(), buf.size()))
+            output->write(buf.data(), n);
+    }
+
+    /* BLOCKS and DELTA: every chunk inflates to one block of the file. */
+    void assembleBlocks() {
+        std::vector<u_int8_t> block(CHUNK_SIZE);
+        std::vector<u_int8_t> compressed;
+        char path[SavedChunks::PATH_SIZE];
+        for (u_int64_t chunkNo = 0; chunkNo < chunks; ++chunkNo) {
+            int source;
+            if (!waitFor(chunkNo, source))
+                return;
+            const u_int64_t len = getSizeOfChunk(plan.rawSize, chunkNo, CHUNK_SIZE);
+            if (source == SavedChunks::BASE) {
+                plan.deltaSync->readBaseBlock(chunkNo, block.data(), len);
+                output->write(block.data(), len);
+                consumed(nullptr);
+                continue;
+            }
+            savedChunks.formatPath(path, chunkNo, source);
+            ChunkMerger::inflateBlock(path, block.data(), len, compressed);
+            if (plan.deltaSync && !plan.deltaSync->verifyBlock(chunkNo, block.data(), len))
+                throw std::runtime_error("Block " + std::to_string(chunkNo) +
+                                         " does not match the server's hash");
+            output->write(block.data(), len);
+            consumed(path);
+        }
+    }
+
+    static const size_t BUF_SIZE{256 * 1024};
+
+    const SavedChunks &savedChunks;
+    Plan plan;
+    u_int64_t chunks{0};
+    std::unique_ptr<OutputSink> output;
+    std::thread thread;
+    std::exception_ptr error;
+    std::atomic<u_int64_t> assembled{0};
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    /* Copy of SavedChunks' sources shared with the assembler thread. */
+    std::vector<int> sources;
+    std::atomic<bool> aborted{false};
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "Gzip.hpp"
+#include "Log.hpp"
+#include "MsgMetadata.hpp"
+#include "SavedChunks.hpp"
+#include "utils.hpp"
+
+/* Reads back the chunk files of a file served as compressed blocks. */
+class ChunkMerger {
+public:
+    /* Inflates the block saved at `path` into the `len` bytes at `out`. A
+       block of exactly `len` bytes was sent uncompressed. */
+    static void inflateBlock(const char *path, u_int8_t *out, u_int64_t len,
+                             std::vector<u_int8_t> &compressed) {
+        int chunkFd = open(path, O_RDONLY);
+        if (chunkFd == -1)
+            throw std::runtime_error(std::string("Cannot open ") + path);
+        struct stat st{};
+        if (fstat(chunkFd, &st) != 0) {
+            close(chunkFd);
+            throw std::runtime_error(std::string("Cannot stat ") + path);
+        }
+        compressed.resize(static_cast<size_t>(st.st_size));
+        size_t readBytes{0};
+        while (readBytes < compressed.size()) {
+            ssize_t rv = read(chunkFd, compressed.data() + readBytes, compressed.size() - readBytes);
+            if (rv <= 0)
+                break;
+            readBytes += rv;
+        }
+        tryClose(chunkFd, path);
+        if (readBytes != compressed.size())
+            throw std::runtime_error(std::string("Cannot read ") + path);
+        if (compressed.size() == len)
+            memcpy(out, compressed.data(), len);
+        else
+            Gzip::decompressBuffer(compressed.data(), compressed.size(), out, len);
+    }
+};
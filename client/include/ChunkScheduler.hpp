@@ -1,8 +1,21 @@
 #pragma once
 
+#include <functional>
 #include <unordered_map>
+#include <vector>
+#include "ChunkBitmap.hpp"
 #include "MetaDataProvider.hpp"
+#include "SavedChunks.hpp"
+#include "Stats.hpp"
 
+/* Decides which chunk each worker downloads next. Every source (identified by
+   its worker's socket) reports which chunks it holds, and a worker is only
+   given chunks its source has. Among those the rarest chunk wins, so chunks
+   only a few sources hold are fetched while those sources are around; ties go
+   to the lowest chunk number. A chunk already in flight elsewhere is only
+   handed out again when the source has nothing else left.
+   All per-chunk state is index-addressed and sized once, so requesting and
+   saving a chunk does not allocate. */
 class ChunkScheduler {
 public:
     ChunkScheduler(const MetaDataProvider &metaDataProvider)
@@ -11,34 +24,193 @@ public:
     struct AllChunksDownloaded : std::exception {};
     struct NoMoreChunks : std::exception {};
 
-    void markChunkAsDone(u_int64_t chunkNo, const std::string& path) {
-        if (savedChunks.find(chunkNo) == savedChunks.end())
-            savedChunks[chunkNo] = path;
+    /* `source` is the worker socket the chunk came from, see SavedChunks. */
+    void markChunkAsDone(u_int64_t chunkNo, int source) {
+        if (savedChunks.save(chunkNo, source)) {
+            markRequested(chunkNo);
+            for (const auto &listener : chunkDoneListeners)
+                listener(chunkNo);
+        }
+        updateQueueStats();
 
-        if (savedChunks.size() == chunks)
+        if (savedChunks.count() == chunks)
             throw AllChunksDownloaded();
     }
 
-    u_int64_t getChunkToDownload() {
-        chunks = metaDataProvider.getNumberOfChunks();
-        if (savedChunks.size() > chunks)
-            throw NoMoreChunks();
+    /* Delta sync: the chunks to fetch are blocks of the uncompressed file,
+       and the unchanged ones count as saved (from the base copy) already. */
+    void useRawChunks(u_int64_t rawChunks, const ChunkBitmap &unchanged) {
+        rawMode = true;
+        resize(rawChunks);
+        for (u_int64_t chunkNo = 0; chunkNo < chunks; ++chunkNo) {
+            if (unchanged.test(chunkNo)) {
+                savedChunks.save(chunkNo, SavedChunks::BASE);
+                markRequested(chunkNo);
+            }
+        }
+        updateQueueStats();
+    }
 
-        while (true) {
-            uint64_t chunkToDownload = nextChunk++ % (chunks + 1);
-            if (savedChunks.find(chunkToDownload) == savedChunks.end()) {
-                return chunkToDownload;
+    /* Adds the chunks `source` gained to what is known about it. */
+    void updateAvailability(int source, const ChunkBitmap &gained) {
+        if (!rawMode)
+            resize(metaDataProvider.getNumberOfChunks());
+        ChunkBitmap &known = sources[source];
+        known.resize(chunks);
+        for (u_int64_t chunkNo = 0; chunkNo < chunks; ++chunkNo) {
+            if (gained.test(chunkNo) && !known.test(chunkNo)) {
+                known.set(chunkNo);
+                setHolders(chunkNo, holders[chunkNo] + 1);
             }
         }
     }
 
-    const std::unordered_map<uint64_t, std::string>& getSavedChunks() const {
+    void removeSource(int source) {
+        auto it = sources.find(source);
+        if (it == sources.end())
+            return;
+        for (u_int64_t chunkNo = 0; chunkNo < chunks; ++chunkNo)
+            if (it->second.test(chunkNo))
+                setHolders(chunkNo, holders[chunkNo] - 1);
+        sources.erase(it);
+    }
+
+    /* Picks the next chunk to fetch from `source`. Returns false when the
+       source has no chunk that is still missing. No open chunk has fewer
+       holders than the rarest bucket, so the scan stops at the first chunk
+       that rare; when all sources hold everything that is the first open
+       chunk. */
+    bool getChunkToDownload(int source, u_int64_t &chunkNo) {
+        auto it = sources.find(source);
+        if (it == sources.end())
+            return false;
+        const ChunkBitmap &known = it->second;
+
+        const u_int32_t rarest = rarestOpen();
+        u_int64_t best{chunks};
+        for (u_int64_t candidate = firstOpen; candidate < chunks; ++candidate) {
+            if (!known.test(candidate) || requested.test(candidate))
+                continue;
+            if (best == chunks || holders[candidate] < holders[best]) {
+                best = candidate;
+                if (holders[best] <= rarest)
+                    break;
+            }
+        }
+
+        if (best == chunks) {
+            /* Nothing open: duplicate the in-flight chunk fewest sources have. */
+            for (u_int64_t candidate = 0; candidate < chunks; ++candidate) {
+                if (!known.test(candidate) || savedChunks.has(candidate))
+                    continue;
+                if (best == chunks || holders[candidate] < holders[best])
+                    best = candidate;
+            }
+            if (best == chunks)
+                return false;
+            Stats::add(Counter::RETRIES);
+        } else {
+            markRequested(best);
+        }
+        Stats::add(Counter::CHUNKS_REQUESTED);
+        updateQueueStats();
+        chunkNo = best;
+        return true;
+    }
+
+    /* A chunk whose download was abandoned goes back to the queue. */
+    void releaseChunk(u_int64_t chunkNo) {
+        if (!savedChunks.has(chunkNo) && requested.test(chunkNo)) {
+            requested.clear(chunkNo);
+            --requestedCount;
+            ++openByHolders[holders[chunkNo]];
+            if (chunkNo < firstOpen)
+                firstOpen = chunkNo;
+        }
+        Stats::add(Counter::RETRIES);
+        updateQueueStats();
+    }
+
+    /* An empty file is complete once a source has described it. */
+    bool isComplete() const {
+        return sized && savedChunks.count() == chunks;
+    }
+
+    const SavedChunks &getSavedChunks() const {
         return savedChunks;
     }
 
+    /* Called with every newly saved chunk, after its file is closed. */
+    void addChunkDoneListener(std::function<void(u_int64_t)> listener) {
+        chunkDoneListeners.push_back(std::move(listener));
+    }
+
 private:
+    void resize(u_int64_t newChunks) {
+        sized = true;
+        if (newChunks == chunks)
+            return;
+        chunks = newChunks;
+        savedChunks.resize(chunks);
+        requested.resize(chunks);
+        holders.resize(chunks, 0);
+        openByHolders.assign(1, 0);
+        for (u_int64_t chunkNo = 0; chunkNo < chunks; ++chunkNo)
+            if (!requested.test(chunkNo))
+                bucket(holders[chunkNo]) += 1;
+    }
+
+    u_int64_t &bucket(u_int32_t holderCount) {
+        if (holderCount >= openByHolders.size())
+            openByHolders.resize(holderCount + 1, 0);
+        return openByHolders[holderCount];
+    }
+
+    void setHolders(u_int64_t chunkNo, u_int32_t count) {
+        if (!requested.test(chunkNo)) {
+            --bucket(holders[chunkNo]);
+            ++bucket(count);
+        }
+        holders[chunkNo] = count;
+    }
+
+    void markRequested(u_int64_t chunkNo) {
+        if (requested.test(chunkNo))
+            return;
+        requested.set(chunkNo);
+        ++requestedCount;
+        --openByHolders[holders[chunkNo]];
+        while (firstOpen < chunks && requested.test(firstOpen))
+            ++firstOpen;
+    }
+
+    /* Fewest holders of any open chunk that at least one source has. */
+    u_int32_t rarestOpen() const {
+        for (u_int32_t count = 1; count < openByHolders.size(); ++count)
+            if (openByHolders[count] != 0)
+                return count;
+        return 0;
+    }
+
+    void updateQueueStats() const {
+        Stats::set(Gauge::QUEUE_DEPTH, chunks - requestedCount);
+        Stats::set(Gauge::IN_FLIGHT, requestedCount - savedChunks.count());
+    }
+
     const MetaDataProvider &metaDataProvider;
-    std::unordered_map<uint64_t, std::string> savedChunks;
-    u_int64_t nextChunk{0};
+    SavedChunks savedChunks;
+    ChunkBitmap requested;
+    u_int64_t requestedCount{0};
+    /* Lowest chunk number that is not requested. */
+    u_int64_t firstOpen{0};
+    std::unordered_map<int, ChunkBitmap> sources;
+    /* Number of known sources holding each chunk. */
+    std::vector<u_int32_t> holders;
+    /* Number of chunks not requested yet, by holder count. */
+    std::vector<u_int64_t> openByHolders;
+    std::vector<std::function<void(u_int64_t)>> chunkDoneListeners;
     u_int64_t chunks{};
+    /* Whether `chunks` was learned from a source yet. */
+    bool sized{false};
+    bool rawMode{false};
 };
@@ -1,70 +1,77 @@
 #pragma once
 #include <iostream>
+#include <memory>
 #include <unordered_map>
+#include <vector>
+#include "ChunkAssembler.hpp"
 #include "Downloader.hpp"
-#include "Gzip.hpp"
+#include "Log.hpp"
+#include "Stats.hpp"
 #include "utils.hpp"
 
 
 class Client {
 public:
     Client(int argc, char **argv) {
-        std::cout << "Loading settings" << std::endl;
+        LOG_INFO("Loading settings");
         load_settings(argc, argv);
         try {
-            const auto& savedChunks = downloader.downloadChunks();
-            mergeChunks(savedChunks);
-            std::cout << "Chunks merged to " << MERGED_FILENAME << ". Decompressing..." << std::endl;
-            Gzip::decompress(MERGED_FILENAME, downloader.getFilename());
-            std::cout << "Done. Cleaning..." << std::endl;
+            downloadChunks();
+            if (!assembler.isStarted())
+                startAssembler();
+            {
+                PhaseTimer phase("finish");
+                assembler.finish();
+            }
+            LOG_INFO("Done. Cleaning...");
             removeRecursively("workspace");
-            removeRecursively(MERGED_FILENAME);
-            std::cout << "============================================" << std::endl;
-            std::cout << "File download completed!!!" << std::endl;
+            LOG_INFO("============================================");
+            LOG_INFO("File download completed!!!");
+            completed = true;
         } catch (const std::exception& e) {
-            std::cerr << e.what() << std::endl;
+            LOG_ERROR("%s", e.what());
         }
     }
 
-private:
-    void mergeChunks(const std::unordered_map<uint64_t, std::string> &savedChunks) {
-        int mergedFd = open(MERGED_FILENAME, O_CREAT | O_WRONLY | O_TRUNC, S_IRWXU);
-        if (mergedFd == -1) {
-            perror("open");
-            throw std::exception();
-        }
-
-        for (uint64_t chunkNo = 0; chunkNo < savedChunks.size(); ++chunkNo) {
-            int chunkFd = open(savedChunks.at(chunkNo).c_str(), O_RDONLY);
-            if (chunkFd == -1) {
-                perror("open");
-                throw std::exception();
-            }
-
-            char buf[BUF_SIZE];
-            off_t chunkSize = getFileSize(savedChunks.at(chunkNo));
+    /* False if the download or assembling the output failed. */
+    bool isCompleted() const {
+        return completed;
+    }
 
-            off_t writtenBytes = 0;
-            while (writtenBytes < chunkSize) {
-                ssize_t readBytes = read(chunkFd, buf, BUF_SIZE);
-                if (readBytes < 0) {
-                    perror("open");
-                    throw std::runtime_error("Cannot read: " + savedChunks.at(chunkNo));
-                }
+private:
+    void downloadChunks() {
+        PhaseTimer phase("download");
+        downloader.downloadChunks();
+    }
 
-                tryWriteAll(mergedFd, buf, static_cast<size_t>(readBytes));
-                writtenBytes += readBytes;
-            }
-            if (close(chunkFd)) {
-                perror("close");
-                throw std::runtime_error("Cannot close: " + savedChunks.at(chunkNo));
-            }
+    /* Called with the first saved chunk, when the layout of the download
+       is known, or after a download that needed no chunks. */
+    void startAssembler() {
+        ChunkAssembler::Plan plan;
+        plan.outPath = downloader.getFilename();
+        DeltaSync *deltaSync = downloader.getDeltaSync();
+        if (deltaSync && deltaSync->isPlanned()) {
+            plan.mode = ChunkAssembler::Mode::DELTA;
+            plan.rawSize = deltaSync->getRawSize();
+            plan.deltaSync = deltaSync;
+            LOG_INFO("Rebuilding %s from %s and the changed blocks", plan.outPath.c_str(), basePath.c_str());
+        } else if (downloader.isStored()) {
+            plan.mode = ChunkAssembler::Mode::STORED;
+            plan.rawSize = downloader.getFilesize();
+            LOG_INFO("Merging chunks into %s, the server sends them uncompressed", plan.outPath.c_str());
+        } else if (downloader.isBlocks()) {
+            plan.mode = ChunkAssembler::Mode::BLOCKS;
+            plan.rawSize = downloader.getFilesize();
+            LOG_INFO("Inflating blocks into %s", plan.outPath.c_str());
+        } else {
+            LOG_INFO("Decompressing chunks into %s", plan.outPath.c_str());
         }
-
-        if (close(mergedFd)) {
-            perror("close");
-            throw std::runtime_error("Cannot close merged file");
+        if (downloader.isTree()) {
+            plan.tree = &downloader.getManifest();
+            LOG_INFO("Unpacking %lu entries into %s/", plan.tree->size(), plan.outPath.c_str());
         }
+        plan.keepChunks = downloader.isPeerMode();
+        assembler.start(plan);
     }
 
     void load_settings(int argc, char **argv) {
@@ -73,8 +80,75 @@ private:
             exit(EXIT_FAILURE);
         }
         
-        for (int i = 1; i < argc; ++i)
-            add_server(argv[i]);
+        std::vector<std::string> servers;
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg(argv[i]);
+            if (arg.compare(0, 2, "--") == 0)
+                apply_option(arg, argv[0]);
+            else
+                servers.push_back(arg);
+        }
+
+        statsReporter = std::make_unique<StatsReporter>(statsInterval);
+        downloader.setSocketOptions(socketOptions);
+        downloader.setIoMode(ioMode);
+        if (!basePath.empty()) {
+            downloader.enableDeltaSync(basePath);
+            if (!peerPort.empty()) {
+                LOG_WARN("Peer mode is not available with --base, ignoring --peer-port");
+                peerPort.clear();
+            }
+        }
+        if (!peerPort.empty()) {
+            try {
+                downloader.enablePeerMode(peerPort, seedTime, peerLimits);
+            } catch (const std::exception& e) {
+                LOG_ERROR("Peer mode disabled: %s", e.what());
+            }
+        }
+        downloader.addChunkDoneListener([this](u_int64_t chunkNo) {
+            if (!assembler.isStarted())
+                startAssembler();
+            assembler.chunkSaved(chunkNo);
+        });
+        for (const auto& server : servers)
+            add_server(server);
+    }
+
+    /* Unknown options and malformed values print the usage and exit. */
+    void apply_option(const std::string& arg, const char *name) {
+        try {
+            if (parse_option(arg))
+                return;
+            std::cerr << "Unknown option: " << arg << std::endl;
+        } catch (const std::exception &e) {
+            std::cerr << "Invalid option " << arg << ": " << e.what() << std::endl;
+        }
+        print_usage(name);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Returns false for an unknown option, throws for a malformed value. */
+    bool parse_option(const std::string& arg) {
+        std::string value;
+        if (matchOption(arg, "stats-interval", value)) {
+            statsInterval = static_cast<unsigned>(std::stoul(value));
+        } else if (matchOption(arg, "log-level", value)) {
+            Log::setLevel(value);
+        } else if (matchOption(arg, "peer-port", value)) {
+            peerPort = value;
+        } else if (matchOption(arg, "seed-time", value)) {
+            seedTime = static_cast<unsigned>(std::stoul(value));
+        } else if (matchOption(arg, "peer-rate", value)) {
+            peerLimits.globalRate = RateLimits::parseRate(value);
+        } else if (matchOption(arg, "base", value)) {
+            basePath = value;
+        } else if (matchOption(arg, "io", value)) {
+            ioMode = DiskIo::parseMode(value);
+        } else if (!socketOptions.parse(arg)) {
+            return false;
+        }
+        return true;
     }
 
     void add_server(const std::string& serverAddrInfo) {
@@ -86,14 +160,35 @@ private:
     }
 
     void print_usage(const char *name) const {
-        std::cout << "Usage: " << name << " <server>:<port>" << std::endl
-            << "Example: " << name << " localhost:8080" << std::endl;
+        std::cout << "Usage: " << name << " [options] <server>:<port>..." << std::endl
+            << "Example: " << name << " localhost:8080" << std::endl
+            << "Options:" << std::endl
+            << "  --stats-interval=<sec>  print a stats line every <sec> seconds, 0 disables (default 5)" << std::endl
+            << "  --log-level=<level>     debug, info, warn or error (default info)" << std::endl
+            << "  --peer-port=<port>      serve downloaded chunks to other clients on <port>" << std::endl
+            << "  --seed-time=<sec>       keep serving peers <sec> seconds after the download (default 0)" << std::endl
+            << "  --peer-rate=<bytes/s>   upload rate limit for peers, K/M/G suffixes allowed" << std::endl
+            << "  --base=<path>           older copy of the file: only download the blocks that changed" << std::endl
+            << "  --io=<mode>             buffered, nocache or direct: how chunks are written; nocache drops" << std::endl
+            << "                          written data from the page cache, direct uses O_DIRECT (default buffered)" << std::endl
+            << SocketOptions::USAGE
+            << "Other clients started with --peer-port can be listed as servers." << std::endl
+            << "If the server shares a directory, it is recreated below the current directory." << std::endl
+            << "Send SIGUSR1 for a JSON stats dump, SIGUSR2 for Prometheus text." << std::endl;
     }
 
-    static const u_int64_t BUF_SIZE{8192};
-    static constexpr const char *MERGED_FILENAME = "mergedFile";
-
     using hostname_t = std::string;
     using port_t = std::string;
+    unsigned statsInterval{5};
+    std::string peerPort;
+    unsigned seedTime{0};
+    RateLimits peerLimits;
+    std::string basePath;
+    DiskIo::Mode ioMode{DiskIo::Mode::BUFFERED};
+    SocketOptions socketOptions;
+    std::unique_ptr<StatsReporter> statsReporter;
+    bool completed{false};
     Downloader downloader;
+    /* Builds the output while the download runs. */
+    ChunkAssembler assembler{downloader.getSavedChunks()};
 };
\ No newline at end of file
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <fcntl.h>
+#include <string>
+#include <vector>
+#include "ChunkBitmap.hpp"
+#include "Log.hpp"
+#include "MsgHashes.hpp"
+#include "MsgMetadata.hpp"
+#include "utils.hpp"
+
+/* Delta sync against an older local copy of the file. The server's block
+   hashes are compared with the old copy's block by block at the same offset
+   (the checksum first, the SHA-256 only for blocks that pass it),
+   so edits in place and appends are cheap while inserted bytes shift every
+   later block. Only changed blocks are downloaded; ChunkAssembler stitches
+   them together with the unchanged blocks of the old copy. */
+class DeltaSync {
+public:
+    explicit DeltaSync(const std::string &basePath) : basePath(basePath) {}
+
+    ~DeltaSync() {
+        if (baseFd != -1)
+            close(baseFd);
+    }
+
+    DeltaSync(const DeltaSync &) = delete;
+    DeltaSync &operator=(const DeltaSync &) = delete;
+
+    bool isPlanned() const {
+        return planned;
+    }
+
+    u_int64_t getRawChunks() const {
+        return rawChunks;
+    }
+
+    /* Hashes the old copy and returns the blocks that did not change. */
+    ChunkBitmap plan(const MsgHashes &msg) {
+        rawSize = msg.getRawSize();
+        rawChunks = msg.getHashes().size();
+        hashes = msg.getHashes();
+        ChunkBitmap unchanged(rawChunks);
+
+        const u_int64_t baseSize = doesFileExists(basePath) ? getFileSize(basePath) : 0;
+        int baseFd = open(basePath.c_str(), O_RDONLY);
+        if (baseFd == -1)
+            LOG_WARN("Cannot open %s, downloading everything: %s", basePath.c_str(), strerror(errno));
+
+        std::vector<u_int8_t> block(CHUNK_SIZE);
+        u_int64_t reused{0};
+        for (u_int64_t rawChunkNo = 0; baseFd != -1 && rawChunkNo < rawChunks; ++rawChunkNo) {
+            const u_int64_t len = getSizeOfChunk(rawSize, rawChunkNo, CHUNK_SIZE);
+            if (rawChunkNo * CHUNK_SIZE + len > baseSize)
+                break;
+            if (!readBlock(baseFd, rawChunkNo, block.data(), len))
+                break;
+            const MsgHashes::BlockHash &hash = msg.getHashes()[rawChunkNo];
+            if (MsgHashes::hashChunk(block.data(), len) == hash.weak &&
+                Sha256::of(block.data(), len) == hash.strong) {
+                unchanged.set(rawChunkNo);
+                reused += len;
+            }
+        }
+        if (baseFd != -1)
+            tryClose(baseFd, "Cannot close " + basePath);
+
+        planned = true;
+        LOG_INFO("Delta sync: %lu of %lu blocks changed, reusing %lu bytes of %s",
+                 rawChunks - unchanged.count(), rawChunks, reused, basePath.c_str());
+        return unchanged;
+    }
+
+    u_int64_t getRawSize() const {
+        return rawSize;
+    }
+
+    /* Copies block `rawChunkNo` of the old copy to `buf`. The old copy is
+       opened on first use and stays open, so it may be replaced by the
+       new file while it is read. */
+    void readBaseBlock(u_int64_t rawChunkNo, u_int8_t *buf, u_int64_t len) {
+        if (baseFd == -1)
+            baseFd = open(basePath.c_str(), O_RDONLY);
+        if (baseFd == -1 || !readBlock(baseFd, rawChunkNo, buf, len))
+            throw std::runtime_error("Cannot read " + basePath);
+    }
+
+    /* True if the downloaded block matches the server's checksum and
+       digest of it, as a reused block of the old copy must. */
+    bool verifyBlock(u_int64_t rawChunkNo, const u_int8_t *buf, u_int64_t len) const {
+        const MsgHashes::BlockHash &hash = hashes[rawChunkNo];
+        return MsgHashes::hashChunk(buf, len) == hash.weak && Sha256::of(buf, len) == hash.strong;
+    }
+
+    /* True if another server's hashes describe the file the plan is for. */
+    bool matchesPlan(const MsgHashes &msg) const {
+        if (msg.getRawSize() != rawSize || msg.getHashes().size() != hashes.size())
+            return false;
+        for (size_t i = 0; i < hashes.size(); ++i) {
+            if (msg.getHashes()[i].weak != hashes[i].weak || msg.getHashes()[i].strong != hashes[i].strong)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    bool readBlock(int fd, u_int64_t rawChunkNo, u_int8_t *buf, u_int64_t len) const {
+        u_int64_t readBytes{0};
+        while (readBytes < len) {
+            ssize_t rv = pread(fd, buf + readBytes, len - readBytes,
+                               static_cast<off_t>(rawChunkNo * CHUNK_SIZE + readBytes));
+            if (rv <= 0)
+                return false;
+            readBytes += rv;
+        }
+        return true;
+    }
+
+    const std::string basePath;
+    bool planned{false};
+    u_int64_t rawSize{0};
+    u_int64_t rawChunks{0};
+    std::vector<MsgHashes::BlockHash> hashes;
+    int baseFd{-1};
+};
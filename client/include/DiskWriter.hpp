@@ -2,71 +2,169 @@
 
 #include <zconf.h>
 #include <bits/unique_ptr.h>
-#include <unordered_map>
-#include <list>
+#include <vector>
 #include <fcntl.h>
 #include <sys/epoll.h>
 #include <iostream>
 #include <utils.hpp>
+#include "DiskIo.hpp"
+#include "Log.hpp"
 #include "MetaDataProvider.hpp"
 #include "ChunkScheduler.hpp"
+#include "Stats.hpp"
 
+/* Writes the chunk files of the workspace. Per open chunk it keeps the page
+   cache hints of DiskIo or, in DIRECT mode, an aligned staging buffer that is
+   written out a DIRECT_BUFFER at a time. Buffers stay with their descriptor
+   slot and are reused by later chunks. */
 class DiskWriter {
 public:
     DiskWriter(const MetaDataProvider &metaDataProvider, ChunkScheduler& chunkScheduler)
             : metaDataProvider(metaDataProvider), chunkScheduler(chunkScheduler) {
         removeRecursively("workspace");
         if (mkdir("workspace", S_IRWXU) != 0) {
-            std::cerr << "Cannot create workspace directory" << std::endl;
-            perror("mkdir");
+            LOG_ERROR("Cannot create workspace directory: %s", strerror(errno));
             throw std::exception();
         }
-        std::cout << "Workspace directory created!" << std::endl;
+        LOG_INFO("Workspace directory created!");
     }
 
+    /* Chunk files are tracked in a table indexed by their descriptor, which
+       only grows when the kernel hands out a higher descriptor than before. */
     int createFileFd(int workerFd, u_int64_t chunkNo) {
-        const std::string chunkFn = generateChunkFilename(workerFd, chunkNo);
-        fd sockfd = open(chunkFn.c_str(), O_CREAT | O_WRONLY | O_EXCL, S_IRWXU);
+        char chunkFn[SavedChunks::PATH_SIZE];
+        chunkScheduler.getSavedChunks().formatPath(chunkFn, chunkNo, workerFd);
+        bool direct = ioMode == DiskIo::Mode::DIRECT;
+        fd sockfd = DiskIo::open(chunkFn, O_CREAT | O_WRONLY | O_EXCL, S_IRWXU, direct);
         if (sockfd == -1) {
-            perror("open");
+            LOG_ERROR("open: %s: %s", chunkFn, strerror(errno));
             throw std::exception();
         }
 
-        fdMap[sockfd] = FdInfo{};
-        fdMap[sockfd].chunkFn = chunkFn;
-        fdMap[sockfd].chunkNo = chunkNo;
+        if (static_cast<size_t>(sockfd) >= files.size())
+            files.resize(static_cast<size_t>(sockfd) + 1);
+        FdInfo &info = files[sockfd];
+        memcpy(info.chunkFn, chunkFn, sizeof(chunkFn));
+        info.chunkNo = chunkNo;
+        info.workerFd = workerFd;
+        info.direct = direct;
+        info.staged = 0;
+        info.written = 0;
+        info.writeBehind.reset(sockfd, ioMode != DiskIo::Mode::BUFFERED);
+        if (direct && !info.stage)
+            info.stage = DiskIo::allocAligned(DIRECT_BUFFER);
 
         return sockfd;
     }
 
+    /* Throws std::runtime_error if the chunk could not be written out; its
+       file is gone then and the chunk is not marked as done. */
     void closeChunk(int sockFd) {
-        std::cout << "Chunk " << fdMap[sockFd].chunkNo << " ("<< fdMap[sockFd].chunkFn << ") saved" << std::endl;
-        tryClose(sockFd, "Failed to close" + fdMap[sockFd].chunkFn);
-        chunkScheduler.markChunkAsDone(fdMap[sockFd].chunkNo, fdMap[sockFd].chunkFn);
+        FdInfo &info = files[sockFd];
+        try {
+            finishWrites(sockFd, info);
+        } catch (const std::exception &) {
+            abortChunk(sockFd);
+            throw std::runtime_error(std::string("Cannot write ") + info.chunkFn);
+        }
+        if (close(sockFd) != 0) {
+            LOG_ERROR("close: %s: %s", info.chunkFn, strerror(errno));
+            unlink(info.chunkFn);
+            throw std::runtime_error(std::string("Cannot write ") + info.chunkFn);
+        }
+        LOG_DEBUG("Chunk %lu (%s) saved", info.chunkNo, info.chunkFn);
+        chunkScheduler.markChunkAsDone(info.chunkNo, info.workerFd);
+    }
+
+    /* Drops a partially written chunk. */
+    void abortChunk(int sockFd) {
+        const FdInfo &info = files[sockFd];
+        LOG_DEBUG("Chunk %lu (%s) aborted", info.chunkNo, info.chunkFn);
+        tryClose(sockFd, info.chunkFn);
+        unlink(info.chunkFn);
+    }
+
+    void setIoMode(DiskIo::Mode mode) {
+        ioMode = mode;
     }
 
+    /* Throws std::runtime_error if the data could not be written; the
+       chunk is left open for abortChunk(). */
     void writeBuf(int sockFd, u_int8_t *arr, size_t bytesToSave) {
+        const auto start = steady_clock::now();
+        FdInfo &info = files[sockFd];
         try {
-            tryWriteAll(sockFd, arr, bytesToSave);
+            if (info.direct) {
+                stageDirect(sockFd, info, arr, bytesToSave);
+            } else {
+                tryWriteAll(sockFd, arr, bytesToSave);
+                info.writeBehind.wrote(bytesToSave);
+            }
         } catch (const std::exception&) {
-            std::cerr << "Cannot write " << fdMap[sockFd].chunkFn << " to disk" << std::endl;
+            LOG_ERROR("Cannot write %s to disk", info.chunkFn);
+            throw std::runtime_error(std::string("Cannot write ") + info.chunkFn);
         }
+        const u_int64_t blockedNs = elapsedNs(start);
+        Stats::add(Counter::DISK_BLOCKED_NS, blockedNs);
+        Stats::add(Counter::DISK_BYTES, bytesToSave);
+        Stats::record(Hist::DISK_WRITE_US, blockedNs / 1000);
     }
 
 private:
-    std::string generateChunkFilename(int workerFd, u_int64_t chunkNo) const {
-        return std::string("workspace/chunk") + std::to_string(chunkNo) + "_" +
-               std::to_string(workerFd);
-    }
-
     using fd = int;
 
     struct FdInfo {
-        std::string chunkFn;
+        char chunkFn[SavedChunks::PATH_SIZE];
         u_int64_t chunkNo{};
+        int workerFd{-1};
+        bool direct{false};
+        DiskIo::WriteBehind writeBehind;
+        DiskIo::AlignedBuffer stage;
+        size_t staged{0};
+        u_int64_t written{0};
     };
 
+    void stageDirect(int sockFd, FdInfo &info, const u_int8_t *data, size_t len) {
+        while (len > 0) {
+            const size_t room = DIRECT_BUFFER - info.staged;
+            const size_t n = len < room ? len : room;
+            memcpy(info.stage.get() + info.staged, data, n);
+            info.staged += n;
+            data += n;
+            len -= n;
+            if (info.staged == DIRECT_BUFFER) {
+                tryWriteAll(sockFd, info.stage.get(), DIRECT_BUFFER);
+                info.written += DIRECT_BUFFER;
+                info.staged = 0;
+            }
+        }
+    }
+
+    /* O_DIRECT can only write whole blocks: the tail goes out padded and
+       the file is cut back to its real size. */
+    void finishWrites(int sockFd, FdInfo &info) {
+        if (info.direct) {
+            if (info.staged == 0)
+                return;
+            const size_t padded = DiskIo::alignUp(info.staged);
+            memset(info.stage.get() + info.staged, 0, padded - info.staged);
+            tryWriteAll(sockFd, info.stage.get(), padded);
+            info.written += info.staged;
+            info.staged = 0;
+            if (ftruncate(sockFd, static_cast<off_t>(info.written)) == -1) {
+                LOG_ERROR("ftruncate: %s: %s", info.chunkFn, strerror(errno));
+                throw std::runtime_error(std::string("Cannot truncate ") + info.chunkFn);
+            }
+            return;
+        }
+        info.writeBehind.finish();
+    }
+
+    /* Bytes per O_DIRECT write. */
+    static const size_t DIRECT_BUFFER{1024 * 1024};
+
     const MetaDataProvider& metaDataProvider;
     ChunkScheduler& chunkScheduler;
-    std::unordered_map<fd, FdInfo> fdMap;
+    DiskIo::Mode ioMode{DiskIo::Mode::BUFFERED};
+    std::vector<FdInfo> files;
 };
\ No newline at end of file
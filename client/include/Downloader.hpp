@@ -4,7 +4,11 @@
 #include <memory>
 #include <unordered_map>
 #include <sys/epoll.h>
+#include "ChunkServer.hpp"
+#include "DeltaSync.hpp"
 #include "DiskWriter.hpp"
+#include "Log.hpp"
+#include "PeerChunkSource.hpp"
 #include "Worker.hpp"
 
 
@@ -13,7 +17,7 @@ public:
     Downloader() {
         epFd = epoll_create1(0);
         if (epFd == -1) {
-            perror("epoll_create1");
+            LOG_ERROR("epoll_create1: %s", strerror(errno));
             exit(EXIT_FAILURE);
         }
         workers.reserve(10);
@@ -23,46 +27,86 @@ public:
     }
 
     ~Downloader() {
+        workers.clear();
+        peerServer.reset();
         tryClose(epFd, "Failed to close epFd");
     }
 
     void addServer(const std::string& hostname, const std::string& port) {
         try {
             std::unique_ptr<Worker> worker = std::make_unique<Worker>(epFd, hostname, port,
-                    *chunkScheduler, *metaDataProvider, *diskWriter);
+                    *chunkScheduler, *metaDataProvider, *diskWriter, socketOptions, deltaSync.get());
             workers[worker->getServerSock()] = std::move(worker);
         } catch (const std::exception& e) {
-            std::cerr << "Could not connect to: " << hostname << ":" << port << std::endl;
-            std::cerr << e.what() << std::endl;
+            LOG_ERROR("Could not connect to: %s:%s", hostname.c_str(), port.c_str());
+            LOG_ERROR("%s", e.what());
         }
     }
 
-    const std::unordered_map<uint64_t, std::string>& downloadChunks() {
+    /* Peer mode: serve already downloaded chunks to other clients on `port`
+       while downloading, and for `seedSec` seconds after the download. */
+    void enablePeerMode(const std::string& port, unsigned seedSec, const RateLimits& limits) {
+        peerSource = std::make_unique<PeerChunkSource>(*chunkScheduler, *metaDataProvider);
+        peerServer = std::make_unique<ChunkServer>(epFd, *peerSource);
+        peerServer->setLimits(limits);
+        peerServer->setSocketOptions(socketOptions);
+        peerServer->listenOn(port);
+        chunkScheduler->addChunkDoneListener([this](u_int64_t chunkNo) {
+            peerSource->chunkSaved(chunkNo);
+            peerServer->chunkAvailable(chunkNo);
+        });
+        seedTime = std::chrono::seconds(seedSec);
+        LOG_INFO("Serving downloaded chunks to peers on port %s", port.c_str());
+    }
+
+    /* Used for server connections and the peer listener created afterwards. */
+    void setSocketOptions(const SocketOptions& options) {
+        socketOptions = options;
+    }
+
+    void setIoMode(DiskIo::Mode mode) {
+        diskWriter->setIoMode(mode);
+    }
+
+    /* Only download the blocks that differ from the old copy at `basePath`.
+       Must be called before any server is added. */
+    void enableDeltaSync(const std::string& basePath) {
+        deltaSync = std::make_unique<DeltaSync>(basePath);
+    }
+
+    DeltaSync *getDeltaSync() const {
+        return deltaSync.get();
+    }
+
+    /* Peers read served chunks from their files until the seeding ends. */
+    bool isPeerMode() const {
+        return peerServer != nullptr;
+    }
+
+    /* `listener` is called on the download thread as each chunk is saved. */
+    void addChunkDoneListener(std::function<void(u_int64_t)> listener) {
+        chunkScheduler->addChunkDoneListener(std::move(listener));
+    }
+
+    const SavedChunks& getSavedChunks() const {
+        return chunkScheduler->getSavedChunks();
+    }
+
+    const SavedChunks& downloadChunks() {
         if (workers.empty()) {
             throw std::runtime_error("Could not connect to any server");
         }
         try {
-            epoll_event events[MAX_EVENTS];
-            while(!workers.empty()) {
-                int readyCount = epoll_wait(epFd, events, MAX_EVENTS, TIMEOUT);
-                if (readyCount == -1) {
-                    perror("epoll_wait");
-                    throw std::exception();
-                } else if (readyCount == 0){
-                    throw std::runtime_error("Timeout");
-                }
-
-                for (int i = 0; i < readyCount; ++i) {
-                    try {
-                        workers[events[i].data.fd]->notify();
-                    } catch (const ChunkScheduler::NoMoreChunks&) {
-                        workers.erase(events[i].data.fd);
-                    }
-                }
-            }
+            while(!workers.empty())
+                pollOnce();
+            if (!chunkScheduler->isComplete())
+                throw std::runtime_error("Some chunks are not available from any server");
         } catch(const ChunkScheduler::AllChunksDownloaded&) {
-            std::cout << "All chunks are downloaded" << std::endl;
             workers.clear();
+            const Stats::Snapshot totals = Stats::snapshot();
+            LOG_INFO("All chunks are downloaded: %lu bytes received, %lu wasted",
+                     totals.counter(Counter::BYTES_IN), totals.counter(Counter::WASTED_BYTES));
+            seed();
         }
         return chunkScheduler->getSavedChunks();
     }
@@ -70,14 +114,95 @@ public:
     std::string getFilename() const {
         return metaDataProvider->getFilename();
     }
+
+    u_int64_t getFilesize() const {
+        return metaDataProvider->getFilesize();
+    }
+
+    bool isBlocks() const {
+        return metaDataProvider->isBlocks();
+    }
+
+    bool isStored() const {
+        return metaDataProvider->isStored();
+    }
+
+    bool isTree() const {
+        return metaDataProvider->isTree();
+    }
+
+    const std::vector<MsgManifest::Entry> &getManifest() const {
+        return metaDataProvider->getManifest();
+    }
 private:
+    void pollOnce() {
+        if (peerServer && !peerServer->hasMetadata() && metaDataProvider->hasMetaData() &&
+            (!metaDataProvider->isTree() || metaDataProvider->hasManifest())) {
+            peerSource->metadataKnown();
+            if (metaDataProvider->isTree())
+                peerServer->setManifest(metaDataProvider->getManifest());
+            peerServer->setMetadata(metaDataProvider->getFilename(), metaDataProvider->getFilesize(),
+                                    metaDataProvider->getFlags());
+        }
+
+        int timeout = TIMEOUT;
+        const int peerTimeout = peerServer ? peerServer->nextTimeoutMs() : -1;
+        if (peerTimeout >= 0)
+            timeout = std::min(timeout, peerTimeout);
+
+        epoll_event events[MAX_EVENTS];
+        int readyCount = epoll_wait(epFd, events, MAX_EVENTS, timeout);
+        if (readyCount == -1) {
+            if (errno == EINTR)
+                return;
+            LOG_ERROR("epoll_wait: %s", strerror(errno));
+            throw std::exception();
+        } else if (readyCount == 0 && timeout == TIMEOUT && !workers.empty()) {
+            throw std::runtime_error("Timeout");
+        }
+
+        for (int i = 0; i < readyCount; ++i) {
+            const int fd = events[i].data.fd;
+            auto worker = workers.find(fd);
+            if (worker != workers.end()) {
+                try {
+                    worker->second->notify();
+                } catch (const ChunkScheduler::NoMoreChunks&) {
+                    workers.erase(worker);
+                } catch (const std::runtime_error& e) {
+                    LOG_ERROR("Dropping server: %s", e.what());
+                    worker->second->abort();
+                    workers.erase(worker);
+                }
+            } else if (peerServer && peerServer->owns(fd)) {
+                peerServer->handleEvent(fd, events[i].events);
+            }
+        }
+        if (peerServer)
+            peerServer->serveActive();
+    }
+
+    void seed() {
+        if (!peerServer || seedTime == steady_clock::duration::zero())
+            return;
+        LOG_INFO("Seeding for %ld s", std::chrono::duration_cast<std::chrono::seconds>(seedTime).count());
+        const auto until = steady_clock::now() + seedTime;
+        while (steady_clock::now() < until)
+            pollOnce();
+    }
+
     const int MAX_EVENTS{10};
     const int TIMEOUT{2000};
 
     std::unique_ptr<MetaDataProvider> metaDataProvider;
     std::unique_ptr<ChunkScheduler> chunkScheduler;
     std::unique_ptr<DiskWriter> diskWriter;
+    std::unique_ptr<DeltaSync> deltaSync;
+    SocketOptions socketOptions;
 
     std::unordered_map<int, std::unique_ptr<Worker>> workers;
+    std::unique_ptr<PeerChunkSource> peerSource;
+    std::unique_ptr<ChunkServer> peerServer;
+    steady_clock::duration seedTime{};
     int epFd;
 };
@@ -1,20 +1,57 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include "MsgManifest.hpp"
 #include "MsgMetadata.hpp"
 
 struct MetaDataProvider {
-    void setMetaData(const std::string& filename, u_int64_t filesize) {
+    void setMetaData(const std::string& filename, u_int64_t filesize, u_int64_t flags = 0) {
         if (this->filename.empty()) {
             this->filename = filename;
             this->filesize = filesize;
+            this->flags = flags;
         }
     }
 
+    bool hasMetaData() const {
+        return !filename.empty();
+    }
+
+    /* Chunks are compressed blocks, see MsgMetadata::BLOCKS. */
+    bool isBlocks() const {
+        return (flags & MsgMetadata::BLOCKS) != 0;
+    }
+
+    /* Chunks are the file itself, nothing to inflate. */
+    bool isStored() const {
+        return (flags & MsgMetadata::STORED) != 0;
+    }
+
+    /* The file is a packed directory tree, see MsgMetadata::TREE. */
+    bool isTree() const {
+        return (flags & MsgMetadata::TREE) != 0;
+    }
+
+    void setManifest(const MsgManifest &msg) {
+        if (!manifestKnown) {
+            manifest = msg.getEntries();
+            manifestKnown = true;
+        }
+    }
+
+    bool hasManifest() const {
+        return manifestKnown;
+    }
+
+    const std::vector<MsgManifest::Entry> &getManifest() const {
+        return manifest;
+    }
+
     u_int64_t getSizeOfChunk(u_int64_t chunkNo) const {
         if (chunkNo < getNumberOfChunks() - 1)
             return CHUNK_SIZE;
-        return filesize % CHUNK_SIZE;
+        return filesize - chunkNo * CHUNK_SIZE;
     }
 
     u_int64_t getNumberOfChunks() const {
@@ -25,7 +62,7 @@ struct MetaDataProvider {
         }
     }
 
-    std::string getFilename() const {
+    const std::string &getFilename() const {
         return filename;
     }
 
@@ -33,7 +70,14 @@ struct MetaDataProvider {
         return filesize;
     }
 
+    u_int64_t getFlags() const {
+        return flags;
+    }
+
 private:
     std::string filename;
     u_int64_t filesize{};
+    u_int64_t flags{};
+    std::vector<MsgManifest::Entry> manifest;
+    bool manifestKnown{false};
 };
\ No newline at end of file
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include "Gzip.hpp"
+#include "Log.hpp"
+#include "utils.hpp"
+
+/* Where ChunkAssembler writes the downloaded data, in file order. commit()
+   checks that everything arrived and makes the result durable in one go. */
+class OutputSink : public ByteSink {
+public:
+    virtual void commit() = 0;
+};
+
+/* A single output file. It is written as <path>.part and renamed over
+   `path` by commit(), so an interrupted download never leaves something
+   that looks complete, and delta sync can read the old copy at `path`
+   until the end. */
+class OutputFile : public OutputSink {
+public:
+    OutputFile(const std::string &path, u_int64_t expectedSize)
+            : path(path), tmpPath(path + ".part"), expectedSize(expectedSize) {
+        fd = open(tmpPath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd == -1) {
+            LOG_ERROR("open: %s: %s", tmpPath.c_str(), strerror(errno));
+            throw std::runtime_error("Cannot create " + tmpPath);
+        }
+    }
+
+    ~OutputFile() override {
+        if (fd != -1) {
+            close(fd);
+            unlink(tmpPath.c_str());
+        }
+    }
+
+    OutputFile(const OutputFile &) = delete;
+    OutputFile &operator=(const OutputFile &) = delete;
+
+    void write(const u_int8_t *buf, size_t len) override {
+        tryWriteAll(fd, buf, len);
+        written += len;
+    }
+
+    void commit() override {
+        if (expectedSize != UNKNOWN_SIZE && written != expectedSize)
+            throw std::runtime_error("Assembled " + std::to_string(written) + " bytes of " + path +
+                                     ", expected " + std::to_string(expectedSize));
+        if (fdatasync(fd) != 0)
+            LOG_WARN("fdatasync: %s: %s", tmpPath.c_str(), strerror(errno));
+        tryClose(fd, "Cannot close " + tmpPath);
+        fd = -1;
+        if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+            LOG_ERROR("rename: %s: %s", tmpPath.c_str(), strerror(errno));
+            throw std::runtime_error("Cannot move " + tmpPath + " to " + path);
+        }
+        syncParent();
+    }
+
+    /* The size is only known once the stream is inflated. */
+    static const u_int64_t UNKNOWN_SIZE{~0ULL};
+
+private:
+    /* The rename itself only survives a crash once the directory entry is
+       on disk. */
+    void syncParent() const {
+        const size_t slash = path.find_last_of('/');
+        const std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        const int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dirFd == -1 || fsync(dirFd) != 0)
+            LOG_WARN("fsync: %s: %s", dir.c_str(), strerror(errno));
+        if (dirFd != -1)
+            close(dirFd);
+    }
+
+    const std::string path;
+    const std::string tmpPath;
+    const u_int64_t expectedSize;
+    u_int64_t written{0};
+    int fd{-1};
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <fcntl.h>
+#include <memory>
+#include <vector>
+#include <zlib.h>
+#include "BufferPool.hpp"
+#include "ChunkScheduler.hpp"
+#include "ChunkSource.hpp"
+#include "Log.hpp"
+#include "MetaDataProvider.hpp"
+#include "utils.hpp"
+
+/* Serves the chunks this client has already saved in its workspace, so it
+   can act as a server for other clients (peer mode). Chunks are read into
+   buffers from a BufferPool, like ChunkStore does with O_DIRECT. */
+class PeerChunkSource : public ChunkSource {
+public:
+    PeerChunkSource(const ChunkScheduler &chunkScheduler, const MetaDataProvider &metaDataProvider)
+            : chunkScheduler(chunkScheduler), metaDataProvider(metaDataProvider),
+              buffers(sizeof(u_int64_t) + compressBound(CHUNK_SIZE), MAX_IDLE_BUFFERS) {}
+
+    const AvailabilityLog &availability() const override {
+        return log;
+    }
+
+    /* Once the metadata is known, before it is sent to peers: they check
+       the chunk count of every availability reply against it. */
+    void metadataKnown() {
+        if (log.chunks() == 0)
+            log.resize(metaDataProvider.getNumberOfChunks());
+    }
+
+    /* Called for every chunk the download saves. */
+    void chunkSaved(u_int64_t chunkNo) {
+        metadataKnown();
+        log.add(chunkNo);
+    }
+
+    ChunkRef acquire(u_int64_t chunkNo) override {
+        const std::string path = chunkScheduler.getSavedChunks().path(chunkNo);
+        int chunkFd = open(path.c_str(), O_RDONLY);
+        if (chunkFd == -1) {
+            LOG_ERROR("open: %s: %s", path.c_str(), strerror(errno));
+            throw std::runtime_error("Cannot open " + path);
+        }
+
+        /* A compressed block goes out with its length in front, as the
+           server sent it. */
+        const bool blocks = metaDataProvider.isBlocks();
+        const u_int64_t prefix = blocks ? sizeof(u_int64_t) : 0;
+        const u_int64_t chunkSize = blocks ? static_cast<u_int64_t>(getFileSize(path))
+                                           : metaDataProvider.getSizeOfChunk(chunkNo);
+
+        ChunkRef ref;
+        ref.chunkNo = chunkNo;
+        ref.size = prefix + chunkSize;
+        /* Only a damaged chunk file is larger than the pool's buffers. */
+        std::shared_ptr<u_int8_t> data = ref.size <= buffers.getBufferSize()
+                ? buffers.take()
+                : std::shared_ptr<u_int8_t>(new u_int8_t[ref.size], std::default_delete<u_int8_t[]>());
+        if (blocks)
+            memcpy(data.get(), &chunkSize, sizeof(chunkSize));
+        u_int64_t readBytes{0};
+        while (readBytes < chunkSize) {
+            ssize_t rv = read(chunkFd, data.get() + prefix + readBytes, chunkSize - readBytes);
+            if (rv <= 0) {
+                close(chunkFd);
+                throw std::runtime_error("Cannot read " + path);
+            }
+            readBytes += rv;
+        }
+        tryClose(chunkFd, "Cannot close " + path);
+
+        ref.data = data.get();
+        ref.owned = std::move(data);
+        return ref;
+    }
+
+private:
+    /* Idle buffers kept for the next chunks sent to peers. */
+    static const size_t MAX_IDLE_BUFFERS{4};
+
+    const ChunkScheduler &chunkScheduler;
+    const MetaDataProvider &metaDataProvider;
+    AvailabilityLog log;
+    /* Holds a chunk, or a compressed block and its length, while it is sent. */
+    BufferPool buffers;
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+/* Which downloaded chunks are on disk and where. A chunk fetched through
+   the worker on socket `source` lives at <dir>/chunk<chunkNo>_<source>, so
+   only the source is kept per chunk and saving one allocates nothing. */
+class SavedChunks {
+public:
+    enum : int {
+        /* Not saved yet. */
+        NONE = -1,
+        /* Delta sync: taken from the old copy, nothing was downloaded. */
+        BASE = -2
+    };
+    static const size_t PATH_SIZE{256};
+
+    explicit SavedChunks(const std::string &dir = "workspace") : dir(dir) {
+        if (dir.size() > PATH_SIZE - 32)
+            throw std::length_error("Chunk directory name is too long");
+    }
+
+    void resize(u_int64_t chunks) {
+        sources.resize(chunks, NONE);
+    }
+
+    /* Number of chunks of the file, saved or not. */
+    u_int64_t size() const {
+        return sources.size();
+    }
+
+    /* Number of saved chunks. */
+    u_int64_t count() const {
+        return saved;
+    }
+
+    bool has(u_int64_t chunkNo) const {
+        return chunkNo < sources.size() && sources[chunkNo] != NONE;
+    }
+
+    bool fromBase(u_int64_t chunkNo) const {
+        return sources[chunkNo] == BASE;
+    }
+
+    /* The source the chunk was saved from, NONE or BASE. */
+    int source(u_int64_t chunkNo) const {
+        return sources[chunkNo];
+    }
+
+    /* Returns false if the chunk was saved already. */
+    bool save(u_int64_t chunkNo, int source) {
+        if (has(chunkNo))
+            return false;
+        sources[chunkNo] = source;
+        ++saved;
+        return true;
+    }
+
+    std::string path(u_int64_t chunkNo) const {
+        char buf[PATH_SIZE];
+        formatPath(buf, chunkNo, sources[chunkNo]);
+        return buf;
+    }
+
+    /* The path of chunk `chunkNo` downloaded from `source`. */
+    void formatPath(char (&buf)[PATH_SIZE], u_int64_t chunkNo, int source) const {
+        snprintf(buf, PATH_SIZE, "%s/chunk%lu_%d", dir.c_str(), chunkNo, source);
+    }
+
+    const std::string &getDir() const {
+        return dir;
+    }
+
+private:
+    const std::string dir;
+    std::vector<int> sources;
+    u_int64_t saved{0};
+};
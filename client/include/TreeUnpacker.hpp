@@ -0,0 +1,167 @@
+#pragma once
+
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+#include "Log.hpp"
+#include "MsgManifest.hpp"
+#include "OutputFile.hpp"
+#include "utils.hpp"
+
+/* Splits a downloaded tree pack (MsgMetadata::TREE) into the files listed
+   in its manifest, below `root`, as the pack's bytes arrive: each file is
+   created when the pack reaches it, so the pack itself is never stored.
+   Directories are created writable and get their own permissions at
+   commit(), once everything below them is in place. Every path is resolved
+   one component at a time from the root's fd without following symlinks,
+   so links planted in the destination cannot send files elsewhere. */
+class TreeUnpacker : public OutputSink {
+public:
+    TreeUnpacker(const std::vector<MsgManifest::Entry> &entries, const std::string &root)
+            : entries(entries), root(root) {
+        makeDirectory(AT_FDCWD, root, root);
+        rootFd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (rootFd == -1) {
+            LOG_ERROR("open: %s: %s", root.c_str(), strerror(errno));
+            throw std::runtime_error("Cannot open " + root);
+        }
+        advance();
+    }
+
+    ~TreeUnpacker() override {
+        if (fd != -1)
+            close(fd);
+        if (parentFd != -1 && parentFd != rootFd)
+            close(parentFd);
+        if (rootFd != -1)
+            close(rootFd);
+    }
+
+    TreeUnpacker(const TreeUnpacker &) = delete;
+    TreeUnpacker &operator=(const TreeUnpacker &) = delete;
+
+    void write(const u_int8_t *buf, size_t len) override {
+        while (len > 0) {
+            if (next == entries.size())
+                throw std::runtime_error("The pack is larger than its manifest");
+            const size_t n = left < len ? left : len;
+            tryWriteAll(fd, buf, n);
+            buf += n;
+            len -= n;
+            left -= n;
+            if (left == 0) {
+                tryClose(fd, "Cannot close " + root + "/" + entries[next].path);
+                fd = -1;
+                ++next;
+                advance();
+            }
+        }
+    }
+
+    /* One syncfs() covers every file of the tree. */
+    void commit() override {
+        if (next != entries.size())
+            throw std::runtime_error("The pack ends before " + entries[next].path);
+        for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+            if (!it->isDirectory())
+                continue;
+            std::string name;
+            const int dirFd = openParent(it->path, name);
+            const int entryFd = openat(dirFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (entryFd == -1 || fchmod(entryFd, it->mode & 07777) != 0)
+                LOG_WARN("chmod: %s/%s: %s", root.c_str(), it->path.c_str(), strerror(errno));
+            if (entryFd != -1)
+                close(entryFd);
+        }
+
+        if (syncfs(rootFd) != 0)
+            LOG_WARN("syncfs: %s: %s", root.c_str(), strerror(errno));
+    }
+
+private:
+    /* Creates the entries up to the next file that still needs bytes. */
+    void advance() {
+        for (; next < entries.size(); ++next) {
+            const MsgManifest::Entry &entry = entries[next];
+            const std::string path = root + "/" + entry.path;
+            std::string name;
+            const int dirFd = openParent(entry.path, name);
+            if (entry.isDirectory()) {
+                makeDirectory(dirFd, name, path);
+                continue;
+            }
+            fd = openat(dirFd, name.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_NOFOLLOW, entry.mode & 0777);
+            if (fd == -1) {
+                LOG_ERROR("open: %s: %s", path.c_str(), strerror(errno));
+                throw std::runtime_error("Cannot create " + path);
+            }
+            if (entry.size != 0) {
+                left = entry.size;
+                return;
+            }
+            tryClose(fd, "Cannot close " + path);
+            fd = -1;
+        }
+    }
+
+    /* Returns an fd of the directory `path` is in and sets `name` to its
+       last component. The fd stays open for the next entry, which is
+       usually in the same directory. */
+    int openParent(const std::string &path, std::string &name) {
+        const size_t slash = path.find_last_of('/');
+        const std::string dir = slash == std::string::npos ? std::string() : path.substr(0, slash);
+        name = path.substr(slash + 1);
+        if (parentFd != -1 && dir == parentPath)
+            return parentFd;
+
+        if (parentFd != -1 && parentFd != rootFd)
+            close(parentFd);
+        parentFd = rootFd;
+        parentPath.clear();
+        size_t start{0};
+        while (start < dir.size()) {
+            size_t end = dir.find('/', start);
+            if (end == std::string::npos)
+                end = dir.size();
+            const std::string part = dir.substr(start, end - start);
+            const int childFd = openat(parentFd, part.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (childFd == -1) {
+                LOG_ERROR("open: %s/%s: %s", root.c_str(), dir.substr(0, end).c_str(), strerror(errno));
+                if (parentFd != rootFd)
+                    close(parentFd);
+                parentFd = -1;
+                throw std::runtime_error("Cannot open " + root + "/" + dir.substr(0, end));
+            }
+            if (parentFd != rootFd)
+                close(parentFd);
+            parentFd = childFd;
+            start = end + 1;
+        }
+        parentPath = dir;
+        return parentFd;
+    }
+
+    /* An existing directory is reused; a symlink in its place is not. */
+    static void makeDirectory(int dirFd, const std::string &name, const std::string &path) {
+        if (mkdirat(dirFd, name.c_str(), S_IRWXU) == 0)
+            return;
+        const int error = errno;
+        struct stat st{};
+        if (error == EEXIST && fstatat(dirFd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+            return;
+        LOG_ERROR("mkdir: %s: %s", path.c_str(), error == EEXIST ? "exists and is not a directory" : strerror(error));
+        throw std::runtime_error("Cannot create " + path);
+    }
+
+    const std::vector<MsgManifest::Entry> &entries;
+    const std::string root;
+    int rootFd{-1};
+    /* Directory of the last entry, relative to the root, and its fd. */
+    std::string parentPath;
+    int parentFd{-1};
+    /* The entry being written, entries.size() once all are complete. */
+    size_t next{0};
+    u_int64_t left{0};
+    int fd{-1};
+};
@@ -9,10 +9,19 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unordered_map>
+#include <vector>
 #include "ChunkScheduler.hpp"
+#include "DeltaSync.hpp"
 #include "DiskWriter.hpp"
+#include "Log.hpp"
 #include "MetaDataProvider.hpp"
+#include "MsgAvailability.hpp"
+#include "MsgHashes.hpp"
+#include "MsgManifest.hpp"
 #include "MsgMetadata.hpp"
+#include "MsgRequest.hpp"
+#include "SocketOptions.hpp"
+#include "Stats.hpp"
 #include "utils.hpp"
 
 class Worker {
@@ -20,17 +29,20 @@ public:
     Worker(int epfd, const std::string &hostname, const std::string &port,
            ChunkScheduler &chunkScheduler,
            MetaDataProvider &metaDataProvider,
-           DiskWriter& diskWriter)
+           DiskWriter& diskWriter,
+           const SocketOptions &socketOptions,
+           DeltaSync *deltaSync = nullptr)
             : chunkScheduler(chunkScheduler),
               metaDataProvider(metaDataProvider),
-              diskWriter(diskWriter) {
+              diskWriter(diskWriter),
+              deltaSync(deltaSync) {
         addrinfo hints{}, *serverInfo = nullptr;
         hints.ai_family = AF_UNSPEC;
         hints.ai_socktype = SOCK_STREAM;
         int rv;
         if ((rv = getaddrinfo(hostname.c_str(), port.c_str(), &hints,
                               &serverInfo)) != 0) {
-            std::cerr << "getaddrinfo: " << gai_strerror(rv) << std::endl;
+            LOG_ERROR("getaddrinfo: %s", gai_strerror(rv));
             freeaddrinfo(serverInfo);
             throw std::runtime_error(hostname + ":" + port);
         }
@@ -39,11 +51,12 @@ public:
         for (rp = serverInfo; rp != nullptr; rp = rp->ai_next) {
             if ((serverSock = socket(rp->ai_family, rp->ai_socktype,
                                      rp->ai_protocol)) == -1) {
-                perror("socket");
+                LOG_ERROR("socket: %s", strerror(errno));
                 continue;
             }
 
             serverIp = ipToStr(rp->ai_addr);
+            socketOptions.apply(serverSock);
             if (connect(serverSock, rp->ai_addr, rp->ai_addrlen) != -1)
                 break;  /* Success */
 
@@ -57,7 +70,7 @@ public:
         }
 
         if (fcntl(serverSock, F_SETFL, O_NONBLOCK) == -1) {
-            perror("fcntl");
+            LOG_ERROR("fcntl: %s", strerror(errno));
             tryClose(serverSock, serverIp);
             throw std::runtime_error(serverIp);
         }
@@ -67,14 +80,21 @@ public:
         event.data.fd = serverSock;
 
         if (epoll_ctl(epfd, EPOLL_CTL_ADD, serverSock, &event) == -1) {
-            perror("epoll_ctl");
+            LOG_ERROR("epoll_ctl: %s", strerror(errno));
             tryClose(serverSock, serverIp);
             throw std::runtime_error(serverIp);
         }
-        std::cout << "Server " << serverIp << " successfully registered" << std::endl;
+        peerStats = Stats::registerPeer(serverIp);
+        LOG_INFO("Server %s successfully registered", serverIp.c_str());
+        LOG_DEBUG("(%s) socket options: %s", serverIp.c_str(), socketOptions.describe(serverSock).c_str());
     }
 
     ~Worker() {
+        /* Still in flight when another worker completed the download. */
+        if (chunkOpen && !blobLenPending)
+            Stats::add(Counter::WASTED_BYTES, receivedBytes);
+        chunkScheduler.removeSource(serverSock);
+        Stats::unregisterPeer(peerStats);
         disconnect();
     }
 
@@ -83,6 +103,12 @@ public:
             case STATE::INIT:
                 readMetadata();
                 return;
+            case STATE::CONTROL_REQUEST:
+                sendControlRequest();
+                return;
+            case STATE::CONTROL_REPLY:
+                readControlReply();
+                return;
             case STATE::CHUNK_REQUEST:
                 requestChunk();
                 return;
@@ -98,9 +124,21 @@ public:
         return serverSock;
     }
 
+    /* Gives the chunk in progress back to the scheduler after a failure. */
+    void abort() {
+        if (chunkOpen) {
+            if (!blobLenPending)
+                Stats::add(Counter::WASTED_BYTES, receivedBytes);
+            diskWriter.abortChunk(writerFd);
+            chunkScheduler.releaseChunk(chunkToDownload);
+            chunkOpen = false;
+        }
+        state = STATE::CLOSED;
+    }
+
 private:
     void disconnect() {
-        std::cout << "Disconnecting from " << serverIp << std::endl;
+        LOG_INFO("Disconnecting from %s", serverIp.c_str());
         tryClose(serverSock, serverIp);
     }
 
@@ -109,60 +147,187 @@ private:
             return;
 
         MsgMetadata msg(buf);
-        metaDataProvider.setMetaData(msg.getFilename(), msg.getFilesize());
-        std::cout << "(" << serverIp << ") readMetadata - filename: " << metaDataProvider.getFilename() << " filesize: "
-                  << metaDataProvider.getFilesize() << " bytes" << std::endl;
+        if (!msg.hasSafeFilename())
+            throw std::runtime_error(serverIp + " sent an unsafe file name: " + msg.getFilename());
+        metaDataProvider.setMetaData(msg.getFilename(), msg.getFilesize(), msg.getFlags());
+        LOG_INFO("(%s) readMetadata - filename: %s filesize: %lu bytes", serverIp.c_str(),
+                 metaDataProvider.getFilename().c_str(), metaDataProvider.getFilesize());
+
+        if (metaDataProvider.isTree()) {
+            if (deltaSync != nullptr)
+                throw std::runtime_error("--base cannot be used for a directory tree");
+            if (!metaDataProvider.hasManifest()) {
+                sendControl(MsgRequest::MANIFEST, 0);
+                return;
+            }
+        }
+        if (deltaSync != nullptr)
+            sendControl(MsgRequest::HASHES, 0);
+        else
+            requestAvailability();
+    }
+
+    /* A tree's file list, needed to unpack it once downloaded. */
+    void onManifest() {
+        MsgManifest msg(message.data(), message.size());
+        if ((metaDataProvider.isBlocks() || metaDataProvider.isStored()) &&
+            msg.getTotalSize() != metaDataProvider.getFilesize())
+            throw std::runtime_error(serverIp + " sent a manifest that does not match the file size");
+        metaDataProvider.setManifest(msg);
+        LOG_INFO("(%s) manifest: %zu entries", serverIp.c_str(), msg.getEntries().size());
+        requestAvailability();
+    }
 
-        state = STATE::CHUNK_REQUEST;
+    /* Asks which chunks the server gained since the last reply. A server that
+       can still gain chunks (a peer) holds the reply until it has news. */
+    void requestAvailability() {
+        sendControl(MsgRequest::AVAILABILITY, availabilityVersion);
+    }
+
+    void sendControl(MsgRequest::Kind kind, u_int64_t arg) {
+        request = MsgRequest::make(kind, arg);
+        state = STATE::CONTROL_REQUEST;
+        sendControlRequest();
+    }
+
+    void sendControlRequest() {
+        if (!writeAllNoBlocking(&request, sizeof(request)))
+            return;
+        state = STATE::CONTROL_REPLY;
+    }
+
+    void readControlReply() {
+        if (!readMessageNoBlocking())
+            return;
+        switch (MsgRequest::kind(request)) {
+            case MsgRequest::HASHES:
+                onHashes();
+                return;
+            case MsgRequest::MANIFEST:
+                onManifest();
+                return;
+            default:
+                onAvailability();
+        }
+    }
+
+    /* Delta sync: the first hashes to arrive decide which blocks to fetch.
+       Every server with the original file has all blocks; one whose hashes
+       differ has another file and is dropped. */
+    void onHashes() {
+        MsgHashes msg(message.data(), message.size());
+        if (!deltaSync->isPlanned())
+            chunkScheduler.useRawChunks(msg.getHashes().size(), deltaSync->plan(msg));
+        else if (!deltaSync->matchesPlan(msg))
+            throw std::runtime_error(serverIp + " has a different file than the other servers");
+        ChunkBitmap all(deltaSync->getRawChunks());
+        all.setAll();
+        chunkScheduler.updateAvailability(serverSock, all);
+        sourceFinal = true;
+        requestChunk(true);
+    }
+
+    void onAvailability() {
+        MsgAvailability msg(message.data(), message.size(), metaDataProvider.getNumberOfChunks());
+        availabilityVersion = msg.getVersion();
+        sourceFinal = msg.isFinal();
+        chunkScheduler.updateAvailability(serverSock, msg.getBitmap());
+        LOG_DEBUG("(%s) availability version %lu%s", serverIp.c_str(), availabilityVersion,
+                  sourceFinal ? " (final)" : "");
         requestChunk(true);
     }
 
     void requestChunk(bool newChunk = false) {
         if (newChunk) {
-            try {
-                chunkToDownload = chunkScheduler.getChunkToDownload();
-                chunkSize = metaDataProvider.getSizeOfChunk(chunkToDownload);
-            } catch (const ChunkScheduler::NoMoreChunks& e) {
-                std::cout << "No more chunks to download, closing worker..." << std::endl;
-                state = STATE::CLOSED;
-                throw e;
+            if (!chunkScheduler.getChunkToDownload(serverSock, chunkToDownload)) {
+                if (sourceFinal) {
+                    LOG_INFO("No more chunks to download from %s, closing worker...", serverIp.c_str());
+                    state = STATE::CLOSED;
+                    throw ChunkScheduler::NoMoreChunks();
+                }
+                requestAvailability();
+                return;
             }
             writerFd = diskWriter.createFileFd(serverSock, chunkToDownload);
+            chunkOpen = true;
+            if (deltaSync != nullptr) {
+                /* The size of a compressed block precedes it. */
+                request = MsgRequest::make(MsgRequest::RAW_CHUNK, chunkToDownload);
+                blobLenPending = true;
+            } else if (metaDataProvider.isBlocks()) {
+                request = chunkToDownload;
+                blobLenPending = true;
+            } else {
+                request = chunkToDownload;
+                chunkSize = metaDataProvider.getSizeOfChunk(chunkToDownload);
+            }
+            state = STATE::CHUNK_REQUEST;
         }
-        if (!writeAllNoBlocking(&chunkToDownload, sizeof(chunkToDownload)))
+        if (!writeAllNoBlocking(&request, sizeof(request)))
             return;
 
-        std::cout << "Requested chunk " << chunkToDownload << " from " << serverIp << std::endl;
+        LOG_DEBUG("Requested chunk %lu from %s", chunkToDownload, serverIp.c_str());
+        requestedAt = steady_clock::now();
         state = STATE::DOWNLOADING;
     }
 
     void downloadChunk() {
+        if (blobLenPending) {
+            if (!readAllNoBlocking(sizeof(chunkSize)))
+                return;
+            memcpy(&chunkSize, buf, sizeof(chunkSize));
+            if (chunkSize == 0 || chunkSize > MAX_MESSAGE_SIZE)
+                throw std::runtime_error(serverIp + " sent an invalid block size");
+            blobLenPending = false;
+            return;
+        }
+
         u_int64_t bytesToRead{BUF_SIZE};
         if (chunkSize - receivedBytes < BUF_SIZE)
             bytesToRead = chunkSize - receivedBytes;
 
         ssize_t rv = read(serverSock, buf, bytesToRead);
         if (rv == -1) {
-            perror("read");
+            LOG_ERROR("read: %s", strerror(errno));
             throw std::runtime_error(serverIp);
+        } else if (rv == 0) {
+            throw std::runtime_error(serverIp + " closed the connection");
         }
         receivedBytes += rv;
+        Stats::add(Counter::BYTES_IN, static_cast<u_int64_t>(rv));
+        peerStats->addBytes(static_cast<u_int64_t>(rv));
         diskWriter.writeBuf(writerFd, buf, static_cast<size_t>(rv));
 
         if (receivedBytes == chunkSize) {
-            diskWriter.closeChunk(writerFd);
+            const u_int64_t latencyUs = elapsedUs(requestedAt);
+            Stats::record(Hist::CHUNK_LATENCY_US, latencyUs);
+            Stats::add(Counter::CHUNKS_DONE);
+            peerStats->chunkDone(latencyUs);
+            /* Another worker finished the same chunk first. */
+            if (chunkScheduler.getSavedChunks().has(chunkToDownload))
+                Stats::add(Counter::WASTED_BYTES, chunkSize);
+            chunkOpen = false;
+            try {
+                diskWriter.closeChunk(writerFd);
+            } catch (const std::runtime_error &) {
+                /* The file is dropped already, the chunk has to come again. */
+                Stats::add(Counter::WASTED_BYTES, chunkSize);
+                chunkScheduler.releaseChunk(chunkToDownload);
+                throw;
+            }
             receivedBytes = 0;
-            state = STATE::CHUNK_REQUEST;
             requestChunk(true);
         }
     }
 
     bool readAllNoBlocking(size_t count) {
         assert(count <= BUF_SIZE);
-        ssize_t rv = read(serverSock, buf, count - receivedBytes);
+        ssize_t rv = read(serverSock, buf + receivedBytes, count - receivedBytes);
         if (rv == -1) {
-            perror("read");
+            LOG_ERROR("read: %s", strerror(errno));
             throw std::runtime_error(serverIp);
+        } else if (rv == 0) {
+            throw std::runtime_error(serverIp + " closed the connection");
         }
         receivedBytes += rv;
         if (receivedBytes == count) {
@@ -172,10 +337,40 @@ private:
         return false;
     }
 
+    /* Reads a length-prefixed control reply into `message`. */
+    bool readMessageNoBlocking() {
+        if (!messageLenRead) {
+            if (!readAllNoBlocking(sizeof(u_int64_t)))
+                return false;
+            u_int64_t messageLen;
+            memcpy(&messageLen, buf, sizeof(messageLen));
+            if (messageLen > MAX_MESSAGE_SIZE)
+                throw std::runtime_error(serverIp + " sent an oversized message");
+            message.resize(messageLen);
+            messageLenRead = true;
+        }
+
+        while (receivedBytes < message.size()) {
+            ssize_t rv = read(serverSock, message.data() + receivedBytes, message.size() - receivedBytes);
+            if (rv == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return false;
+                LOG_ERROR("read: %s", strerror(errno));
+                throw std::runtime_error(serverIp);
+            } else if (rv == 0) {
+                throw std::runtime_error(serverIp + " closed the connection");
+            }
+            receivedBytes += rv;
+        }
+        receivedBytes = 0;
+        messageLenRead = false;
+        return true;
+    }
+
     bool writeAllNoBlocking(void *msg, size_t count) {
         ssize_t rv = write(serverSock, (u_int8_t*)msg + sendBytes, count - sendBytes);
         if (rv == -1) {
-            perror("write");
+            LOG_ERROR("write: %s", strerror(errno));
             throw std::runtime_error(serverIp);
         }
         sendBytes += rv;
@@ -187,13 +382,15 @@ private:
     }
 
     enum STATE {
-        INIT, CHUNK_REQUEST, DOWNLOADING, CLOSED
+        INIT, CONTROL_REQUEST, CONTROL_REPLY, CHUNK_REQUEST, DOWNLOADING, CLOSED
     };
     static const u_int64_t BUF_SIZE{8192};
+    static const u_int64_t MAX_MESSAGE_SIZE{64 * 1024 * 1024};
 
     ChunkScheduler &chunkScheduler;
     MetaDataProvider &metaDataProvider;
     DiskWriter& diskWriter;
+    DeltaSync *deltaSync;
 
     u_int8_t buf[BUF_SIZE];
     size_t receivedBytes{0};
@@ -201,8 +398,17 @@ private:
 
     STATE state{INIT};
     std::string serverIp;
+    PeerStats *peerStats{nullptr};
+    steady_clock::time_point requestedAt;
     u_int64_t chunkSize;
     u_int64_t chunkToDownload;
+    u_int64_t request{};
+    u_int64_t availabilityVersion{0};
+    bool sourceFinal{false};
+    bool blobLenPending{false};
+    std::vector<u_int8_t> message;
+    bool messageLenRead{false};
     int serverSock{-1};
     int writerFd;
+    bool chunkOpen{false};
 };
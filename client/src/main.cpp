@@ -3,7 +3,9 @@
 int main(int argc, char **argv) {
     try {
         Client client(argc, argv);
+        return client.isCompleted() ? EXIT_SUCCESS : EXIT_FAILURE;
     } catch (const std::exception& e) {
-        std::cout << "EXCEPTION: " << e.what() << std::endl;
+        LOG_ERROR("EXCEPTION: %s", e.what());
     }
+    return EXIT_FAILURE;
 }
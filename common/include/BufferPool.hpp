@@ -0,0 +1,51 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <sys/types.h>
+#include <vector>
+#include "DiskIo.hpp"
+
+/* Aligned buffers of one size for chunks being sent. take() hands a buffer
+   out as a shared pointer whose deleter gives it back; of the buffers given
+   back at most `maxIdle` are kept for reuse and the rest are freed, so a
+   burst of concurrent sends does not pin its peak memory. Thread safe; the
+   pool must outlive the buffers it handed out. */
+class BufferPool {
+public:
+    BufferPool(size_t bufferSize, size_t maxIdle) : bufferSize(bufferSize), maxIdle(maxIdle) {}
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    std::shared_ptr<u_int8_t> take() {
+        DiskIo::AlignedBuffer buffer;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!idle.empty()) {
+                buffer = std::move(idle.back());
+                idle.pop_back();
+            }
+        }
+        if (!buffer)
+            buffer = DiskIo::allocAligned(bufferSize);
+        return std::shared_ptr<u_int8_t>(buffer.release(), [this](u_int8_t *ptr) { giveBack(ptr); });
+    }
+
+    size_t getBufferSize() const {
+        return bufferSize;
+    }
+
+private:
+    void giveBack(u_int8_t *ptr) {
+        DiskIo::AlignedBuffer buffer(ptr);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idle.size() < maxIdle)
+            idle.push_back(std::move(buffer));
+    }
+
+    const size_t bufferSize;
+    const size_t maxIdle;
+    std::mutex mutex;
+    std::vector<DiskIo::AlignedBuffer> idle;
+};
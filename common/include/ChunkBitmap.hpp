@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+/* One bit per chunk. Serialised as alternating run lengths (clear run first,
+   then set, then clear, ...) written as LEB128 varints, so a complete or
+   mostly contiguous bitmap costs a few bytes whatever the chunk count. */
+class ChunkBitmap {
+public:
+    ChunkBitmap() = default;
+
+    explicit ChunkBitmap(u_int64_t bits) {
+        resize(bits);
+    }
+
+    void resize(u_int64_t newBits) {
+        bits = newBits;
+        words.resize((bits + 63) / 64, 0);
+    }
+
+    u_int64_t size() const {
+        return bits;
+    }
+
+    bool test(u_int64_t bit) const {
+        return bit < bits && (words[bit / 64] >> (bit % 64) & 1);
+    }
+
+    void set(u_int64_t bit) {
+        words[bit / 64] |= u_int64_t{1} << (bit % 64);
+    }
+
+    void clear(u_int64_t bit) {
+        words[bit / 64] &= ~(u_int64_t{1} << (bit % 64));
+    }
+
+    void setAll() {
+        for (u_int64_t bit = 0; bit < bits; ++bit)
+            set(bit);
+    }
+
+    void merge(const ChunkBitmap &other) {
+        if (other.bits > bits)
+            resize(other.bits);
+        for (size_t i = 0; i < other.words.size(); ++i)
+            words[i] |= other.words[i];
+    }
+
+    u_int64_t count() const {
+        u_int64_t total{0};
+        for (u_int64_t word : words)
+            total += static_cast<u_int64_t>(__builtin_popcountll(word));
+        return total;
+    }
+
+    void encodeRuns(std::vector<u_int8_t> &out) const {
+        bool current{false};
+        u_int64_t run{0};
+        for (u_int64_t bit = 0; bit < bits; ++bit) {
+            if (test(bit) != current) {
+                putVarint(out, run);
+                current = !current;
+                run = 0;
+            }
+            ++run;
+        }
+        putVarint(out, run);
+    }
+
+    /* Decodes runs from [pos, end) into a bitmap of `bitCount` bits. */
+    static ChunkBitmap decodeRuns(const u_int8_t *pos, const u_int8_t *end, u_int64_t bitCount) {
+        ChunkBitmap bitmap(bitCount);
+        bool current{false};
+        u_int64_t bit{0};
+        while (pos != end) {
+            const u_int64_t run = getVarint(pos, end);
+            if (run > bitCount - bit)
+                throw std::runtime_error("Malformed chunk bitmap");
+            if (current)
+                for (u_int64_t i = bit; i < bit + run; ++i)
+                    bitmap.set(i);
+            bit += run;
+            current = !current;
+        }
+        return bitmap;
+    }
+
+    /* Parses "0-99,120,200-" (inclusive, open ended ranges allowed). */
+    static ChunkBitmap fromRanges(const std::string &spec, u_int64_t bitCount) {
+        ChunkBitmap bitmap(bitCount);
+        size_t pos{0};
+        while (pos <= spec.size()) {
+            size_t end = spec.find(',', pos);
+            if (end == std::string::npos)
+                end = spec.size();
+            const std::string range = spec.substr(pos, end - pos);
+            pos = end + 1;
+            if (range.empty())
+                continue;
+
+            const size_t dash = range.find('-');
+            u_int64_t first, last;
+            try {
+                first = std::stoull(range.substr(0, dash));
+                last = dash == std::string::npos ? first
+                       : dash + 1 == range.size() ? bitCount - 1
+                       : std::stoull(range.substr(dash + 1));
+            } catch (const std::logic_error &) {
+                throw std::runtime_error("Invalid chunk range: " + range);
+            }
+            if (first > last)
+                throw std::runtime_error("Invalid chunk range: " + range);
+            for (u_int64_t bit = first; bit <= last && bit < bitCount; ++bit)
+                bitmap.set(bit);
+        }
+        return bitmap;
+    }
+
+    static void putVarint(std::vector<u_int8_t> &out, u_int64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<u_int8_t>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<u_int8_t>(value));
+    }
+
+    static u_int64_t getVarint(const u_int8_t *&pos, const u_int8_t *end) {
+        u_int64_t value{0};
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            if (pos == end)
+                throw std::runtime_error("Truncated varint");
+            const u_int8_t byte = *pos++;
+            value |= static_cast<u_int64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                return value;
+        }
+        throw std::runtime_error("Malformed varint");
+    }
+
+private:
+    u_int64_t bits{0};
+    std::vector<u_int64_t> words;
+};
+
+/* Chunks a source can serve, plus the order in which they became available.
+   The version is the number of chunks added so far, which lets a client ask
+   only for what changed since the version it has seen. A final log will not
+   gain chunks any more. */
+class AvailabilityLog {
+public:
+    /* A final log of the chunks set in `held`. */
+    static AvailabilityLog of(const ChunkBitmap &held) {
+        AvailabilityLog log;
+        log.resize(held.size());
+        for (u_int64_t chunkNo = 0; chunkNo < held.size(); ++chunkNo)
+            if (held.test(chunkNo))
+                log.add(chunkNo);
+        log.setFinal();
+        return log;
+    }
+
+    void resize(u_int64_t chunks) {
+        available.resize(chunks);
+    }
+
+    void add(u_int64_t chunkNo) {
+        if (chunkNo >= available.size() || available.test(chunkNo))
+            return;
+        available.set(chunkNo);
+        added.push_back(chunkNo);
+    }
+
+    bool has(u_int64_t chunkNo) const {
+        return available.test(chunkNo);
+    }
+
+    u_int64_t version() const {
+        return added.size();
+    }
+
+    u_int64_t chunks() const {
+        return available.size();
+    }
+
+    void setFinal() {
+        finalFlag = true;
+    }
+
+    bool isFinal() const {
+        return finalFlag || (available.size() != 0 && added.size() == available.size());
+    }
+
+    /* Chunks added after version `since` (all of them for 0). */
+    ChunkBitmap since(u_int64_t since) const {
+        if (since == 0 || since > added.size())
+            return available;
+        ChunkBitmap delta(available.size());
+        for (u_int64_t i = since; i < added.size(); ++i)
+            delta.set(added[i]);
+        return delta;
+    }
+
+private:
+    ChunkBitmap available;
+    std::vector<u_int64_t> added;
+    bool finalFlag{false};
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "Stats.hpp"
+
+/* Bounded LRU of chunk contents keyed by chunk number. Entries are shared,
+   so a chunk that is evicted while being sent stays alive until the send
+   is done. */
+class ChunkCache {
+public:
+    using Data = std::shared_ptr<const std::vector<u_int8_t>>;
+
+    explicit ChunkCache(size_t capacity) : capacity(capacity) {}
+
+    /* Null on a miss. */
+    Data get(u_int64_t chunkNo) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(chunkNo);
+        if (it == entries.end()) {
+            Stats::add(Counter::CACHE_MISSES);
+            return nullptr;
+        }
+        Stats::add(Counter::CACHE_HITS);
+        lru.splice(lru.begin(), lru, it->second.lruPos);
+        return it->second.data;
+    }
+
+    void put(u_int64_t chunkNo, Data data) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (entries.find(chunkNo) != entries.end())
+            return;
+        lru.push_front(chunkNo);
+        usedBytes += data->size();
+        entries[chunkNo] = Entry{std::move(data), lru.begin()};
+        while (usedBytes > capacity && lru.size() > 1) {
+            auto victim = entries.find(lru.back());
+            usedBytes -= victim->second.data->size();
+            entries.erase(victim);
+            lru.pop_back();
+        }
+    }
+
+private:
+    struct Entry {
+        Data data;
+        std::list<u_int64_t>::iterator lruPos;
+    };
+
+    const size_t capacity;
+    size_t usedBytes{0};
+    std::mutex mutex;
+    std::list<u_int64_t> lru;
+    std::unordered_map<u_int64_t, Entry> entries;
+};
@@ -0,0 +1,353 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <fcntl.h>
+#include <memory>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include "ChunkSource.hpp"
+#include "Connection.hpp"
+#include "Log.hpp"
+#include "MsgManifest.hpp"
+#include "MsgMetadata.hpp"
+#include "RateLimiter.hpp"
+#include "ReadyQueue.hpp"
+#include "SocketOptions.hpp"
+#include "Stats.hpp"
+#include "utils.hpp"
+
+/* Serving side of the chunk protocol, shared by haserver and by haclient's
+   peer mode. It does not own the event loop: the caller passes every epoll
+   event for a fd it owns() to handleEvent() and calls serveActive() once per
+   loop iteration, waiting at most nextTimeoutMs().
+
+   Connections are only accepted once setMetadata() was called; until then
+   they wait in the listen backlog. A peer can therefore listen before it has
+   heard from any server. */
+class ChunkServer {
+public:
+    ChunkServer(int epFd, ChunkSource &chunkSource)
+            : epFd(epFd), chunkSource(chunkSource), globalBucket(std::make_shared<SharedTokenBucket>()) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = readyQueue.getFd();
+        if (epoll_ctl(epFd, EPOLL_CTL_ADD, readyQueue.getFd(), &event) == -1) {
+            LOG_ERROR("epoll_ctl: %s", strerror(errno));
+            throw std::runtime_error("Cannot watch the ready queue");
+        }
+        chunkSource.subscribe(&readyQueue);
+    }
+
+    ~ChunkServer() {
+        chunkSource.unsubscribe(&readyQueue);
+        Stats::adjust(Gauge::ACTIVE_CONNECTIONS, -static_cast<int64_t>(connections.size()));
+        connections.clear();
+        if (listenSock != -1)
+            close(listenSock);
+    }
+
+    ChunkServer(const ChunkServer &) = delete;
+    ChunkServer &operator=(const ChunkServer &) = delete;
+
+    void listenOn(const std::string &port) {
+        addrinfo hints{}, *serverInfo;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int rv;
+        if ((rv = getaddrinfo(nullptr, port.c_str(), &hints, &serverInfo)) != 0) {
+            LOG_ERROR("getaddrinfo: %s", gai_strerror(rv));
+            throw std::runtime_error("Cannot resolve port " + port);
+        }
+
+        addrinfo *rp;
+        for (rp = serverInfo; rp != nullptr; rp = rp->ai_next) {
+            if ((listenSock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1) {
+                LOG_ERROR("socket: %s", strerror(errno));
+                continue;
+            }
+
+            int enable = 1;
+            if (setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) == -1 ||
+                setsockopt(listenSock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1) {
+                LOG_ERROR("setsockopt: %s", strerror(errno));
+                freeaddrinfo(serverInfo);
+                throw std::runtime_error("Cannot set socket options");
+            }
+            socketOptions.apply(listenSock);
+
+            if (bind(listenSock, rp->ai_addr, rp->ai_addrlen) == 0)
+                break;
+            LOG_ERROR("bind: %s", strerror(errno));
+            close(listenSock);
+            listenSock = -1;
+        }
+        freeaddrinfo(serverInfo);
+
+        if (rp == nullptr)
+            throw std::runtime_error("Could not bind");
+
+        if (listen(listenSock, LISTEN_BACKLOG) < 0) {
+            LOG_ERROR("listen: %s", strerror(errno));
+            throw std::runtime_error("Cannot listen on port " + port);
+        }
+        if (fcntl(listenSock, F_SETFL, O_NONBLOCK) == -1) {
+            LOG_ERROR("fcntl: %s", strerror(errno));
+            throw std::runtime_error("Cannot listen on port " + port);
+        }
+        LOG_INFO("Socket options: %s", socketOptions.describe(listenSock).c_str());
+        if (metadataSet)
+            startAccepting();
+    }
+
+    void setMetadata(const std::string &filename, u_int64_t dataSize, u_int64_t flags = 0) {
+        MsgMetadata msg(filename, dataSize, flags);
+        msg.encode(metadataMsg);
+        chunks = getNumberOfChunks(dataSize, CHUNK_SIZE);
+        metadataSet = true;
+        if (listenSock != -1)
+            startAccepting();
+    }
+
+    /* The MANIFEST reply of a tree, set before setMetadata(). */
+    void setManifest(const std::vector<MsgManifest::Entry> &entries) {
+        manifestMsg.clear();
+        MsgManifest::encode(entries, manifestMsg);
+    }
+
+    bool hasMetadata() const {
+        return metadataSet;
+    }
+
+    bool owns(int fd) const {
+        return fd == listenSock || fd == readyQueue.getFd() || connections.find(fd) != connections.end();
+    }
+
+    void handleEvent(int fd, u_int32_t events) {
+        if (fd == listenSock) {
+            acceptClients();
+            return;
+        }
+        if (fd == readyQueue.getFd()) {
+            readyQueue.drain(readyChunks);
+            for (u_int64_t chunkNo : readyChunks)
+                chunkAvailable(chunkNo);
+            return;
+        }
+
+        auto it = connections.find(fd);
+        if (it == connections.end())
+            return;
+        Connection &connection = *it->second;
+
+        try {
+            if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+                throw Connection::ClientDisconnected();
+            if (events & EPOLLOUT)
+                connection.onWritable();
+            if (events & EPOLLIN)
+                connection.onReadable();
+        } catch (const Connection::ClientDisconnected &) {
+            LOG_INFO("(%s) - Client disconnected", connection.getClientIp().c_str());
+            closeConnection(fd);
+            return;
+        } catch (const std::exception &e) {
+            LOG_ERROR("(%s) - %s", connection.getClientIp().c_str(), e.what());
+            closeConnection(fd);
+            return;
+        }
+        updateConnection(connection);
+    }
+
+    /* One round robin pass: every connection with data to send gets at most
+       QUANTUM bytes, further capped by its own and the global token bucket.
+       Connections that still have data go to the back. */
+    void serveActive() {
+        const auto now = steady_clock::now();
+        for (size_t n = active.size(); n > 0; --n) {
+            const int fd = active.front();
+            active.pop_front();
+            auto it = connections.find(fd);
+            if (it == connections.end())
+                continue;
+            Connection &connection = *it->second;
+
+            if (connection.wantsToSend()) {
+                u_int64_t grant = std::min<u_int64_t>(QUANTUM, connection.remainingInChunk());
+                grant = std::min(grant, connection.getBucket().available(now));
+                if (grant > 0)
+                    grant = globalBucket->take(grant, now);
+                if (grant > 0) {
+                    size_t sent;
+                    try {
+                        sent = connection.send(grant);
+                    } catch (const std::exception &e) {
+                        LOG_ERROR("(%s) - %s", connection.getClientIp().c_str(), e.what());
+                        globalBucket->refund(grant);
+                        closeConnection(fd);
+                        continue;
+                    }
+                    connection.getBucket().consume(sent);
+                    if (sent < grant)
+                        globalBucket->refund(grant - sent);
+                }
+            }
+
+            connection.queued = false;
+            updateConnection(connection);
+        }
+    }
+
+    /* 0 when someone can send right away, the time until the first throttled
+       connection gets tokens back, or -1 when nothing is queued. */
+    int nextTimeoutMs() {
+        const auto now = steady_clock::now();
+        bool anyQueued{false};
+        steady_clock::duration wait = steady_clock::duration::max();
+        for (int fd : active) {
+            Connection &connection = *connections.at(fd);
+            if (!connection.wantsToSend())
+                continue;
+            anyQueued = true;
+            const u_int64_t wanted = std::min<u_int64_t>(MIN_GRANT, connection.remainingInChunk());
+            wait = std::min(wait, std::max(connection.getBucket().waitFor(wanted, now),
+                                           globalBucket->waitFor(wanted, now)));
+        }
+        if (!anyQueued)
+            return -1;
+        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(wait).count();
+        return wait == steady_clock::duration::zero() ? 0 : static_cast<int>(ms) + 1;
+    }
+
+    /* Wakes connections that were waiting for `chunkNo` to be downloaded
+       or prepared. */
+    void chunkAvailable(u_int64_t chunkNo) {
+        for (auto it = connections.begin(); it != connections.end();) {
+            Connection &connection = *it->second;
+            ++it;
+            try {
+                connection.chunkAvailable(chunkNo);
+            } catch (const std::exception &e) {
+                LOG_ERROR("(%s) - %s", connection.getClientIp().c_str(), e.what());
+                closeConnection(connection.getSock());
+                continue;
+            }
+            updateConnection(connection);
+        }
+    }
+
+    /* Servers sharing a bucket share the global rate limit; several reactor
+       threads of one process do. */
+    void shareGlobalBucket(std::shared_ptr<SharedTokenBucket> bucket) {
+        globalBucket = std::move(bucket);
+        globalBucket->setRate(limits.globalRate);
+    }
+
+    /* Applies to sockets created after the call; set it before listenOn(). */
+    void setSocketOptions(const SocketOptions &options) {
+        socketOptions = options;
+    }
+
+    /* New rates apply to every open connection from the next round on. */
+    void setLimits(const RateLimits &newLimits) {
+        limits = newLimits;
+        globalBucket->setRate(limits.globalRate);
+        for (auto &connection : connections)
+            connection.second->getBucket().setRate(limits.clientRate);
+    }
+
+private:
+    void startAccepting() {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = listenSock;
+        if (epoll_ctl(epFd, EPOLL_CTL_ADD, listenSock, &event) == -1) {
+            LOG_ERROR("epoll_ctl: %s", strerror(errno));
+            throw std::runtime_error("Cannot accept connections");
+        }
+    }
+
+    void acceptClients() {
+        while (true) {
+            sockaddr_storage clientAddr{};
+            socklen_t addrlen = sizeof(clientAddr);
+            int clientSock = accept4(listenSock, reinterpret_cast<sockaddr *>(&clientAddr), &addrlen,
+                                     SOCK_NONBLOCK);
+            if (clientSock < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+                    LOG_ERROR("accept: %s", strerror(errno));
+                return;
+            }
+
+            const std::string clientIpStr = ipToStr(reinterpret_cast<sockaddr *>(&clientAddr));
+            LOG_INFO("Client connected: %s", clientIpStr.c_str());
+            Stats::add(Counter::CONNECTIONS);
+
+            auto connection = std::make_unique<Connection>(clientSock, clientIpStr, chunkSource, chunks,
+                                                           metadataMsg, manifestMsg);
+            connection->getBucket().setRate(limits.clientRate);
+            socketOptions.applyAccepted(clientSock);
+            connection->setMoreFlag(socketOptions.moreFlag());
+            epoll_event event{};
+            event.events = connection->interest();
+            event.data.fd = clientSock;
+            if (epoll_ctl(epFd, EPOLL_CTL_ADD, clientSock, &event) == -1) {
+                LOG_ERROR("epoll_ctl: %s", strerror(errno));
+                continue;
+            }
+            connections[clientSock] = std::move(connection);
+            Stats::adjust(Gauge::ACTIVE_CONNECTIONS, 1);
+            handleEvent(clientSock, EPOLLOUT);
+        }
+    }
+
+    /* Re-queues the connection if it has data to send and syncs its epoll
+       interest with its state. */
+    void updateConnection(Connection &connection) {
+        if (connection.remainingInChunk() > 0 && !connection.queued) {
+            connection.queued = true;
+            active.push_back(connection.getSock());
+        }
+
+        epoll_event event{};
+        event.events = connection.interest();
+        event.data.fd = connection.getSock();
+        if (epoll_ctl(epFd, EPOLL_CTL_MOD, connection.getSock(), &event) == -1)
+            LOG_ERROR("epoll_ctl: %s", strerror(errno));
+    }
+
+    void closeConnection(int fd) {
+        active.erase(std::remove(active.begin(), active.end(), fd), active.end());
+        if (connections.erase(fd) != 0)
+            Stats::adjust(Gauge::ACTIVE_CONNECTIONS, -1);
+    }
+
+    const int LISTEN_BACKLOG{128};
+    /* Bytes a connection may send per round robin turn. */
+    const u_int64_t QUANTUM{64 * 1024};
+    /* Throttled connections are woken once this much is available. */
+    const u_int64_t MIN_GRANT{16 * 1024};
+
+    const int epFd;
+    ChunkSource &chunkSource;
+    u_int64_t chunks{0};
+    /* An empty file has no chunks, but metadata all the same. */
+    bool metadataSet{false};
+    int listenSock{-1};
+    u_int8_t metadataMsg[MsgMetadata::MSG_SIZE];
+    std::vector<u_int8_t> manifestMsg;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    std::deque<int> active;
+    RateLimits limits;
+    std::shared_ptr<SharedTokenBucket> globalBucket;
+    SocketOptions socketOptions;
+    /* Chunks the source prepared in the background. */
+    ReadyQueue readyQueue;
+    std::vector<u_int64_t> readyChunks;
+};
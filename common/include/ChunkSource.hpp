@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <sys/types.h>
+#include <vector>
+#include "ChunkBitmap.hpp"
+#include "ReadyQueue.hpp"
+
+/* Where a ChunkServer takes the chunks it sends from: the compressed
+   artifact on a server, the already downloaded chunks on a peer client. */
+class ChunkSource {
+public:
+    /* Pins one chunk while it is being sent. `data` is null when the bytes
+       have to be read on demand through bytes(); otherwise `owned`, if set,
+       keeps the memory behind it alive. */
+    struct ChunkRef {
+        u_int64_t chunkNo{};
+        u_int64_t size{};
+        const u_int8_t *data{nullptr};
+        std::shared_ptr<const void> owned;
+    };
+
+    static const u_int64_t HASHES_READY{~0ULL};
+
+    virtual ~ChunkSource() = default;
+
+    /* Chunks that can be served right now and the order they arrived in. */
+    virtual const AvailabilityLog &availability() const = 0;
+
+    bool has(u_int64_t chunkNo) const {
+        return availability().has(chunkNo);
+    }
+
+    virtual ChunkRef acquire(u_int64_t chunkNo) = 0;
+
+    /* acquire() for the event loop: false while the chunk is still being
+       prepared in the background, in which case every subscribed ReadyQueue
+       gets its number once it is worth asking again. */
+    virtual bool tryAcquire(u_int64_t chunkNo, ChunkRef &ref) {
+        ref = acquire(chunkNo);
+        return true;
+    }
+
+    /* Called as a client requests `chunkNo` after `previousChunk`; sources
+       use it to tell its sequential reads from random ones. */
+    virtual void willRead(u_int64_t chunkNo, u_int64_t previousChunk) {
+        (void) chunkNo;
+        (void) previousChunk;
+    }
+
+    /* Sources that prepare chunks in the background report to these. */
+    virtual void subscribe(ReadyQueue *queue) {
+        (void) queue;
+    }
+
+    virtual void unsubscribe(ReadyQueue *queue) {
+        (void) queue;
+    }
+
+    /* Delta sync needs the uncompressed file, which only a server has: the
+       hashes of its CHUNK_SIZE blocks and single blocks compressed on their
+       own. Both may still be in the making, like tryAcquire() chunks; the
+       hashes are announced as HASHES_READY. */
+    virtual bool tryEncodeHashes(std::vector<u_int8_t> &out) {
+        (void) out;
+        throw std::runtime_error("Delta sync is not supported by this source");
+    }
+
+    virtual bool tryAcquireRaw(u_int64_t rawChunkNo, ChunkRef &ref) {
+        (void) rawChunkNo;
+        (void) ref;
+        throw std::runtime_error("Delta sync is not supported by this source");
+    }
+
+    /* Returns up to `len` bytes of the chunk starting at `offset`; `len` is
+       updated to what is actually available. Unbacked chunks are read into
+       `scratch`. */
+    virtual const u_int8_t *bytes(const ChunkRef &ref, u_int64_t offset, size_t &len, u_int8_t *scratch) {
+        if (offset + len > ref.size)
+            len = ref.size - offset;
+        (void) scratch;
+        return ref.data + offset;
+    }
+};
@@ -0,0 +1,301 @@
+#pragma once
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "ChunkSource.hpp"
+#include "Log.hpp"
+#include "MsgAvailability.hpp"
+#include "MsgHashes.hpp"
+#include "MsgMetadata.hpp"
+#include "MsgRequest.hpp"
+#include "RateLimiter.hpp"
+#include "Stats.hpp"
+#include "utils.hpp"
+
+/* One client of a ChunkServer. Non-blocking counterpart of the client's
+   Worker: sends the metadata, then alternates between reading a chunk request
+   and sending that chunk. A request for a chunk the source does not have yet
+   (a peer still downloading it, a block still being compressed) waits until
+   chunkAvailable() is called.
+   Control requests are answered with a length-prefixed message; an
+   availability request that finds nothing new on a source that still grows
+   is likewise held until a chunk arrives, which makes it a long poll. The
+   ChunkServer decides how many bytes may be sent per round; the connection
+   only reports whether it has something to send. */
+class Connection {
+public:
+    struct ClientDisconnected : std::exception {};
+
+    Connection(int sock, const std::string &clientIp, ChunkSource &chunkSource, u_int64_t chunks,
+               const u_int8_t *metadataMsg, const std::vector<u_int8_t> &manifestMsg)
+            : sock(sock), clientIp(clientIp), chunkSource(chunkSource), chunks(chunks),
+              manifestMsg(manifestMsg) {
+        peerStats = Stats::registerPeer(clientIp);
+        pending = metadataMsg;
+        pendingLen = MsgMetadata::MSG_SIZE;
+    }
+
+    ~Connection() {
+        Stats::unregisterPeer(peerStats);
+        try {
+            tryClose(sock, "Cannot close client socket");
+        } catch (const std::exception &e) {
+            LOG_ERROR("(%s) - %s", clientIp.c_str(), e.what());
+        }
+    }
+
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    void onReadable() {
+        if (state != STATE::WAIT_REQUEST)
+            return;
+
+        ssize_t rv = recv(sock, reinterpret_cast<u_int8_t *>(&request) + receivedBytes,
+                          sizeof(request) - receivedBytes, 0);
+        if (rv == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            LOG_ERROR("read: %s", strerror(errno));
+            throw std::runtime_error("Cannot receive chunk req");
+        } else if (rv == 0) {
+            throw ClientDisconnected();
+        }
+
+        receivedBytes += rv;
+        if (receivedBytes < sizeof(request))
+            return;
+        receivedBytes = 0;
+
+        if (MsgRequest::isControl(request)) {
+            handleControl();
+            return;
+        }
+
+        requestedChunk = request;
+        if (requestedChunk >= chunks)
+            throw std::runtime_error("Invalid chunk requested. Dropping connection");
+        if (!chunkSource.has(requestedChunk) && chunkSource.availability().isFinal())
+            throw std::runtime_error("Requested chunk is not available here. Dropping connection");
+
+        LOG_DEBUG("Chunk %lu requested", requestedChunk);
+        chunkSource.willRead(requestedChunk, previousChunk);
+        previousChunk = requestedChunk;
+        Stats::add(Counter::CHUNKS_REQUESTED);
+        requestedAt = steady_clock::now();
+        rawRequested = false;
+        state = STATE::WAIT_CHUNK;
+        chunkAvailable(requestedChunk);
+    }
+
+    void chunkAvailable(u_int64_t chunkNo) {
+        if (state == STATE::WAIT_AVAILABILITY) {
+            replyAvailability();
+            return;
+        }
+        if (state == STATE::WAIT_HASHES) {
+            if (chunkNo == ChunkSource::HASHES_READY)
+                replyHashes();
+            return;
+        }
+        if (state != STATE::WAIT_CHUNK || chunkNo != requestedChunk)
+            return;
+        if (rawRequested ? !chunkSource.tryAcquireRaw(chunkNo, chunk)
+                         : !chunkSource.has(chunkNo) || !chunkSource.tryAcquire(chunkNo, chunk))
+            return;
+        chunkOffset = 0;
+        state = STATE::SENDING;
+    }
+
+    void onWritable() {
+        blockedOnWrite = false;
+        if (state == STATE::SEND_CONTROL)
+            send(pendingLen);
+    }
+
+    /* Sends at most `budget` bytes and returns how many went out. */
+    size_t send(size_t budget) {
+        size_t sent{0};
+        while (sent < budget && !blockedOnWrite) {
+            if (pendingLen == 0 && !refill())
+                break;
+
+            const size_t len = std::min(pendingLen, budget - sent);
+            int flags = MSG_NOSIGNAL;
+            if (state == STATE::SENDING && chunkOffset + len < chunk.size)
+                flags |= moreFlag;
+            ssize_t rv = ::send(sock, pending, len, flags);
+            if (rv == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    blockedOnWrite = true;
+                    break;
+                }
+                LOG_ERROR("send: %s", strerror(errno));
+                throw std::runtime_error("Cannot send requested chunk");
+            }
+
+            pending += rv;
+            pendingLen -= rv;
+            sent += rv;
+            if (state == STATE::SEND_CONTROL) {
+                if (pendingLen == 0)
+                    state = STATE::WAIT_REQUEST;
+                continue;
+            }
+
+            chunkOffset += rv;
+            Stats::add(Counter::BYTES_OUT, static_cast<u_int64_t>(rv));
+            peerStats->addBytes(static_cast<u_int64_t>(rv));
+            if (chunkOffset == chunk.size) {
+                finishChunk();
+                break;
+            }
+        }
+        return sent;
+    }
+
+    bool wantsToSend() const {
+        return state == STATE::SENDING && !blockedOnWrite;
+    }
+
+    u_int64_t remainingInChunk() const {
+        return state == STATE::SENDING ? chunk.size - chunkOffset : 0;
+    }
+
+    u_int32_t interest() const {
+        u_int32_t events = EPOLLRDHUP;
+        if (state == STATE::WAIT_REQUEST)
+            events |= EPOLLIN;
+        if (blockedOnWrite || (state == STATE::SEND_CONTROL && pendingLen > 0))
+            events |= EPOLLOUT;
+        return events;
+    }
+
+    int getSock() const {
+        return sock;
+    }
+
+    const std::string &getClientIp() const {
+        return clientIp;
+    }
+
+    TokenBucket &getBucket() {
+        return bucket;
+    }
+
+    /* send() flag for chunk slices that are not the last of their chunk. */
+    void setMoreFlag(int flag) {
+        moreFlag = flag;
+    }
+
+    bool queued{false};
+
+private:
+    void handleControl() {
+        switch (MsgRequest::kind(request)) {
+            case MsgRequest::AVAILABILITY:
+                knownVersion = MsgRequest::arg(request);
+                state = STATE::WAIT_AVAILABILITY;
+                replyAvailability();
+                return;
+            case MsgRequest::HASHES:
+                state = STATE::WAIT_HASHES;
+                chunkAvailable(ChunkSource::HASHES_READY);
+                return;
+            case MsgRequest::MANIFEST:
+                if (manifestMsg.empty())
+                    throw std::runtime_error("Manifest requested but not serving a tree. Dropping connection");
+                pending = manifestMsg.data();
+                pendingLen = manifestMsg.size();
+                state = STATE::SEND_CONTROL;
+                return;
+            case MsgRequest::RAW_CHUNK:
+                LOG_DEBUG("Raw chunk %lu requested", MsgRequest::arg(request));
+                Stats::add(Counter::CHUNKS_REQUESTED);
+                requestedAt = steady_clock::now();
+                requestedChunk = MsgRequest::arg(request);
+                rawRequested = true;
+                state = STATE::WAIT_CHUNK;
+                chunkAvailable(requestedChunk);
+                return;
+            default:
+                throw std::runtime_error("Unknown control request. Dropping connection");
+        }
+    }
+
+    void replyHashes() {
+        controlMsg.clear();
+        if (!chunkSource.tryEncodeHashes(controlMsg))
+            return;
+        pending = controlMsg.data();
+        pendingLen = controlMsg.size();
+        state = STATE::SEND_CONTROL;
+    }
+
+    /* Answers a pending availability request unless it should keep waiting. */
+    void replyAvailability() {
+        const AvailabilityLog &log = chunkSource.availability();
+        if (log.version() == knownVersion && !log.isFinal())
+            return;
+        controlMsg.clear();
+        MsgAvailability::encode(log, knownVersion, controlMsg);
+        pending = controlMsg.data();
+        pendingLen = controlMsg.size();
+        state = STATE::SEND_CONTROL;
+    }
+
+    /* Points `pending` at the next slice of the chunk being sent. */
+    bool refill() {
+        if (state != STATE::SENDING)
+            return false;
+        size_t len = chunk.data != nullptr ? SEND_SIZE : BUF_SIZE;
+        pending = chunkSource.bytes(chunk, chunkOffset, len, scratch);
+        pendingLen = len;
+        return true;
+    }
+
+    void finishChunk() {
+        const u_int64_t latencyUs = elapsedUs(requestedAt);
+        Stats::record(Hist::CHUNK_LATENCY_US, latencyUs);
+        Stats::add(Counter::CHUNKS_DONE);
+        peerStats->chunkDone(latencyUs);
+        chunk = ChunkSource::ChunkRef{};
+        pendingLen = 0;
+        state = STATE::WAIT_REQUEST;
+    }
+
+    enum class STATE {
+        SEND_CONTROL, WAIT_REQUEST, WAIT_AVAILABILITY, WAIT_HASHES, WAIT_CHUNK, SENDING
+    };
+    static const size_t BUF_SIZE{8192};
+    static const size_t SEND_SIZE{256 * 1024};
+
+    const int sock;
+    const std::string clientIp;
+    ChunkSource &chunkSource;
+    const u_int64_t chunks;
+    /* Owned by the ChunkServer, empty unless it serves a tree. */
+    const std::vector<u_int8_t> &manifestMsg;
+    PeerStats *peerStats;
+    TokenBucket bucket;
+    int moreFlag{0};
+
+    STATE state{STATE::SEND_CONTROL};
+    bool blockedOnWrite{false};
+    const u_int8_t *pending{nullptr};
+    size_t pendingLen{0};
+
+    u_int64_t request{};
+    u_int64_t requestedChunk{};
+    /* Chunk requested before, all ones so that chunk 0 starts a sequential read. */
+    u_int64_t previousChunk{~0ULL};
+    /* requestedChunk is a block of the original file (RAW_CHUNK). */
+    bool rawRequested{false};
+    u_int64_t knownVersion{0};
+    std::vector<u_int8_t> controlMsg;
+    size_t receivedBytes{0};
+    steady_clock::time_point requestedAt;
+    ChunkSource::ChunkRef chunk;
+    u_int64_t chunkOffset{0};
+    u_int8_t scratch[BUF_SIZE];
+};
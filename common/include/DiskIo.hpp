@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory>
+#include <new>
+#include <string>
+#include "Log.hpp"
+
+/* Page cache policy for bulk file I/O, for files that may be larger than RAM.
+   BUFFERED - plain writes; writeback of every finished window is started
+              right away, so dirty pages do not pile up into one long stall
+              partway through the transfer (default).
+   NOCACHE  - as BUFFERED, and written windows are also dropped from the
+              page cache once written back, so memory use stays flat.
+   DIRECT   - O_DIRECT from aligned buffers, bypassing the page cache. Files
+              on file systems that refuse it fall back to NOCACHE. */
+class DiskIo {
+public:
+    enum class Mode { BUFFERED, NOCACHE, DIRECT };
+
+    static Mode parseMode(const std::string &name) {
+        if (name == "buffered")
+            return Mode::BUFFERED;
+        if (name == "nocache")
+            return Mode::NOCACHE;
+        if (name == "direct")
+            return Mode::DIRECT;
+        throw std::runtime_error("Unknown io mode: " + name);
+    }
+
+    /* O_DIRECT needs buffers, offsets and lengths aligned to the logical
+       block size; the page size covers every common device. */
+    static const size_t ALIGN{4096};
+
+    struct FreeDeleter {
+        void operator()(u_int8_t *ptr) const {
+            free(ptr);
+        }
+    };
+    using AlignedBuffer = std::unique_ptr<u_int8_t[], FreeDeleter>;
+
+    static AlignedBuffer allocAligned(size_t size) {
+        void *ptr;
+        if (posix_memalign(&ptr, ALIGN, size) != 0)
+            throw std::bad_alloc();
+        return AlignedBuffer(static_cast<u_int8_t *>(ptr));
+    }
+
+    static size_t alignUp(size_t len) {
+        return (len + ALIGN - 1) / ALIGN * ALIGN;
+    }
+
+    /* Opens `path` with O_DIRECT when `direct` is set. If the file system
+       refuses it, opens it buffered and clears `direct`. */
+    static int open(const char *path, int flags, mode_t mode, bool &direct) {
+        if (direct) {
+            int fd = ::open(path, flags | O_DIRECT, mode);
+            if (fd != -1 || errno != EINVAL)
+                return fd;
+            direct = false;
+            static std::atomic<bool> warned{false};
+            if (!warned.exchange(true))
+                LOG_WARN("O_DIRECT is not supported for %s, using buffered I/O without caching", path);
+        }
+        return ::open(path, flags, mode);
+    }
+
+    /* Drops a range from the page cache; `len` 0 means up to the end of the
+       file. Never waits for the device: pages still dirty or under
+       writeback are skipped. */
+    static void dropRange(int fd, u_int64_t offset, u_int64_t len) {
+        posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(len), POSIX_FADV_DONTNEED);
+    }
+
+    /* Hints for a file written front to back, from an event loop: writeback
+       of each WINDOW is started once it is complete and, when dropping, the
+       window DROP_LAG windows before it is evicted. Nothing here waits for
+       the device; the lag gives a window's writeback time to finish before
+       it is dropped. */
+    class WriteBehind {
+    public:
+        void reset(int newFd, bool newDrop) {
+            fd = newFd;
+            drop = newDrop;
+            written = 0;
+            queued = 0;
+        }
+
+        void wrote(size_t len) {
+            written += len;
+            while (written - queued >= WINDOW) {
+                sync_file_range(fd, static_cast<off_t>(queued), WINDOW, SYNC_FILE_RANGE_WRITE);
+                if (drop && queued >= DROP_LAG * WINDOW)
+                    dropRange(fd, queued - DROP_LAG * WINDOW, WINDOW);
+                queued += WINDOW;
+            }
+        }
+
+        /* Before the file is closed. Pages of the last windows that are
+           still being written back stay cached, clean, until reclaimed. */
+        void finish() {
+            if (written > queued)
+                sync_file_range(fd, static_cast<off_t>(queued), 0, SYNC_FILE_RANGE_WRITE);
+            if (drop)
+                dropRange(fd, 0, 0);
+        }
+
+        static const u_int64_t WINDOW{1024 * 1024};
+        static const u_int64_t DROP_LAG{2};
+
+    private:
+        int fd{-1};
+        bool drop{false};
+        u_int64_t written{0};
+        /* Start of the first window whose writeback was not started. */
+        u_int64_t queued{0};
+    };
+};
@@ -1,147 +1,18 @@
-/* zpipe.c: example of proper use of zlib's inflate() and deflate()
-   Not copyrighted -- provided to the public domain
-   Version 1.4  11 December 2005  Mark Adler */
-
-/* Version history:
-   1.0  30 Oct 2004  First version
-   1.1   8 Nov 2004  Add void casting for unused return values
-                     Use switch statement for inflate() return values
-   1.2   9 Nov 2004  Add assertions to document zlib guarantees
-   1.3   6 Apr 2005  Remove incorrect assertion in inf()
-   1.4  11 Dec 2005  Add hack to avoid MSDOS end-of-line conversions
-                     Avoid some compiler warnings for input and output buffers
- */
+/* The streaming deflate/inflate loops follow zpipe.c, Mark Adler's public
+   domain example of proper use of zlib's inflate() and deflate(). */
 #pragma once
 
-#include <stdio.h>
-#include <string.h>
-#include <assert.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 #include <zlib.h>
-#include <iostream>
-
-#define CHUNK 16384
-
-/* Compress from file source to file dest until EOF on source.
-   def() returns Z_OK on success, Z_MEM_ERROR if memory could not be
-   allocated for processing, Z_STREAM_ERROR if an invalid compression
-   level is supplied, Z_VERSION_ERROR if the version of zlib.h and the
-   version of the library linked do not match, or Z_ERRNO if there is
-   an error reading or writing the files. */
-int def(FILE *source, FILE *dest, int level)
-{
-    int ret, flush;
-    unsigned have;
-    z_stream strm;
-    unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
-
-    /* allocate deflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    ret = deflateInit(&strm, level);
-    if (ret != Z_OK)
-        return ret;
-
-    /* compress until end of file */
-    do {
-        strm.avail_in = fread(in, 1, CHUNK, source);
-        if (ferror(source)) {
-            (void)deflateEnd(&strm);
-            return Z_ERRNO;
-        }
-        flush = feof(source) ? Z_FINISH : Z_NO_FLUSH;
-        strm.next_in = in;
-
-        /* run deflate() on input until output buffer not full, finish
-           compression if all of source has been read in */
-        do {
-            strm.avail_out = CHUNK;
-            strm.next_out = out;
-            ret = deflate(&strm, flush);    /* no bad return value */
-            assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-            have = CHUNK - strm.avail_out;
-            if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
-                (void)deflateEnd(&strm);
-                return Z_ERRNO;
-            }
-        } while (strm.avail_out == 0);
-        assert(strm.avail_in == 0);     /* all input will be used */
-
-        /* done when last data in file processed */
-    } while (flush != Z_FINISH);
-    assert(ret == Z_STREAM_END);        /* stream will be complete */
-
-    /* clean up and return */
-    (void)deflateEnd(&strm);
-    return Z_OK;
-}
-
-/* Decompress from file source to file dest until stream ends or EOF.
-   inf() returns Z_OK on success, Z_MEM_ERROR if memory could not be
-   allocated for processing, Z_DATA_ERROR if the deflate data is
-   invalid or incomplete, Z_VERSION_ERROR if the version of zlib.h and
-   the version of the library linked do not match, or Z_ERRNO if there
-   is an error reading or writing the files. */
-int inf(FILE *source, FILE *dest)
-{
-    int ret;
-    unsigned have;
-    z_stream strm;
-    unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
-
-    /* allocate inflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    ret = inflateInit(&strm);
-    if (ret != Z_OK)
-        return ret;
-
-    /* decompress until deflate stream ends or end of file */
-    do {
-        strm.avail_in = fread(in, 1, CHUNK, source);
-        if (ferror(source)) {
-            (void)inflateEnd(&strm);
-            return Z_ERRNO;
-        }
-        if (strm.avail_in == 0)
-            break;
-        strm.next_in = in;
-
-        /* run inflate() on input until output buffer not full */
-        do {
-            strm.avail_out = CHUNK;
-            strm.next_out = out;
-            ret = inflate(&strm, Z_NO_FLUSH);
-            assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-            switch (ret) {
-            case Z_NEED_DICT:
-                ret = Z_DATA_ERROR;
-                (void)inflateEnd(&strm);
-                return ret;
-            case Z_DATA_ERROR:
-            case Z_MEM_ERROR:
-                (void)inflateEnd(&strm);
-                return ret;
-            }
-            have = CHUNK - strm.avail_out;
-            if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
-                (void)inflateEnd(&strm);
-                return Z_ERRNO;
-            }
-        } while (strm.avail_out == 0);
-
-        /* done when inflate() says it's done */
-    } while (ret != Z_STREAM_END);
-
-    /* clean up and return */
-    (void)inflateEnd(&strm);
-    return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
-}
+#include "Log.hpp"
 
 /* report a zlib or i/o error */
 void throw_zlib_error(int ret) {
@@ -161,47 +32,409 @@ void throw_zlib_error(int ret) {
     }
 }
 
+/* Where the codecs read input from and write output to. read() returns 0 at
+   the end of the input; both throw on I/O errors. */
+class ByteSource {
+public:
+    virtual ~ByteSource() = default;
+    virtual size_t read(u_int8_t *buf, size_t len) = 0;
+};
+
+class ByteSink {
+public:
+    virtual ~ByteSink() = default;
+    virtual void write(const u_int8_t *buf, size_t len) = 0;
+};
+
+class FdSource : public ByteSource {
+public:
+    explicit FdSource(int fd) : fd(fd) {}
+
+    size_t read(u_int8_t *buf, size_t len) override {
+        while (true) {
+            ssize_t rv = ::read(fd, buf, len);
+            if (rv >= 0)
+                return static_cast<size_t>(rv);
+            if (errno != EINTR)
+                throw_zlib_error(Z_ERRNO);
+        }
+    }
+
+private:
+    const int fd;
+};
+
+class FdSink : public ByteSink {
+public:
+    explicit FdSink(int fd) : fd(fd) {}
+
+    void write(const u_int8_t *buf, size_t len) override {
+        while (len > 0) {
+            ssize_t rv = ::write(fd, buf, len);
+            if (rv == -1) {
+                if (errno == EINTR)
+                    continue;
+                throw_zlib_error(Z_ERRNO);
+            }
+            buf += rv;
+            len -= rv;
+        }
+    }
+
+private:
+    const int fd;
+};
+
+class MemorySource : public ByteSource {
+public:
+    MemorySource(const u_int8_t *data, size_t len) : pos(data), left(len) {}
+
+    size_t read(u_int8_t *buf, size_t len) override {
+        const size_t n = std::min(len, left);
+        memcpy(buf, pos, n);
+        pos += n;
+        left -= n;
+        return n;
+    }
+
+private:
+    const u_int8_t *pos;
+    size_t left;
+};
+
+class VectorSink : public ByteSink {
+public:
+    explicit VectorSink(std::vector<u_int8_t> &out) : out(out) {}
+
+    void write(const u_int8_t *buf, size_t len) override {
+        out.insert(out.end(), buf, buf + len);
+    }
+
+private:
+    std::vector<u_int8_t> &out;
+};
+
+/* A deflate context that is set up once and reset between streams, with
+   heap buffers of a configurable size. The output is a zlib stream. */
+class Deflater {
+public:
+    explicit Deflater(int level = DEFAULT_LEVEL, size_t bufSize = DEFAULT_BUF_SIZE)
+            : level(level), in(bufSize), out(bufSize) {
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        int ret = deflateInit(&strm, level);
+        if (ret != Z_OK)
+            throw_zlib_error(ret);
+    }
+
+    ~Deflater() {
+        (void) deflateEnd(&strm);
+    }
+
+    Deflater(const Deflater &) = delete;
+    Deflater &operator=(const Deflater &) = delete;
+
+    /* Compresses everything `source` yields into one stream. */
+    void compress(ByteSource &source, ByteSink &sink) {
+        int flush;
+        do {
+            strm.avail_in = static_cast<uInt>(source.read(in.data(), in.size()));
+            flush = strm.avail_in == 0 ? Z_FINISH : Z_NO_FLUSH;
+            strm.next_in = in.data();
+            drain(sink, flush);
+        } while (flush != Z_FINISH);
+        deflateReset(&strm);
+    }
+
+    int getLevel() const {
+        return level;
+    }
+
+    static const int DEFAULT_LEVEL{6};
+    static const size_t DEFAULT_BUF_SIZE{256 * 1024};
+
+private:
+    /* Runs deflate() until it stops filling the output buffer. */
+    void drain(ByteSink &sink, int flush) {
+        do {
+            strm.avail_out = static_cast<uInt>(out.size());
+            strm.next_out = out.data();
+            int ret = deflate(&strm, flush);
+            if (ret == Z_STREAM_ERROR)
+                throw_zlib_error(ret);
+            sink.write(out.data(), out.size() - strm.avail_out);
+        } while (strm.avail_out == 0);
+    }
+
+    const int level;
+    z_stream strm{};
+    std::vector<u_int8_t> in;
+    std::vector<u_int8_t> out;
+};
+
+/* Counterpart of Deflater. */
+class Inflater {
+public:
+    explicit Inflater(size_t bufSize = Deflater::DEFAULT_BUF_SIZE) : in(bufSize), out(bufSize) {
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        strm.avail_in = 0;
+        strm.next_in = Z_NULL;
+        int ret = inflateInit(&strm);
+        if (ret != Z_OK)
+            throw_zlib_error(ret);
+    }
+
+    ~Inflater() {
+        (void) inflateEnd(&strm);
+    }
+
+    Inflater(const Inflater &) = delete;
+    Inflater &operator=(const Inflater &) = delete;
+
+    /* Decompresses one stream; throws if it is invalid or incomplete. */
+    void decompress(ByteSource &source, ByteSink &sink) {
+        int ret = Z_OK;
+        do {
+            strm.avail_in = static_cast<uInt>(source.read(in.data(), in.size()));
+            if (strm.avail_in == 0)
+                break;
+            strm.next_in = in.data();
+
+            do {
+                strm.avail_out = static_cast<uInt>(out.size());
+                strm.next_out = out.data();
+                ret = inflate(&strm, Z_NO_FLUSH);
+                switch (ret) {
+                    case Z_NEED_DICT:
+                        ret = Z_DATA_ERROR;
+                        /* fall through */
+                    case Z_STREAM_ERROR:
+                    case Z_DATA_ERROR:
+                    case Z_MEM_ERROR:
+                        inflateReset(&strm);
+                        throw_zlib_error(ret);
+                }
+                sink.write(out.data(), out.size() - strm.avail_out);
+            } while (strm.avail_out == 0);
+        } while (ret != Z_STREAM_END);
+
+        inflateReset(&strm);
+        if (ret != Z_STREAM_END)
+            throw_zlib_error(Z_DATA_ERROR);
+    }
+
+private:
+    z_stream strm{};
+    std::vector<u_int8_t> in;
+    std::vector<u_int8_t> out;
+};
+
+/* Push/pull deflate for producing compressed data in memory as input
+   arrives, e.g. straight into a send buffer. push() feeds input, flush()
+   ends a chunk: everything pushed so far becomes pullable and, with
+   Z_FULL_FLUSH, later output no longer refers back to it. finish() ends the
+   stream and reset() starts the next one on the same context. */
+class DeflateStream {
+public:
+    explicit DeflateStream(int level = Deflater::DEFAULT_LEVEL) : level(level) {
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        int ret = deflateInit(&strm, level);
+        if (ret != Z_OK)
+            throw_zlib_error(ret);
+    }
+
+    ~DeflateStream() {
+        (void) deflateEnd(&strm);
+    }
+
+    DeflateStream(const DeflateStream &) = delete;
+    DeflateStream &operator=(const DeflateStream &) = delete;
+
+    void push(const u_int8_t *data, size_t len) {
+        run(data, len, Z_NO_FLUSH);
+    }
+
+    void flush(int mode = Z_FULL_FLUSH) {
+        run(nullptr, 0, mode);
+    }
+
+    void finish() {
+        run(nullptr, 0, Z_FINISH);
+    }
+
+    /* Compressed bytes ready to be pulled. */
+    size_t available() const {
+        return out.size() - outPos;
+    }
+
+    size_t pull(u_int8_t *buf, size_t len) {
+        const size_t n = std::min(len, available());
+        memcpy(buf, out.data() + outPos, n);
+        outPos += n;
+        if (outPos == out.size()) {
+            out.clear();
+            outPos = 0;
+        }
+        return n;
+    }
+
+    void reset() {
+        deflateReset(&strm);
+        out.clear();
+        outPos = 0;
+    }
+
+    int getLevel() const {
+        return level;
+    }
+
+private:
+    void run(const u_int8_t *data, size_t len, int flush) {
+        strm.next_in = const_cast<Bytef *>(data);
+        strm.avail_in = static_cast<uInt>(len);
+        do {
+            const size_t used = out.size();
+            const size_t bound = deflateBound(&strm, static_cast<uLong>(len)) / 4;
+            const size_t room = bound > GROW_SIZE ? bound : GROW_SIZE;
+            out.resize(used + room);
+            strm.next_out = out.data() + used;
+            strm.avail_out = static_cast<uInt>(room);
+            int ret = deflate(&strm, flush);
+            out.resize(used + room - strm.avail_out);
+            if (ret == Z_STREAM_ERROR)
+                throw_zlib_error(ret);
+        } while (strm.avail_in > 0 || strm.avail_out == 0);
+    }
+
+    static const size_t GROW_SIZE{64 * 1024};
+
+    const int level;
+    z_stream strm{};
+    std::vector<u_int8_t> out;
+    size_t outPos{0};
+};
+
 class Gzip {
   public:
-    static void compress(const std::string& src_path, const int level = 6, std::string dst_path = "") {
-        FILE *src = fopen(src_path.c_str(), "rb");
-        if (src == nullptr)
-            throw std::runtime_error(std::string("Cannot open ") + src_path);
-        if (dst_path.empty())
-            dst_path = src_path + ".gzip";
-        FILE *dst = fopen(dst_path.c_str(), "wb");
-        if (dst == nullptr)
-            throw std::runtime_error(std::string("Cannot open ") + dst_path);
-        
-        int ret = def(src, dst, level);
-        
-        if (fclose(src) != 0)
-            perror((std::string("fclose: ") + src_path).c_str());
-        if (fclose(dst) != 0)
-            perror((std::string("fclose: ") + dst_path).c_str());
+    /* Compresses a buffer into a standalone zlib stream. Each thread keeps
+       its deflate context for the next call. */
+    static std::vector<u_int8_t> compressBuffer(const u_int8_t *src, size_t len,
+                                                const int level = Deflater::DEFAULT_LEVEL) {
+        static thread_local std::unique_ptr<Deflater> deflater;
+        if (!deflater || deflater->getLevel() != level)
+            deflater = std::make_unique<Deflater>(level);
+        std::vector<u_int8_t> dst;
+        dst.reserve(compressBound(static_cast<uLong>(len)));
+        MemorySource source(src, len);
+        VectorSink sink(dst);
+        deflater->compress(source, sink);
+        return dst;
+    }
 
+    /* Inflates a stream made by compressBuffer() into exactly `dstLen` bytes. */
+    static void decompressBuffer(const u_int8_t *src, size_t len, u_int8_t *dst, size_t dstLen) {
+        uLongf outLen = static_cast<uLongf>(dstLen);
+        int ret = uncompress(dst, &outLen, src, static_cast<uLong>(len));
+        if (ret == Z_BUF_ERROR || (ret == Z_OK && outLen != dstLen))
+            ret = Z_DATA_ERROR;
         if (ret != Z_OK)
             throw_zlib_error(ret);
     }
 
-    static void decompress(const std::string& src_path, std::string dst_path="") {
-        FILE *src = fopen(src_path.c_str(), "rb");
-        if (src == nullptr)
-            throw std::runtime_error(std::string("Cannot open ") + src_path);
+    /* Estimates how well the file at `path` compresses: the compressed to
+       raw size ratio of `samples` evenly spread pieces of `sampleSize` bytes,
+       deflated at level 1. Already compressed media and archives come out
+       at about 1.0. */
+    static double sampleRatio(const std::string &path, unsigned samples = 16, size_t sampleSize = 64 * 1024) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st{};
+        if (fd == -1 || fstat(fd, &st) != 0) {
+            if (fd != -1)
+                ::close(fd);
+            throw std::runtime_error(std::string("Cannot open ") + path);
+        }
+        const u_int64_t size = static_cast<u_int64_t>(st.st_size);
+
+        std::vector<u_int8_t> piece(sampleSize);
+        u_int64_t rawBytes{0}, compressedBytes{0};
+        const u_int64_t stride = size / samples;
+        for (unsigned i = 0; i < samples; ++i) {
+            ssize_t rv = pread(fd, piece.data(), sampleSize, static_cast<off_t>(i * stride));
+            if (rv <= 0)
+                break;
+            rawBytes += static_cast<u_int64_t>(rv);
+            compressedBytes += compressBuffer(piece.data(), static_cast<size_t>(rv), 1).size();
+            if (stride == 0)
+                break;
+        }
+        ::close(fd);
+        return rawBytes == 0 ? 1.0 : static_cast<double>(compressedBytes) / static_cast<double>(rawBytes);
+    }
+
+    static void compress(const std::string& src_path, const int level = Deflater::DEFAULT_LEVEL,
+                         std::string dst_path = "", size_t bufSize = Deflater::DEFAULT_BUF_SIZE) {
+        if (dst_path.empty())
+            dst_path = src_path + ".gzip";
+        Files files(src_path, dst_path);
+        FdSource source(files.src);
+        FdSink sink(files.dst);
+        Deflater(level, bufSize).compress(source, sink);
+        files.close();
+    }
+
+    static void decompress(const std::string& src_path, std::string dst_path = "",
+                           size_t bufSize = Deflater::DEFAULT_BUF_SIZE) {
         if (dst_path.empty())
             dst_path = src_path.substr(0, src_path.size() - 5);
-        FILE *dst = fopen(dst_path.c_str(), "wb");
-        if (dst == nullptr)
-            throw std::runtime_error(std::string("Cannot open ") + dst_path);
+        Files files(src_path, dst_path);
+        FdSource source(files.src);
+        FdSink sink(files.dst);
+        Inflater(bufSize).decompress(source, sink);
+        files.close();
+    }
+
+  private:
+    /* Input and output file of compress()/decompress(). */
+    struct Files {
+        Files(const std::string &src_path, const std::string &dst_path) : src_path(src_path), dst_path(dst_path) {
+            src = open(src_path.c_str(), O_RDONLY);
+            if (src == -1)
+                throw std::runtime_error(std::string("Cannot open ") + src_path);
+            dst = open(dst_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC,
+                       S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+            if (dst == -1) {
+                ::close(src);
+                throw std::runtime_error(std::string("Cannot open ") + dst_path);
+            }
+        }
 
-        int ret = inf(src, dst);
+        ~Files() {
+            if (src != -1)
+                ::close(src);
+            if (dst != -1)
+                ::close(dst);
+        }
 
-        if (fclose(src) != 0)
-            perror((std::string("fclose: ") + src_path).c_str());
-        if (fclose(dst) != 0)
-            perror((std::string("fclose: ") + dst_path).c_str());
+        void close() {
+            if (::close(src) != 0)
+                LOG_ERROR("close: %s: %s", src_path.c_str(), strerror(errno));
+            src = -1;
+            const int rv = ::close(dst);
+            dst = -1;
+            if (rv != 0) {
+                LOG_ERROR("close: %s: %s", dst_path.c_str(), strerror(errno));
+                throw_zlib_error(Z_ERRNO);
+            }
+        }
 
-        if (ret != Z_OK)
-            throw_zlib_error(ret);
-    }
+        const std::string &src_path;
+        const std::string &dst_path;
+        int src{-1};
+        int dst{-1};
+    };
 };
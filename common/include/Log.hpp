@@ -0,0 +1,230 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+/* Asynchronous leveled logger.
+   Producers format into a slot of a bounded lock-free ring (Vyukov MPMC
+   queue, used here as MPSC) and return; a background thread drains the ring
+   and writes whole batches with one write(2) per stream. When the ring is
+   full the message is dropped and counted instead of blocking the caller.
+
+   HA_LOG_LEVEL removes levels below it at compile time: the LOG_* macros
+   expand to `if (false)` and their arguments are never evaluated. */
+
+#define HA_LOG_DEBUG 0
+#define HA_LOG_INFO 1
+#define HA_LOG_WARN 2
+#define HA_LOG_ERROR 3
+
+#ifndef HA_LOG_LEVEL
+#define HA_LOG_LEVEL HA_LOG_DEBUG
+#endif
+
+#define HA_LOG(level, ...)                                               \
+    do {                                                                 \
+        if ((level) >= HA_LOG_LEVEL && Log::enabled(level))              \
+            Log::write(level, __VA_ARGS__);                              \
+    } while (0)
+
+#define LOG_DEBUG(...) HA_LOG(HA_LOG_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) HA_LOG(HA_LOG_INFO, __VA_ARGS__)
+#define LOG_WARN(...) HA_LOG(HA_LOG_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) HA_LOG(HA_LOG_ERROR, __VA_ARGS__)
+
+class Log {
+public:
+    static bool enabled(int level) {
+        return level >= instance().level.load(std::memory_order_relaxed);
+    }
+
+    static void setLevel(int level) {
+        instance().level.store(level, std::memory_order_relaxed);
+    }
+
+    /* Accepts "debug", "info", "warn" or "error". */
+    static void setLevel(const std::string &name) {
+        for (int level = HA_LOG_DEBUG; level <= HA_LOG_ERROR; ++level) {
+            if (name == LEVEL_NAMES[level]) {
+                setLevel(level);
+                return;
+            }
+        }
+        throw std::runtime_error("Unknown log level: " + name);
+    }
+
+    __attribute__((format(printf, 2, 3)))
+    static void write(int level, const char *fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        instance().push(level, fmt, args);
+        va_end(args);
+    }
+
+    /* Blocks until everything logged so far has been written out. */
+    static void flush() {
+        Log &log = instance();
+        const size_t target = log.enqueuePos.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> lock(log.mutex);
+        log.wakeup.notify_one();
+        log.drained.wait(lock, [&log, target] {
+            return log.dequeuePos.load(std::memory_order_acquire) >= target;
+        });
+    }
+
+    static u_int64_t dropped() {
+        return instance().droppedCount.load(std::memory_order_relaxed);
+    }
+
+    ~Log() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        flusher.join();
+    }
+
+private:
+    static const size_t CAPACITY{2048};
+    static const size_t MSG_SIZE{480};
+    static constexpr const char *LEVEL_NAMES[] = {"debug", "info", "warn", "error"};
+
+    struct Slot {
+        std::atomic<size_t> seq;
+        int level;
+        timespec time;
+        char text[MSG_SIZE];
+    };
+
+    Log() {
+        for (size_t i = 0; i < CAPACITY; ++i)
+            ring[i].seq.store(i, std::memory_order_relaxed);
+        flusher = std::thread(&Log::run, this);
+    }
+
+    static Log &instance() {
+        static Log log;
+        return log;
+    }
+
+    void push(int level, const char *fmt, va_list args) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &ring[pos % CAPACITY];
+            const size_t seq = slot->seq.load(std::memory_order_acquire);
+            const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                droppedCount.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->level = level;
+        clock_gettime(CLOCK_REALTIME, &slot->time);
+        vsnprintf(slot->text, MSG_SIZE, fmt, args);
+        slot->seq.store(pos + 1, std::memory_order_release);
+
+        if (level >= HA_LOG_WARN || flusherIdle.load(std::memory_order_relaxed))
+            wakeup.notify_one();
+    }
+
+    void run() {
+        std::string out, err;
+        while (true) {
+            drain(out, err);
+            std::unique_lock<std::mutex> lock(mutex);
+            drained.notify_all();
+            if (stopping && !pending())
+                return;
+            flusherIdle.store(true, std::memory_order_relaxed);
+            wakeup.wait_for(lock, IDLE_PERIOD, [this] { return stopping || pending(); });
+            flusherIdle.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    bool pending() const {
+        const Slot &slot = ring[dequeuePos.load(std::memory_order_relaxed) % CAPACITY];
+        return slot.seq.load(std::memory_order_acquire) == dequeuePos.load(std::memory_order_relaxed) + 1;
+    }
+
+    void drain(std::string &out, std::string &err) {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            Slot &slot = ring[pos % CAPACITY];
+            if (slot.seq.load(std::memory_order_acquire) != pos + 1)
+                break;
+
+            format(slot.level >= HA_LOG_WARN ? err : out, slot);
+            slot.seq.store(pos + CAPACITY, std::memory_order_release);
+            dequeuePos.store(++pos, std::memory_order_release);
+        }
+
+        const u_int64_t droppedNow = droppedCount.load(std::memory_order_relaxed);
+        if (droppedNow != droppedReported) {
+            err += "log: " + std::to_string(droppedNow - droppedReported) + " messages dropped\n";
+            droppedReported = droppedNow;
+        }
+        writeOut(STDOUT_FILENO, out);
+        writeOut(STDERR_FILENO, err);
+    }
+
+    static void format(std::string &dst, const Slot &slot) {
+        tm local{};
+        localtime_r(&slot.time.tv_sec, &local);
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%03ld %c ", local.tm_hour, local.tm_min,
+                 local.tm_sec, slot.time.tv_nsec / 1000000, "DIWE"[slot.level]);
+        dst += prefix;
+        dst += slot.text;
+        dst += '\n';
+    }
+
+    static void writeOut(int fd, std::string &buf) {
+        size_t written{0};
+        while (written < buf.size()) {
+            ssize_t rv = ::write(fd, buf.data() + written, buf.size() - written);
+            if (rv == -1 && errno == EINTR)
+                continue;
+            if (rv <= 0)
+                break;
+            written += static_cast<size_t>(rv);
+        }
+        buf.clear();
+    }
+
+    static constexpr std::chrono::milliseconds IDLE_PERIOD{20};
+
+    Slot ring[CAPACITY];
+    std::atomic<size_t> enqueuePos{0};
+    std::atomic<size_t> dequeuePos{0};
+    std::atomic<u_int64_t> droppedCount{0};
+    u_int64_t droppedReported{0};
+    std::atomic<int> level{HA_LOG_INFO};
+    std::atomic<bool> flusherIdle{false};
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::condition_variable drained;
+    bool stopping{false};
+    std::thread flusher;
+};
+
+constexpr const char *Log::LEVEL_NAMES[];
+constexpr std::chrono::milliseconds Log::IDLE_PERIOD;
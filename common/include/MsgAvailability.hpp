@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "ChunkBitmap.hpp"
+
+/* Reply to an AVAILABILITY request. Payload: u64 version, u8 flags, u64 chunk
+   count, then the run-length encoded bitmap of the chunks added since the
+   version the client sent. The client ORs it into what it already knows. */
+class MsgAvailability {
+public:
+    enum Flags : u_int8_t {
+        /* The source will not gain any more chunks. */
+        FINAL = 1
+    };
+
+    /* Appends the length-prefixed reply to `out`. */
+    static void encode(const AvailabilityLog &log, u_int64_t since, std::vector<u_int8_t> &out) {
+        const size_t start = out.size();
+        out.resize(start + sizeof(u_int64_t) + HEADER_SIZE);
+        const u_int64_t version = log.version();
+        const u_int8_t flags = log.isFinal() ? FINAL : 0;
+        const u_int64_t chunks = log.chunks();
+        u_int8_t *header = out.data() + start + sizeof(u_int64_t);
+        memcpy(header, &version, sizeof(version));
+        memcpy(header + 8, &flags, sizeof(flags));
+        memcpy(header + 9, &chunks, sizeof(chunks));
+
+        log.since(since).encodeRuns(out);
+        const u_int64_t payloadLen = out.size() - start - sizeof(u_int64_t);
+        memcpy(out.data() + start, &payloadLen, sizeof(payloadLen));
+    }
+
+    /* Parses a payload (without the length prefix) of a source whose file
+       has `expectedChunks` chunks, as its metadata said. */
+    MsgAvailability(const u_int8_t *payload, size_t len, u_int64_t expectedChunks) {
+        if (len < HEADER_SIZE)
+            throw std::runtime_error("Availability message too short");
+        memcpy(&version, payload, sizeof(version));
+        memcpy(&flags, payload + 8, sizeof(flags));
+        memcpy(&chunks, payload + 9, sizeof(chunks));
+        if (chunks != expectedChunks)
+            throw std::runtime_error("Availability of " + std::to_string(chunks) + " chunks, expected " +
+                                     std::to_string(expectedChunks));
+        bitmap = ChunkBitmap::decodeRuns(payload + HEADER_SIZE, payload + len, chunks);
+    }
+
+    u_int64_t getVersion() const {
+        return version;
+    }
+
+    bool isFinal() const {
+        return (flags & FINAL) != 0;
+    }
+
+    const ChunkBitmap &getBitmap() const {
+        return bitmap;
+    }
+
+    static const size_t HEADER_SIZE{17};
+
+private:
+    u_int64_t version{};
+    u_int8_t flags{};
+    u_int64_t chunks{};
+    ChunkBitmap bitmap;
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "MsgMetadata.hpp"
+#include "Sha256.hpp"
+#include "utils.hpp"
+
+/* Reply to a HASHES request: u64 size of the uncompressed file, then per
+   CHUNK_SIZE block of it a u64 checksum and the block's SHA-256. Delta sync
+   compares the checksums with those of the client's old copy of the file
+   and confirms a match with the digest. */
+class MsgHashes {
+public:
+    struct BlockHash {
+        u_int64_t weak;
+        Sha256::Digest strong;
+    };
+
+    static BlockHash hashBlock(const u_int8_t *data, size_t len) {
+        return BlockHash{hashChunk(data, len), Sha256::of(data, len)};
+    }
+
+    /* CRC-32 and Adler-32 of the block side by side: cheap, but only good
+       to rule a block out. */
+    static u_int64_t hashChunk(const u_int8_t *data, size_t len) {
+        const uInt size = static_cast<uInt>(len);
+        const u_int64_t crc = crc32(crc32(0L, Z_NULL, 0), data, size);
+        const u_int64_t adler = adler32(adler32(0L, Z_NULL, 0), data, size);
+        return crc << 32 | adler;
+    }
+
+    /* Appends the length-prefixed reply to `out`. */
+    static void encode(u_int64_t rawSize, const std::vector<BlockHash> &hashes, std::vector<u_int8_t> &out) {
+        const u_int64_t payloadLen = sizeof(rawSize) + hashes.size() * ENTRY_SIZE;
+        const size_t start = out.size();
+        out.resize(start + sizeof(payloadLen) + payloadLen);
+        u_int8_t *pos = out.data() + start;
+        memcpy(pos, &payloadLen, sizeof(payloadLen));
+        memcpy(pos + 8, &rawSize, sizeof(rawSize));
+        pos += 16;
+        for (const BlockHash &hash : hashes) {
+            memcpy(pos, &hash.weak, sizeof(hash.weak));
+            memcpy(pos + sizeof(hash.weak), hash.strong.data(), hash.strong.size());
+            pos += ENTRY_SIZE;
+        }
+    }
+
+    /* Parses a payload (without the length prefix). There must be one
+       entry per block of the file. */
+    MsgHashes(const u_int8_t *payload, size_t len) {
+        if (len < sizeof(rawSize) || (len - sizeof(rawSize)) % ENTRY_SIZE != 0)
+            throw std::runtime_error("Malformed hashes message");
+        memcpy(&rawSize, payload, sizeof(rawSize));
+        const u_int64_t entries = (len - sizeof(rawSize)) / ENTRY_SIZE;
+        if (entries != getNumberOfChunks(rawSize, CHUNK_SIZE))
+            throw std::runtime_error("Hashes message has " + std::to_string(entries) + " blocks for " +
+                                     std::to_string(rawSize) + " bytes");
+        hashes.resize(entries);
+        const u_int8_t *pos = payload + sizeof(rawSize);
+        for (BlockHash &hash : hashes) {
+            memcpy(&hash.weak, pos, sizeof(hash.weak));
+            memcpy(hash.strong.data(), pos + sizeof(hash.weak), hash.strong.size());
+            pos += ENTRY_SIZE;
+        }
+    }
+
+    u_int64_t getRawSize() const {
+        return rawSize;
+    }
+
+    const std::vector<BlockHash> &getHashes() const {
+        return hashes;
+    }
+
+private:
+    static const size_t ENTRY_SIZE{sizeof(u_int64_t) + sizeof(Sha256::Digest)};
+
+    u_int64_t rawSize{};
+    std::vector<BlockHash> hashes;
+};
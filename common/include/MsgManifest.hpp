@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+/* Reply to a MANIFEST request for a tree (MsgMetadata::TREE): u64 entry
+   count, then per entry u64 size, u32 st_mode, u32 path length and the path
+   relative to the tree root. The served file is the contents of the regular
+   files concatenated in manifest order; directories take no space in it. */
+class MsgManifest {
+public:
+    struct Entry {
+        std::string path;
+        u_int64_t size{};
+        u_int32_t mode{};
+
+        bool isDirectory() const {
+            return S_ISDIR(mode);
+        }
+    };
+
+    /* Appends the length-prefixed reply to `out`. */
+    static void encode(const std::vector<Entry> &entries, std::vector<u_int8_t> &out) {
+        u_int64_t payloadLen = sizeof(u_int64_t);
+        for (const Entry &entry : entries)
+            payloadLen += ENTRY_HEADER + entry.path.size();
+
+        const size_t start = out.size();
+        out.resize(start + sizeof(payloadLen) + payloadLen);
+        u_int8_t *pos = out.data() + start;
+        pos = put(pos, payloadLen);
+        pos = put(pos, static_cast<u_int64_t>(entries.size()));
+        for (const Entry &entry : entries) {
+            pos = put(pos, entry.size);
+            pos = put(pos, entry.mode);
+            pos = put(pos, static_cast<u_int32_t>(entry.path.size()));
+            memcpy(pos, entry.path.data(), entry.path.size());
+            pos += entry.path.size();
+        }
+    }
+
+    /* Parses a payload (without the length prefix). Paths that could leave
+       the tree root are rejected. */
+    MsgManifest(const u_int8_t *payload, size_t len) {
+        const u_int8_t *end = payload + len;
+        u_int64_t count;
+        payload = get(payload, end, count);
+        if (count > len / ENTRY_HEADER)
+            throw std::runtime_error("Malformed manifest message");
+        entries.resize(count);
+        for (Entry &entry : entries) {
+            u_int32_t pathLen;
+            payload = get(payload, end, entry.size);
+            payload = get(payload, end, entry.mode);
+            payload = get(payload, end, pathLen);
+            if (static_cast<size_t>(end - payload) < pathLen)
+                throw std::runtime_error("Malformed manifest message");
+            entry.path.assign(reinterpret_cast<const char *>(payload), pathLen);
+            payload += pathLen;
+            if (!isSafePath(entry.path))
+                throw std::runtime_error("Unsafe path in manifest: " + entry.path);
+            if (!entry.isDirectory())
+                totalSize += entry.size;
+        }
+    }
+
+    const std::vector<Entry> &getEntries() const {
+        return entries;
+    }
+
+    /* Size of the concatenated file contents. */
+    u_int64_t getTotalSize() const {
+        return totalSize;
+    }
+
+private:
+    static bool isSafePath(const std::string &path) {
+        if (path.empty() || path[0] == '/')
+            return false;
+        size_t start{0};
+        while (start <= path.size()) {
+            size_t end = path.find('/', start);
+            if (end == std::string::npos)
+                end = path.size();
+            const std::string part = path.substr(start, end - start);
+            if (part.empty() || part == "." || part == "..")
+                return false;
+            start = end + 1;
+        }
+        return true;
+    }
+
+    template<typename T>
+    static u_int8_t *put(u_int8_t *pos, T value) {
+        memcpy(pos, &value, sizeof(value));
+        return pos + sizeof(value);
+    }
+
+    template<typename T>
+    static const u_int8_t *get(const u_int8_t *pos, const u_int8_t *end, T &value) {
+        if (static_cast<size_t>(end - pos) < sizeof(value))
+            throw std::runtime_error("Malformed manifest message");
+        memcpy(&value, pos, sizeof(value));
+        return pos + sizeof(value);
+    }
+
+    static const size_t ENTRY_HEADER{sizeof(u_int64_t) + 2 * sizeof(u_int32_t)};
+
+    std::vector<Entry> entries;
+    u_int64_t totalSize{0};
+};
@@ -1,54 +1,83 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <stdexcept>
 
 constexpr int CHUNK_SIZE{4096 * 1024};
 
+/* The first message of a connection: the file name (NUL padded to
+   MAX_FILENAME_SIZE), the size and the flags. Encoding and decoding work on
+   fixed buffers and never allocate. */
 class MsgMetadata {
 public:
-    MsgMetadata(const std::string &filename, u_int64_t filesize)
-            : filename(filename), filesize(filesize) {
-        if (filename.size() >= MAX_FILENAME_SIZE) {
-            std::string err("Filename is too long. Max: ");
-            err += std::to_string(MAX_FILENAME_SIZE - 1);
-            err += ", actual: " + std::to_string(filename.size());
-            throw std::runtime_error(err);
-        }
+    enum Flags : u_int64_t {
+        /* Chunks are CHUNK_SIZE blocks of the file compressed one by one and
+           sent as [u64 length][zlib stream]; filesize is the uncompressed size.
+           A block as long as the raw block is not compressed. */
+        BLOCKS = 1,
+        /* Chunks are the file itself, not compressed. */
+        STORED = 2,
+        /* The name is a directory; the file is its contents packed as
+           described by the MANIFEST reply (MsgManifest). */
+        TREE = 4
+    };
+
+    MsgMetadata(const char *name, u_int64_t filesize, u_int64_t flags = 0)
+            : filesize(filesize), flags(flags) {
+        const size_t len = strnlen(name, MAX_FILENAME_SIZE);
+        if (len >= MAX_FILENAME_SIZE)
+            throw std::length_error("Filename is too long");
+        memcpy(filename, name, len);
     }
 
+    MsgMetadata(const std::string &filename, u_int64_t filesize, u_int64_t flags = 0)
+            : MsgMetadata(filename.c_str(), filesize, flags) {}
+
     MsgMetadata(const uint8_t *buf) {
-        auto *start = reinterpret_cast<const char *>(buf);
-        filename = std::string(start, strnlen(start, MAX_FILENAME_SIZE - 1));
-        start += MAX_FILENAME_SIZE;
-        memcpy(&(filesize), start, sizeof(filesize));
+        memcpy(filename, buf, MAX_FILENAME_SIZE - 1);
+        buf += MAX_FILENAME_SIZE;
+        memcpy(&(filesize), buf, sizeof(filesize));
+        buf += FILESIZE;
+        memcpy(&(flags), buf, sizeof(flags));
     }
 
-    void *generateMsg() {
-        auto *start = reinterpret_cast<char *>(msg);
-        memcpy(start, filename.data(), MAX_FILENAME_SIZE - 1);
-        start[filename.size()] = '\0'; // required until C++11
-        start += MAX_FILENAME_SIZE;
-        memcpy(start, &filesize, sizeof(filesize));
-
-        return msg;
+    /* Writes the MSG_SIZE bytes of the message to `buf`. */
+    void encode(uint8_t *buf) const {
+        memcpy(buf, filename, MAX_FILENAME_SIZE);
+        buf += MAX_FILENAME_SIZE;
+        memcpy(buf, &filesize, sizeof(filesize));
+        buf += FILESIZE;
+        memcpy(buf, &flags, sizeof(flags));
     }
 
-    std::string getFilename() const {
+    const char *getFilename() const {
         return filename;
     }
 
+    /* The client creates the name in its working directory, so it has to
+       be a single path component other than "." and "..". */
+    bool hasSafeFilename() const {
+        return filename[0] != '\0' && strchr(filename, '/') == nullptr && strcmp(filename, ".") != 0 &&
+               strcmp(filename, "..") != 0;
+    }
+
     u_int64_t getFilesize() const {
         return filesize;
     }
 
+    u_int64_t getFlags() const {
+        return flags;
+    }
+
     static const size_t MAX_FILENAME_SIZE{256};
     static const size_t FILESIZE{sizeof(u_int64_t)};
-    static const size_t MSG_SIZE{MAX_FILENAME_SIZE + FILESIZE};
+    static const size_t FLAGS{sizeof(u_int64_t)};
+    static const size_t MSG_SIZE{MAX_FILENAME_SIZE + FILESIZE + FLAGS};
 
 private:
-    char msg[MSG_SIZE];
-    std::string filename;
+    char filename[MAX_FILENAME_SIZE]{};
     u_int64_t filesize{};
+    u_int64_t flags{};
 };
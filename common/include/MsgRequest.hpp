@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <sys/types.h>
+
+/* Every client request is one u64. A plain chunk number asks for that chunk's
+   bytes. With the top bit set it is a control request instead: the next 7
+   bits select the kind and the low 56 bits carry its argument. Control
+   replies are length prefixed (u64 length, then the payload). */
+class MsgRequest {
+public:
+    enum Kind : u_int64_t {
+        /* Argument: the availability version the client has already seen. */
+        AVAILABILITY = 1,
+        /* Hashes of the uncompressed file per CHUNK_SIZE block (delta sync). */
+        HASHES = 2,
+        /* Argument: a block of the uncompressed file. The reply is that
+           block compressed on its own, length prefixed and sent like a
+           chunk. */
+        RAW_CHUNK = 3,
+        /* The file list of a tree, see MsgManifest. */
+        MANIFEST = 4
+    };
+
+    static u_int64_t make(Kind kind, u_int64_t arg) {
+        return CONTROL_BIT | (static_cast<u_int64_t>(kind) << KIND_SHIFT) | (arg & ARG_MASK);
+    }
+
+    static bool isControl(u_int64_t request) {
+        return (request & CONTROL_BIT) != 0;
+    }
+
+    static u_int64_t kind(u_int64_t request) {
+        return (request & ~CONTROL_BIT) >> KIND_SHIFT;
+    }
+
+    static u_int64_t arg(u_int64_t request) {
+        return request & ARG_MASK;
+    }
+
+private:
+    static const u_int64_t CONTROL_BIT{u_int64_t{1} << 63};
+    static const unsigned KIND_SHIFT{56};
+    static const u_int64_t ARG_MASK{(u_int64_t{1} << KIND_SHIFT) - 1};
+};
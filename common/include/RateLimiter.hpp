@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "Log.hpp"
+#include "Stats.hpp"
+
+/* Token bucket over bytes. A rate of 0 means unlimited. Tokens are refilled
+   lazily from the clock whenever the bucket is consulted, so there is no
+   timer per bucket. */
+class TokenBucket {
+public:
+    void setRate(u_int64_t bytesPerSec) {
+        const bool wasUnlimited = rate == 0;
+        rate = bytesPerSec;
+        burst = std::max<u_int64_t>(rate / BURST_DIVISOR, MIN_BURST);
+        tokens = wasUnlimited ? burst : std::min(tokens, burst);
+        lastRefill = steady_clock::now();
+    }
+
+    u_int64_t getRate() const {
+        return rate;
+    }
+
+    u_int64_t available(steady_clock::time_point now) {
+        if (rate == 0)
+            return UNLIMITED;
+        refill(now);
+        return tokens;
+    }
+
+    void consume(u_int64_t bytes) {
+        if (rate != 0)
+            tokens -= std::min(tokens, bytes);
+    }
+
+    /* Returns tokens taken but not used. */
+    void refund(u_int64_t bytes) {
+        if (rate != 0)
+            tokens = std::min(burst, tokens + bytes);
+    }
+
+    /* Time until `bytes` tokens will be available. */
+    steady_clock::duration waitFor(u_int64_t bytes, steady_clock::time_point now) {
+        if (rate == 0)
+            return steady_clock::duration::zero();
+        refill(now);
+        bytes = std::min(bytes, burst);
+        if (tokens >= bytes)
+            return steady_clock::duration::zero();
+        return std::chrono::duration_cast<steady_clock::duration>(
+                std::chrono::duration<double>(static_cast<double>(bytes - tokens) / rate));
+    }
+
+    static const u_int64_t UNLIMITED{~u_int64_t{0}};
+
+private:
+    void refill(steady_clock::time_point now) {
+        /* Threads sharing a bucket read the clock before taking its lock. */
+        if (now <= lastRefill)
+            return;
+        const double secs = std::chrono::duration<double>(now - lastRefill).count();
+        const u_int64_t fresh = static_cast<u_int64_t>(secs * rate);
+        if (fresh == 0)
+            return;
+        if (tokens + fresh >= burst) {
+            tokens = burst;
+            lastRefill = now;
+            return;
+        }
+        /* Keep the fraction of a byte for the next refill; frequent refills
+           would otherwise round the rate down noticeably. */
+        tokens += fresh;
+        lastRefill += std::chrono::duration_cast<steady_clock::duration>(
+                std::chrono::duration<double>(static_cast<double>(fresh) / rate));
+    }
+
+    /* The bucket holds at most 1/BURST_DIVISOR s worth of traffic. */
+    static const u_int64_t BURST_DIVISOR{20};
+    static const u_int64_t MIN_BURST{256 * 1024};
+
+    u_int64_t rate{0};
+    u_int64_t burst{MIN_BURST};
+    u_int64_t tokens{0};
+    steady_clock::time_point lastRefill{steady_clock::now()};
+};
+
+/* A TokenBucket several threads draw from, e.g. the global rate limit of
+   a server with several reactor threads. Checking and consuming separately
+   would let every thread spend the same tokens, so take() reserves them in
+   one step and refund() returns what a short send did not use. */
+class SharedTokenBucket {
+public:
+    void setRate(u_int64_t bytesPerSec) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (bucket.getRate() != bytesPerSec)
+            bucket.setRate(bytesPerSec);
+    }
+
+    u_int64_t available(steady_clock::time_point now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bucket.available(now);
+    }
+
+    /* Takes up to `bytes` tokens, returns how many it got. */
+    u_int64_t take(u_int64_t bytes, steady_clock::time_point now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        bytes = std::min(bytes, bucket.available(now));
+        bucket.consume(bytes);
+        return bytes;
+    }
+
+    void refund(u_int64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        bucket.refund(bytes);
+    }
+
+    steady_clock::duration waitFor(u_int64_t bytes, steady_clock::time_point now) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bucket.waitFor(bytes, now);
+    }
+
+private:
+    std::mutex mutex;
+    TokenBucket bucket;
+};
+
+const u_int64_t TokenBucket::UNLIMITED;
+const u_int64_t TokenBucket::MIN_BURST;
+
+struct RateLimits {
+    u_int64_t globalRate{0};
+    u_int64_t clientRate{0};
+
+    /* Bytes per second with an optional K, M or G (powers of 1024) suffix.
+       Negative, non-finite and out of range numbers are rejected. */
+    static u_int64_t parseRate(const std::string &value) {
+        size_t pos{0};
+        const double number = std::stod(value, &pos);
+        const std::string suffix = value.substr(pos);
+        double multiplier{1};
+        if (suffix == "K" || suffix == "k")
+            multiplier = 1024.0;
+        else if (suffix == "M" || suffix == "m")
+            multiplier = 1024.0 * 1024;
+        else if (suffix == "G" || suffix == "g")
+            multiplier = 1024.0 * 1024 * 1024;
+        else if (!suffix.empty())
+            throw std::runtime_error("Invalid rate: " + value);
+        const double rate = number * multiplier;
+        /* 2^64, the first value that does not fit. */
+        if (!std::isfinite(rate) || rate < 0 || rate >= 18446744073709551616.0)
+            throw std::runtime_error("Invalid rate: " + value);
+        return static_cast<u_int64_t>(rate);
+    }
+
+    /* Reads "rate=<value>" and "client-rate=<value>" lines; missing keys keep
+       their current value. Nothing changes unless the whole file parses. */
+    void load(const std::string &path) {
+        RateLimits loaded = *this;
+        std::ifstream file(path);
+        if (!file)
+            throw std::runtime_error("Cannot open " + path);
+
+        std::string line;
+        while (std::getline(file, line)) {
+            const size_t eq = line.find('=');
+            if (line.empty() || line[0] == '#' || eq == std::string::npos)
+                continue;
+            const std::string key = line.substr(0, eq);
+            const std::string value = line.substr(eq + 1);
+            if (key == "rate")
+                loaded.globalRate = parseRate(value);
+            else if (key == "client-rate")
+                loaded.clientRate = parseRate(value);
+            else
+                LOG_WARN("%s: unknown key %s", path.c_str(), key.c_str());
+        }
+        *this = loaded;
+    }
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+#include "Log.hpp"
+
+/* Hands chunk numbers from background threads to one reactor thread: push()
+   may be called from any thread and makes getFd() readable, the reactor
+   calls drain() once epoll reports it. */
+class ReadyQueue {
+public:
+    ReadyQueue() {
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd == -1) {
+            LOG_ERROR("eventfd: %s", strerror(errno));
+            throw std::runtime_error("Cannot create an eventfd");
+        }
+    }
+
+    ~ReadyQueue() {
+        close(fd);
+    }
+
+    ReadyQueue(const ReadyQueue &) = delete;
+    ReadyQueue &operator=(const ReadyQueue &) = delete;
+
+    int getFd() const {
+        return fd;
+    }
+
+    void push(u_int64_t chunkNo) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            chunks.push_back(chunkNo);
+        }
+        const u_int64_t one{1};
+        if (write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            LOG_ERROR("eventfd write: %s", strerror(errno));
+    }
+
+    /* Replaces `out` with everything pushed since the last call. */
+    void drain(std::vector<u_int64_t> &out) {
+        u_int64_t count;
+        if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+            LOG_ERROR("eventfd read: %s", strerror(errno));
+        out.clear();
+        std::lock_guard<std::mutex> lock(mutex);
+        out.swap(chunks);
+    }
+
+private:
+    int fd{-1};
+    std::mutex mutex;
+    std::vector<u_int64_t> chunks;
+};
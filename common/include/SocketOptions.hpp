@@ -0,0 +1,133 @@
+#pragma once
+
+#include <climits>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <unordered_set>
+#include "Log.hpp"
+#include "RateLimiter.hpp"
+#include "utils.hpp"
+
+/* Kernel TCP settings shared by haserver and haclient, set from the
+   --sndbuf/--rcvbuf/--bdp/--nodelay/--cork/--congestion/--busy-poll options.
+   Buffer sizes must be set before listen() or connect() to affect the
+   window scale, so apply() is called on fresh sockets; accepted sockets
+   inherit the buffers of the listening one and get the rest from
+   applyAccepted(). Options the kernel refuses (unknown congestion control,
+   busy polling without CAP_NET_ADMIN) are logged and skipped. */
+struct SocketOptions {
+    /* SO_SNDBUF/SO_RCVBUF in bytes, 0 keeps kernel autotuning. */
+    u_int64_t sndBuf{0};
+    u_int64_t rcvBuf{0};
+    bool noDelay{true};
+    /* Send chunk data with MSG_MORE so slices of one chunk fill whole
+       segments; the last slice is sent without it and flushes. */
+    bool cork{false};
+    std::string congestion;
+    unsigned busyPollUs{0};
+
+    /* Consumes one "--name=value" option. Returns false if `arg` is not a
+       socket option. */
+    bool parse(const std::string &arg) {
+        std::string value;
+        if (matchOption(arg, "sndbuf", value)) {
+            sndBuf = checkInt(RateLimits::parseRate(value));
+        } else if (matchOption(arg, "rcvbuf", value)) {
+            rcvBuf = checkInt(RateLimits::parseRate(value));
+        } else if (matchOption(arg, "bdp", value)) {
+            sndBuf = rcvBuf = checkInt(parseBdp(value));
+        } else if (matchOption(arg, "nodelay", value)) {
+            noDelay = value != "0";
+        } else if (matchOption(arg, "cork", value)) {
+            cork = value != "0";
+        } else if (matchOption(arg, "congestion", value)) {
+            congestion = value;
+        } else if (matchOption(arg, "busy-poll", value)) {
+            busyPollUs = static_cast<unsigned>(checkInt(std::stoull(value)));
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    /* "<rate>:<rtt ms>", e.g. "100M:40": one bandwidth-delay product, the
+       amount of data that has to be in flight to keep such a link busy. */
+    static u_int64_t parseBdp(const std::string &value) {
+        const size_t colon = value.find(':');
+        if (colon == std::string::npos)
+            throw std::runtime_error("Invalid --bdp, expected <bytes/s>:<rtt ms>: " + value);
+        const u_int64_t rate = RateLimits::parseRate(value.substr(0, colon));
+        const u_int64_t rttMs = std::stoull(value.substr(colon + 1));
+        return rate * rttMs / 1000;
+    }
+
+    /* Before bind()/connect(). */
+    void apply(int sock) const {
+        if (sndBuf != 0)
+            set(sock, SOL_SOCKET, SO_SNDBUF, static_cast<int>(sndBuf), "SO_SNDBUF");
+        if (rcvBuf != 0)
+            set(sock, SOL_SOCKET, SO_RCVBUF, static_cast<int>(rcvBuf), "SO_RCVBUF");
+        applyAccepted(sock);
+    }
+
+    void applyAccepted(int sock) const {
+        set(sock, IPPROTO_TCP, TCP_NODELAY, noDelay ? 1 : 0, "TCP_NODELAY");
+        if (!congestion.empty() &&
+            setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, congestion.data(),
+                       static_cast<socklen_t>(congestion.size())) == -1)
+            warnOnce("TCP_CONGESTION");
+        if (busyPollUs != 0)
+            set(sock, SOL_SOCKET, SO_BUSY_POLL, static_cast<int>(busyPollUs), "SO_BUSY_POLL");
+    }
+
+    /* Extra send() flags for a slice that is not the end of a chunk. */
+    int moreFlag() const {
+        return cork ? MSG_MORE : 0;
+    }
+
+    /* The effective settings of `sock`, for the log. */
+    std::string describe(int sock) const {
+        int snd{0}, rcv{0};
+        socklen_t len = sizeof(snd);
+        getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &snd, &len);
+        len = sizeof(rcv);
+        getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcv, &len);
+        return "sndbuf " + std::to_string(snd) + ", rcvbuf " + std::to_string(rcv) +
+               ", nodelay " + (noDelay ? "on" : "off") + ", cork " + (cork ? "on" : "off") +
+               ", congestion " + (congestion.empty() ? "default" : congestion) +
+               ", busy-poll " + std::to_string(busyPollUs) + " us";
+    }
+
+    static constexpr const char *USAGE =
+            "  --sndbuf=<bytes>        SO_SNDBUF, K/M/G suffixes allowed (default kernel autotuning)\n"
+            "  --rcvbuf=<bytes>        SO_RCVBUF (default kernel autotuning)\n"
+            "  --bdp=<bytes/s>:<ms>    size both buffers to the bandwidth-delay product of the link\n"
+            "  --nodelay=<0|1>         TCP_NODELAY, send small control messages at once (default 1)\n"
+            "  --cork=<0|1>            send chunk data with MSG_MORE so it leaves in full segments (default 0)\n"
+            "  --congestion=<name>     TCP congestion control, e.g. cubic or bbr (default system)\n"
+            "  --busy-poll=<us>        SO_BUSY_POLL, busy wait on the device queue (default 0, off)\n";
+
+private:
+    /* setsockopt() takes these as an int. */
+    static u_int64_t checkInt(u_int64_t value) {
+        if (value > static_cast<u_int64_t>(INT_MAX))
+            throw std::runtime_error("Value above " + std::to_string(INT_MAX));
+        return value;
+    }
+
+    static void set(int sock, int level, int name, int value, const char *label) {
+        if (setsockopt(sock, level, name, &value, sizeof(value)) == -1)
+            warnOnce(label);
+    }
+
+    /* Every connection gets the same options, so each failure is logged
+       only the first time. */
+    static void warnOnce(const char *label) {
+        const int err = errno;
+        thread_local std::unordered_set<std::string> warned;
+        if (warned.insert(label).second)
+            LOG_WARN("setsockopt %s: %s, ignoring", label, strerror(err));
+    }
+};
@@ -0,0 +1,430 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Log.hpp"
+
+/* Transfer metrics.
+   Every thread records into its own StatsShard, so the hot path is a relaxed
+   load + store on memory no other thread writes. Readers (the periodic
+   reporter or a dump request) sum all shards. */
+
+enum class Counter : size_t {
+    BYTES_IN, BYTES_OUT, CHUNKS_REQUESTED, CHUNKS_DONE, RETRIES,
+    DISK_BYTES, DISK_BLOCKED_NS, CONNECTIONS, CACHE_HITS, CACHE_MISSES, BLOCKS_STORED, WASTED_BYTES, COUNT
+};
+
+enum class Gauge : size_t {
+    QUEUE_DEPTH, IN_FLIGHT, ACTIVE_CONNECTIONS, COUNT
+};
+
+enum class Hist : size_t {
+    CHUNK_LATENCY_US, DISK_WRITE_US, DISK_READ_US, COUNT
+};
+
+using steady_clock = std::chrono::steady_clock;
+
+inline u_int64_t elapsedUs(steady_clock::time_point since) {
+    return static_cast<u_int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            steady_clock::now() - since).count());
+}
+
+inline u_int64_t elapsedNs(steady_clock::time_point since) {
+    return static_cast<u_int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            steady_clock::now() - since).count());
+}
+
+/* Single-writer add: cheaper than fetch_add, still safe to read concurrently. */
+inline void bump(std::atomic<u_int64_t> &cell, u_int64_t n = 1) {
+    cell.store(cell.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+class Histogram {
+public:
+    static const size_t BUCKETS{40};
+
+    void record(u_int64_t value) {
+        bump(buckets[bucketOf(value)]);
+        bump(sum, value);
+    }
+
+    void mergeInto(std::vector<u_int64_t> &totals, u_int64_t &totalSum) const {
+        totals.resize(BUCKETS);
+        for (size_t i = 0; i < BUCKETS; ++i)
+            totals[i] += buckets[i].load(std::memory_order_relaxed);
+        totalSum += sum.load(std::memory_order_relaxed);
+    }
+
+    /* Upper bound of the bucket holding the q-th quantile. */
+    static u_int64_t quantile(const std::vector<u_int64_t> &totals, double q) {
+        u_int64_t count{0};
+        for (u_int64_t b : totals)
+            count += b;
+        if (count == 0)
+            return 0;
+
+        u_int64_t rank = static_cast<u_int64_t>(q * (count - 1)) + 1;
+        u_int64_t seen{0};
+        for (size_t i = 0; i < totals.size(); ++i) {
+            seen += totals[i];
+            if (seen >= rank)
+                return upperBound(i);
+        }
+        return upperBound(totals.size() - 1);
+    }
+
+    static u_int64_t upperBound(size_t bucket) {
+        return bucket == 0 ? 0 : (u_int64_t{1} << bucket) - 1;
+    }
+
+private:
+    static size_t bucketOf(u_int64_t value) {
+        size_t bucket{0};
+        while (value != 0 && bucket < BUCKETS - 1) {
+            value >>= 1;
+            ++bucket;
+        }
+        return bucket;
+    }
+
+    std::atomic<u_int64_t> buckets[BUCKETS]{};
+    std::atomic<u_int64_t> sum{0};
+};
+
+const size_t Histogram::BUCKETS;
+
+/* Per-source figures. A PeerStats is written only by the thread that owns
+   the connection, so it is per-thread storage as far as writers go. */
+struct PeerStats {
+    PeerStats(u_int64_t id, const std::string &label) : id(id), label(label) {}
+
+    void addBytes(u_int64_t n) {
+        bump(bytes, n);
+    }
+
+    void chunkDone(u_int64_t latencyUs) {
+        bump(chunks);
+        latency.record(latencyUs);
+    }
+
+    const u_int64_t id;
+    const std::string label;
+    std::atomic<u_int64_t> bytes{0};
+    std::atomic<u_int64_t> chunks{0};
+    Histogram latency;
+};
+
+struct StatsShard {
+    std::atomic<u_int64_t> counters[static_cast<size_t>(Counter::COUNT)]{};
+    Histogram hists[static_cast<size_t>(Hist::COUNT)];
+};
+
+class Stats {
+public:
+    static void add(Counter counter, u_int64_t n = 1) {
+        bump(local().counters[static_cast<size_t>(counter)], n);
+    }
+
+    static void record(Hist hist, u_int64_t value) {
+        local().hists[static_cast<size_t>(hist)].record(value);
+    }
+
+    static void set(Gauge gauge, u_int64_t value) {
+        instance().gauges[static_cast<size_t>(gauge)].store(value, std::memory_order_relaxed);
+    }
+
+    /* For gauges several threads contribute to. */
+    static void adjust(Gauge gauge, int64_t delta) {
+        instance().gauges[static_cast<size_t>(gauge)].fetch_add(static_cast<u_int64_t>(delta),
+                                                                std::memory_order_relaxed);
+    }
+
+    static PeerStats *registerPeer(const std::string &label) {
+        Stats &stats = instance();
+        std::lock_guard<std::mutex> lock(stats.mutex);
+        stats.peers.emplace_back(stats.nextPeerId++, label);
+        return &stats.peers.back();
+    }
+
+    static void unregisterPeer(const PeerStats *peer) {
+        Stats &stats = instance();
+        std::lock_guard<std::mutex> lock(stats.mutex);
+        stats.peers.remove_if([peer](const PeerStats &p) { return &p == peer; });
+    }
+
+    struct Snapshot {
+        steady_clock::time_point taken;
+        std::vector<u_int64_t> counters;
+        std::vector<u_int64_t> gauges;
+        std::vector<std::vector<u_int64_t>> hists;
+        std::vector<u_int64_t> histSums;
+        std::vector<u_int64_t> peerIds;
+        std::vector<std::string> peerLabels;
+        std::vector<u_int64_t> peerBytes;
+        std::vector<u_int64_t> peerChunks;
+        std::vector<std::vector<u_int64_t>> peerLatency;
+
+        u_int64_t counter(Counter c) const {
+            return counters[static_cast<size_t>(c)];
+        }
+
+        u_int64_t gauge(Gauge g) const {
+            return gauges[static_cast<size_t>(g)];
+        }
+
+        const std::vector<u_int64_t> &hist(Hist h) const {
+            return hists[static_cast<size_t>(h)];
+        }
+    };
+
+    static Snapshot snapshot() {
+        Stats &stats = instance();
+        Snapshot snap;
+        snap.taken = steady_clock::now();
+        snap.counters.assign(static_cast<size_t>(Counter::COUNT), 0);
+        snap.hists.assign(static_cast<size_t>(Hist::COUNT), std::vector<u_int64_t>(Histogram::BUCKETS));
+        snap.histSums.assign(static_cast<size_t>(Hist::COUNT), 0);
+
+        std::lock_guard<std::mutex> lock(stats.mutex);
+        for (const auto &shard : stats.shards) {
+            for (size_t i = 0; i < snap.counters.size(); ++i)
+                snap.counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+            for (size_t i = 0; i < snap.hists.size(); ++i)
+                shard->hists[i].mergeInto(snap.hists[i], snap.histSums[i]);
+        }
+        for (const auto &gauge : stats.gauges)
+            snap.gauges.push_back(gauge.load(std::memory_order_relaxed));
+        for (const auto &peer : stats.peers) {
+            snap.peerIds.push_back(peer.id);
+            snap.peerLabels.push_back(peer.label);
+            snap.peerBytes.push_back(peer.bytes.load(std::memory_order_relaxed));
+            snap.peerChunks.push_back(peer.chunks.load(std::memory_order_relaxed));
+            u_int64_t unused{0};
+            snap.peerLatency.emplace_back(Histogram::BUCKETS);
+            peer.latency.mergeInto(snap.peerLatency.back(), unused);
+        }
+        return snap;
+    }
+
+    /* One line meant for a terminal: rates since `prev`, latency quantiles,
+       how much of the interval was spent blocked on disk, scheduler depth. */
+    static std::string compactLine(const Snapshot &cur, const Snapshot &prev) {
+        double secs = std::chrono::duration<double>(cur.taken - prev.taken).count();
+        if (secs <= 0)
+            secs = 1;
+
+        auto rate = [secs](u_int64_t now, u_int64_t before) {
+            return (now - before) / secs / (1024 * 1024);
+        };
+
+        std::ostringstream ss;
+        ss << std::fixed << std::setprecision(1) << "stats: in "
+           << rate(cur.counter(Counter::BYTES_IN), prev.counter(Counter::BYTES_IN)) << " MiB/s, out "
+           << rate(cur.counter(Counter::BYTES_OUT), prev.counter(Counter::BYTES_OUT)) << " MiB/s";
+        for (size_t i = 0; i < cur.peerLabels.size(); ++i) {
+            u_int64_t before{0};
+            for (size_t j = 0; j < prev.peerIds.size(); ++j)
+                if (prev.peerIds[j] == cur.peerIds[i])
+                    before = prev.peerBytes[j];
+            ss << " | " << cur.peerLabels[i] << " " << rate(cur.peerBytes[i], before) << " MiB/s";
+        }
+
+        const auto &latency = cur.hist(Hist::CHUNK_LATENCY_US);
+        double blockedNs = cur.counter(Counter::DISK_BLOCKED_NS) - prev.counter(Counter::DISK_BLOCKED_NS);
+        ss << " | chunk p50 " << Histogram::quantile(latency, 0.5) / 1000
+           << "ms p99 " << Histogram::quantile(latency, 0.99) / 1000 << "ms"
+           << " | disk " << 100.0 * blockedNs / (secs * 1e9) << "% blocked"
+           << " | queue " << cur.gauge(Gauge::QUEUE_DEPTH)
+           << " in-flight " << cur.gauge(Gauge::IN_FLIGHT)
+           << " | chunks " << cur.counter(Counter::CHUNKS_DONE)
+           << " retries " << cur.counter(Counter::RETRIES)
+           << " wasted " << cur.counter(Counter::WASTED_BYTES) / (1024.0 * 1024) << " MiB";
+        return ss.str();
+    }
+
+    static std::string toJson(const Snapshot &snap) {
+        std::ostringstream ss;
+        ss << "{\"counters\":{";
+        for (size_t i = 0; i < snap.counters.size(); ++i)
+            ss << (i ? "," : "") << "\"" << COUNTER_NAMES[i] << "\":" << snap.counters[i];
+        ss << "},\"gauges\":{";
+        for (size_t i = 0; i < snap.gauges.size(); ++i)
+            ss << (i ? "," : "") << "\"" << GAUGE_NAMES[i] << "\":" << snap.gauges[i];
+        ss << "},\"histograms\":{";
+        for (size_t i = 0; i < snap.hists.size(); ++i) {
+            ss << (i ? "," : "") << "\"" << HIST_NAMES[i] << "\":";
+            histJson(ss, snap.hists[i], snap.histSums[i]);
+        }
+        ss << "},\"peers\":[";
+        for (size_t i = 0; i < snap.peerLabels.size(); ++i) {
+            ss << (i ? "," : "") << "{\"peer\":\"" << snap.peerLabels[i] << "\",\"bytes\":"
+               << snap.peerBytes[i] << ",\"chunks\":" << snap.peerChunks[i] << ",\"latency_us\":";
+            histJson(ss, snap.peerLatency[i], 0);
+            ss << "}";
+        }
+        ss << "]}";
+        return ss.str();
+    }
+
+    static std::string toPrometheus(const Snapshot &snap) {
+        std::ostringstream ss;
+        for (size_t i = 0; i < snap.counters.size(); ++i)
+            ss << "# TYPE ha_" << COUNTER_NAMES[i] << "_total counter\n"
+               << "ha_" << COUNTER_NAMES[i] << "_total " << snap.counters[i] << "\n";
+        for (size_t i = 0; i < snap.gauges.size(); ++i)
+            ss << "# TYPE ha_" << GAUGE_NAMES[i] << " gauge\n"
+               << "ha_" << GAUGE_NAMES[i] << " " << snap.gauges[i] << "\n";
+        for (size_t i = 0; i < snap.hists.size(); ++i) {
+            ss << "# TYPE ha_" << HIST_NAMES[i] << " histogram\n";
+            histPrometheus(ss, std::string("ha_") + HIST_NAMES[i], "", snap.hists[i], snap.histSums[i]);
+        }
+        ss << "# TYPE ha_peer_bytes_total counter\n";
+        for (size_t i = 0; i < snap.peerLabels.size(); ++i)
+            ss << "ha_peer_bytes_total{peer=\"" << snap.peerLabels[i] << "\"} " << snap.peerBytes[i] << "\n";
+        ss << "# TYPE ha_peer_chunks_total counter\n";
+        for (size_t i = 0; i < snap.peerLabels.size(); ++i)
+            ss << "ha_peer_chunks_total{peer=\"" << snap.peerLabels[i] << "\"} " << snap.peerChunks[i] << "\n";
+        return ss.str();
+    }
+
+private:
+    static StatsShard &local() {
+        thread_local StatsShard *shard = instance().newShard();
+        return *shard;
+    }
+
+    static Stats &instance() {
+        static Stats stats;
+        return stats;
+    }
+
+    StatsShard *newShard() {
+        std::lock_guard<std::mutex> lock(mutex);
+        shards.push_back(std::make_unique<StatsShard>());
+        return shards.back().get();
+    }
+
+    static void histJson(std::ostringstream &ss, const std::vector<u_int64_t> &totals, u_int64_t sum) {
+        u_int64_t count{0};
+        for (u_int64_t b : totals)
+            count += b;
+        ss << "{\"count\":" << count << ",\"sum\":" << sum
+           << ",\"p50\":" << Histogram::quantile(totals, 0.5)
+           << ",\"p90\":" << Histogram::quantile(totals, 0.9)
+           << ",\"p99\":" << Histogram::quantile(totals, 0.99) << "}";
+    }
+
+    static void histPrometheus(std::ostringstream &ss, const std::string &name, const std::string &labels,
+                               const std::vector<u_int64_t> &totals, u_int64_t sum) {
+        u_int64_t cumulative{0};
+        for (size_t i = 0; i < totals.size(); ++i) {
+            cumulative += totals[i];
+            if (totals[i] == 0 && i + 1 != totals.size())
+                continue;
+            ss << name << "_bucket{" << labels << "le=\"" << Histogram::upperBound(i) << "\"} " << cumulative << "\n";
+        }
+        ss << name << "_bucket{" << labels << "le=\"+Inf\"} " << cumulative << "\n"
+           << name << "_sum " << sum << "\n" << name << "_count " << cumulative << "\n";
+    }
+
+    static constexpr const char *COUNTER_NAMES[] = {
+        "bytes_in", "bytes_out", "chunks_requested", "chunks_done", "retries",
+        "disk_bytes", "disk_blocked_ns", "connections", "cache_hits", "cache_misses", "blocks_stored",
+        "wasted_bytes"
+    };
+    static constexpr const char *GAUGE_NAMES[] = {"queue_depth", "in_flight", "active_connections"};
+    static constexpr const char *HIST_NAMES[] = {"chunk_latency_us", "disk_write_us", "disk_read_us"};
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<StatsShard>> shards;
+    std::atomic<u_int64_t> gauges[static_cast<size_t>(Gauge::COUNT)]{};
+    std::list<PeerStats> peers;
+    u_int64_t nextPeerId{0};
+};
+
+constexpr const char *Stats::COUNTER_NAMES[];
+constexpr const char *Stats::GAUGE_NAMES[];
+constexpr const char *Stats::HIST_NAMES[];
+
+/* Background thread printing a compact stats line every `intervalSec`
+   seconds (0 disables it). SIGUSR1 dumps everything as JSON and SIGUSR2 as
+   Prometheus text, both to stderr. */
+class StatsReporter {
+public:
+    explicit StatsReporter(unsigned intervalSec) : intervalSec(intervalSec) {
+        std::signal(SIGUSR1, [](int) { dumpRequest = DUMP_JSON; });
+        std::signal(SIGUSR2, [](int) { dumpRequest = DUMP_PROMETHEUS; });
+        thread = std::thread(&StatsReporter::run, this);
+    }
+
+    ~StatsReporter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        thread.join();
+    }
+
+private:
+    void run() {
+        Stats::Snapshot prev = Stats::snapshot();
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!cv.wait_for(lock, POLL_PERIOD, [this] { return stopping; })) {
+            int request = dumpRequest.exchange(NO_DUMP);
+            if (request == DUMP_JSON)
+                std::cerr << Stats::toJson(Stats::snapshot()) << std::endl;
+            else if (request == DUMP_PROMETHEUS)
+                std::cerr << Stats::toPrometheus(Stats::snapshot()) << std::flush;
+
+            if (intervalSec == 0 || steady_clock::now() - prev.taken < std::chrono::seconds(intervalSec))
+                continue;
+            Stats::Snapshot cur = Stats::snapshot();
+            LOG_INFO("%s", Stats::compactLine(cur, prev).c_str());
+            prev = std::move(cur);
+        }
+    }
+
+    enum { NO_DUMP, DUMP_JSON, DUMP_PROMETHEUS };
+    static std::atomic<int> dumpRequest;
+    static constexpr std::chrono::milliseconds POLL_PERIOD{200};
+
+    const unsigned intervalSec;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping{false};
+    std::thread thread;
+};
+
+std::atomic<int> StatsReporter::dumpRequest{StatsReporter::NO_DUMP};
+constexpr std::chrono::milliseconds StatsReporter::POLL_PERIOD;
+
+/* Logs how long one phase of a transfer (compress, download, merge, ...) took
+   once it goes out of scope. The bench script collects these lines. */
+class PhaseTimer {
+public:
+    explicit PhaseTimer(const char *name) : name(name), start(steady_clock::now()) {}
+
+    ~PhaseTimer() {
+        LOG_INFO("Phase %s took %lu ms", name, elapsedUs(start) / 1000);
+    }
+
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+private:
+    const char *name;
+    const steady_clock::time_point start;
+};
@@ -7,6 +7,7 @@
 #include <cerrno>
 #include <cstring>
 #include <sstream>
+#include "Log.hpp"
 
 
 bool doesFileExists(const std::string &filepath) {
@@ -14,11 +15,16 @@ bool doesFileExists(const std::string &filepath) {
     return (stat(filepath.c_str(), &buffer) == 0);
 }
 
+bool isDirectory(const std::string &path) {
+    struct stat st{};
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
 u_int64_t getFileSize(const std::string &filepath) {
     struct stat buffer{};
     if (stat(filepath.c_str(), &buffer) != 0) {
-        perror("stat: ");
-        exit(EXIT_FAILURE);
+        LOG_ERROR("stat: %s: %s", filepath.c_str(), strerror(errno));
+        throw std::runtime_error("Cannot stat " + filepath);
     }
     return static_cast<u_int64_t>(buffer.st_size);
 }
@@ -34,7 +40,7 @@ u_int64_t getNumberOfChunks(u_int64_t dataSize, u_int64_t chunkSize) {
 u_int64_t getSizeOfChunk(u_int64_t fileSize, u_int64_t chunkNo, u_int64_t chunkSize) {
     if (chunkNo < getNumberOfChunks(fileSize, chunkSize) - 1)
         return chunkSize;
-    return fileSize % chunkSize;
+    return fileSize - chunkNo * chunkSize;
 }
 
 std::string ipToStr(const struct sockaddr *sa) {
@@ -62,7 +68,7 @@ std::string ipToStr(const struct sockaddr *sa) {
 int unlinkCb(const char *fpath, const struct stat *, int, struct FTW *) {
     int rv = remove(fpath);
     if (rv)
-        perror(fpath);
+        LOG_ERROR("%s: %s", fpath, strerror(errno));
 
     return rv;
 }
@@ -71,23 +77,36 @@ int removeRecursively(const char *path) {
     return nftw(path, unlinkCb, 64, FTW_DEPTH | FTW_PHYS);
 }
 
-void tryWriteAll(int sockFd, void *msg, size_t count) {
+void tryWriteAll(int sockFd, const void *msg, size_t count) {
     size_t written_bytes{0};
 
     while (written_bytes < count) {
-        ssize_t rv = write(sockFd, (u_int8_t *) msg + written_bytes,
+        ssize_t rv = write(sockFd, (const u_int8_t *) msg + written_bytes,
                            count - written_bytes);
         if (rv == -1) {
-            perror("write");
+            LOG_ERROR("write: %s", strerror(errno));
             throw std::exception();
         }
         written_bytes += rv;
     }
 }
 
-void tryClose(int sockfd, const std::string& msg) {
+/* Matches "--<name>=<value>" and stores <value>. */
+bool matchOption(const std::string &arg, const std::string &name, std::string &value) {
+    const std::string prefix = "--" + name + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0)
+        return false;
+    value = arg.substr(prefix.size());
+    return true;
+}
+
+void tryClose(int sockfd, const char *msg) {
     if (close(sockfd)) {
-        perror("close");
+        LOG_ERROR("close: %s", strerror(errno));
         throw std::runtime_error(msg);
     }
+}
+
+void tryClose(int sockfd, const std::string& msg) {
+    tryClose(sockfd, msg.c_str());
 }
\ No newline at end of file
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "ChunkCache.hpp"
+#include "ChunkSource.hpp"
+#include "Gzip.hpp"
+#include "Log.hpp"
+#include "MsgHashes.hpp"
+#include "MsgMetadata.hpp"
+#include "Stats.hpp"
+#include "utils.hpp"
+
+/* The uncompressed file cut into CHUNK_SIZE blocks, each compressed on its
+   own when first requested and kept in a bounded LRU. Every block is sent
+   as [u64 length][zlib stream], so a client can inflate blocks in any order.
+   A block deflate cannot shrink is sent as it is; its length then equals
+   the raw block length, which is how the client tells. Serves delta sync
+   for a ChunkStore, and on its own is the on-demand mode: no compressed
+   copy of the file is written and serving starts at once, whatever the
+   file size. Blocks that are not cached are compressed by a pool of worker
+   threads, never on a reactor thread: tryAcquire() queues the block and
+   the reactors hear through their ReadyQueue when it is done. */
+class BlockStore : public ChunkSource {
+public:
+    BlockStore(const std::string &path, u_int64_t rawSize, size_t cacheBytes, int level)
+            : rawSize(rawSize), level(level), cache(cacheBytes) {
+        rawFd = open(path.c_str(), O_RDONLY, 0);
+        if (rawFd == -1) {
+            LOG_ERROR("open: %s: %s", path.c_str(), strerror(errno));
+            throw std::runtime_error("Cannot open " + path);
+        }
+        ChunkBitmap all(getBlocks());
+        all.setAll();
+        log = AvailabilityLog::of(all);
+    }
+
+    ~BlockStore() override {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            stopping = true;
+        }
+        jobReady.notify_all();
+        for (std::thread &worker : workers)
+            worker.join();
+        if (hasher.joinable())
+            hasher.join();
+        close(rawFd);
+    }
+
+    BlockStore(const BlockStore &) = delete;
+    BlockStore &operator=(const BlockStore &) = delete;
+
+    u_int64_t getBlocks() const {
+        return getNumberOfChunks(rawSize, CHUNK_SIZE);
+    }
+
+    const AvailabilityLog &availability() const override {
+        return log;
+    }
+
+    /* Only the blocks set in `held` are advertised and served. */
+    void restrictTo(const ChunkBitmap &held) {
+        log = AvailabilityLog::of(held);
+    }
+
+    /* Send every block as it is, for input that is known not to compress. */
+    void setStoreOnly(bool storeOnly) {
+        this->storeOnly = storeOnly;
+    }
+
+    /* Blocks the caller until the block is compressed. */
+    ChunkRef acquire(u_int64_t blockNo) override {
+        checkBlock(blockNo);
+        ChunkCache::Data data = cache.get(blockNo);
+        if (!data) {
+            data = prepareBlock(blockNo);
+            cache.put(blockNo, data);
+        }
+        return refTo(blockNo, data);
+    }
+
+    bool tryAcquire(u_int64_t blockNo, ChunkRef &ref) override {
+        return tryAcquireRaw(blockNo, ref);
+    }
+
+    void subscribe(ReadyQueue *queue) override {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        readyQueues.push_back(queue);
+    }
+
+    void unsubscribe(ReadyQueue *queue) override {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        readyQueues.erase(std::remove(readyQueues.begin(), readyQueues.end(), queue), readyQueues.end());
+    }
+
+    /* Hashes every block on a thread of its own; HASHES requests are
+       answered from memory once it is done. */
+    void prepareHashes() {
+        hasher = std::thread(&BlockStore::hashBlocks, this);
+    }
+
+    bool tryEncodeHashes(std::vector<u_int8_t> &out) override {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        if (!hashesFailed.empty())
+            throw std::runtime_error(hashesFailed);
+        if (hashesMsg.empty())
+            return false;
+        out.insert(out.end(), hashesMsg.begin(), hashesMsg.end());
+        return true;
+    }
+
+    bool tryAcquireRaw(u_int64_t blockNo, ChunkRef &ref) override {
+        checkBlock(blockNo);
+        ChunkCache::Data data = cache.get(blockNo);
+        if (!data) {
+            prepareLater(blockNo);
+            return false;
+        }
+        ref = refTo(blockNo, data);
+        return true;
+    }
+
+private:
+    void checkBlock(u_int64_t blockNo) const {
+        if (blockNo >= getBlocks())
+            throw std::runtime_error("Invalid raw chunk requested. Dropping connection");
+    }
+
+    static ChunkRef refTo(u_int64_t blockNo, const ChunkCache::Data &data) {
+        ChunkRef ref;
+        ref.chunkNo = blockNo;
+        ref.size = data->size();
+        ref.owned = data;
+        ref.data = data->data();
+        return ref;
+    }
+
+    /* Queues the block for the workers unless it already is. A block whose
+       last attempt failed is reported to the next caller instead. */
+    void prepareLater(u_int64_t blockNo) {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        if (failed.erase(blockNo) != 0)
+            throw std::runtime_error("Cannot prepare block " + std::to_string(blockNo));
+        if (!queued.insert(blockNo).second)
+            return;
+        if (workers.empty()) {
+            const unsigned count = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned i = 0; i < count; ++i)
+                workers.emplace_back(&BlockStore::runWorker, this);
+            LOG_INFO("Started %u block compression threads", count);
+        }
+        jobs.push_back(blockNo);
+        jobReady.notify_one();
+    }
+
+    void runWorker() {
+        std::unique_lock<std::mutex> lock(jobMutex);
+        while (true) {
+            jobReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping)
+                return;
+            const u_int64_t blockNo = jobs.front();
+            jobs.pop_front();
+            lock.unlock();
+
+            bool ok{true};
+            try {
+                cache.put(blockNo, prepareBlock(blockNo));
+            } catch (const std::exception &e) {
+                LOG_ERROR("Block %lu: %s", blockNo, e.what());
+                ok = false;
+            }
+
+            lock.lock();
+            queued.erase(blockNo);
+            if (!ok)
+                failed.insert(blockNo);
+            for (ReadyQueue *queue : readyQueues)
+                queue->push(blockNo);
+        }
+    }
+
+    void hashBlocks() {
+        const auto start = steady_clock::now();
+        std::vector<MsgHashes::BlockHash> hashes;
+        std::vector<u_int8_t> msg;
+        std::string error;
+        try {
+            std::vector<u_int8_t> block(CHUNK_SIZE);
+            for (u_int64_t blockNo = 0; blockNo < getBlocks(); ++blockNo) {
+                if (isStopping())
+                    return;
+                const u_int64_t len = getSizeOfChunk(rawSize, blockNo, CHUNK_SIZE);
+                readRaw(block.data(), len, blockNo * CHUNK_SIZE);
+                hashes.push_back(MsgHashes::hashBlock(block.data(), len));
+            }
+            MsgHashes::encode(rawSize, hashes, msg);
+            LOG_INFO("Hashed %lu blocks of the original file in %lu ms", getBlocks(), elapsedUs(start) / 1000);
+        } catch (const std::exception &e) {
+            LOG_ERROR("Cannot hash the original file: %s", e.what());
+            error = e.what();
+        }
+
+        std::lock_guard<std::mutex> lock(jobMutex);
+        hashesMsg.swap(msg);
+        hashesFailed = error;
+        for (ReadyQueue *queue : readyQueues)
+            queue->push(HASHES_READY);
+    }
+
+    bool isStopping() {
+        std::lock_guard<std::mutex> lock(jobMutex);
+        return stopping;
+    }
+
+    ChunkCache::Data prepareBlock(u_int64_t blockNo) {
+        return storeOnly ? storeBlock(blockNo) : compressBlock(blockNo);
+    }
+
+    /* Streams the block from disk through the deflater, so only the
+       compressed result is held in full. */
+    ChunkCache::Data compressBlock(u_int64_t blockNo) {
+        thread_local std::unique_ptr<DeflateStream> stream;
+        if (!stream || stream->getLevel() != level)
+            stream = std::make_unique<DeflateStream>(level);
+        stream->reset();
+
+        const auto start = steady_clock::now();
+        const u_int64_t len = getSizeOfChunk(rawSize, blockNo, CHUNK_SIZE);
+        std::vector<u_int8_t> piece(READ_SIZE);
+        for (u_int64_t offset = 0; offset < len; offset += READ_SIZE) {
+            const size_t pieceLen = len - offset < READ_SIZE ? static_cast<size_t>(len - offset) : READ_SIZE;
+            readRaw(piece.data(), pieceLen, blockNo * CHUNK_SIZE + offset);
+            stream->push(piece.data(), pieceLen);
+        }
+        stream->finish();
+
+        const u_int64_t blobLen = stream->available();
+        if (blobLen >= len) {
+            Stats::add(Counter::BLOCKS_STORED);
+            return storeBlock(blockNo);
+        }
+        auto data = std::make_shared<std::vector<u_int8_t>>(sizeof(blobLen) + blobLen);
+        memcpy(data->data(), &blobLen, sizeof(blobLen));
+        stream->pull(data->data() + sizeof(blobLen), blobLen);
+        LOG_DEBUG("Compressed block %lu: %lu -> %lu bytes in %lu us", blockNo, len, blobLen, elapsedUs(start));
+        return data;
+    }
+
+    ChunkCache::Data storeBlock(u_int64_t blockNo) {
+        const u_int64_t len = getSizeOfChunk(rawSize, blockNo, CHUNK_SIZE);
+        auto data = std::make_shared<std::vector<u_int8_t>>(sizeof(len) + len);
+        memcpy(data->data(), &len, sizeof(len));
+        readRaw(data->data() + sizeof(len), len, blockNo * CHUNK_SIZE);
+        return data;
+    }
+
+    void readRaw(u_int8_t *buf, size_t len, u_int64_t offset) {
+        const auto start = steady_clock::now();
+        size_t readBytes{0};
+        while (readBytes < len) {
+            ssize_t rv = pread(rawFd, buf + readBytes, len - readBytes, static_cast<off_t>(offset + readBytes));
+            if (rv <= 0)
+                throw std::runtime_error("Cannot read the original file");
+            readBytes += rv;
+        }
+        const u_int64_t readNs = elapsedNs(start);
+        Stats::add(Counter::DISK_BLOCKED_NS, readNs);
+        Stats::add(Counter::DISK_BYTES, len);
+        Stats::record(Hist::DISK_READ_US, readNs / 1000);
+    }
+
+    static const size_t READ_SIZE{256 * 1024};
+
+    int rawFd{-1};
+    const u_int64_t rawSize;
+    const int level;
+    bool storeOnly{false};
+    AvailabilityLog log;
+    ChunkCache cache;
+    /* Guards everything below. Blocks are `queued` from prepareLater() until
+       a worker has put them in the cache. */
+    std::mutex jobMutex;
+    std::condition_variable jobReady;
+    std::deque<u_int64_t> jobs;
+    std::unordered_set<u_int64_t> queued;
+    std::unordered_set<u_int64_t> failed;
+    std::vector<ReadyQueue *> readyQueues;
+    std::vector<std::thread> workers;
+    bool stopping{false};
+    std::thread hasher;
+    /* The HASHES reply, empty until the hasher is done. */
+    std::vector<u_int8_t> hashesMsg;
+    std::string hashesFailed;
+};
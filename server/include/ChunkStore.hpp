@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <vector>
+#include "BlockStore.hpp"
+#include "BufferPool.hpp"
+#include "ChunkCache.hpp"
+#include "ChunkSource.hpp"
+#include "DiskIo.hpp"
+#include "Log.hpp"
+#include "MsgMetadata.hpp"
+#include "Stats.hpp"
+#include "utils.hpp"
+
+/* Source of the compressed chunks served to clients.
+   READ  - pread() from the artifact for every request (default).
+   MMAP  - map the artifact once and send straight from the mapping; madvise
+           follows the request order of each client.
+   CACHE - keep recently requested chunks in a bounded LRU, so many clients
+           fetching the same file at once hit memory instead of the disk.
+   NOCACHE - as READ, and a chunk's pages are dropped from the page cache
+           once it was read to the end, for artifacts much larger than RAM.
+   DIRECT  - read each requested chunk whole with O_DIRECT into an aligned
+           buffer from a BufferPool, bypassing the page cache. Falls back to
+           NOCACHE where the file system does not support O_DIRECT.
+   A partial mirror can restrict which chunks it advertises and serves.
+   Delta sync requests are passed on to the BlockStore of the original file.
+   acquire() and bytes() may be called from several reactor threads at once. */
+class ChunkStore : public ChunkSource {
+public:
+    enum class Mode { READ, MMAP, CACHE, NOCACHE, DIRECT };
+
+    ChunkStore(const std::string &path, u_int64_t dataSize, Mode mode, size_t cacheBytes)
+            : dataSize(dataSize), mode(mode), cache(cacheBytes) {
+        bool direct = mode == Mode::DIRECT;
+        dataFd = DiskIo::open(path.c_str(), O_RDONLY, 0, direct);
+        if (dataFd == -1) {
+            LOG_ERROR("open: %s: %s", path.c_str(), strerror(errno));
+            throw std::runtime_error("Cannot open " + path);
+        }
+        if (mode == Mode::DIRECT && !direct)
+            this->mode = Mode::NOCACHE;
+
+        if (mode == Mode::MMAP && dataSize > 0) {
+            void *addr = mmap(nullptr, dataSize, PROT_READ, MAP_SHARED, dataFd, 0);
+            if (addr == MAP_FAILED) {
+                LOG_ERROR("mmap: %s", strerror(errno));
+                throw std::runtime_error("Cannot map " + path);
+            }
+            mapping = static_cast<const u_int8_t *>(addr);
+        }
+
+        ChunkBitmap all(getNumberOfChunks(dataSize, CHUNK_SIZE));
+        all.setAll();
+        log = AvailabilityLog::of(all);
+    }
+
+    ~ChunkStore() override {
+        if (mapping != nullptr)
+            munmap(const_cast<u_int8_t *>(mapping), dataSize);
+        close(dataFd);
+    }
+
+    ChunkStore(const ChunkStore &) = delete;
+    ChunkStore &operator=(const ChunkStore &) = delete;
+
+    const AvailabilityLog &availability() const override {
+        return log;
+    }
+
+    /* Only the chunks set in `held` are advertised and served. */
+    void restrictTo(const ChunkBitmap &held) {
+        log = AvailabilityLog::of(held);
+    }
+
+    ChunkRef acquire(u_int64_t chunkNo) override {
+        ChunkRef ref;
+        ref.chunkNo = chunkNo;
+        ref.size = getSizeOfChunk(dataSize, chunkNo, CHUNK_SIZE);
+        switch (mode) {
+            case Mode::READ:
+            case Mode::NOCACHE:
+                break;
+            case Mode::MMAP:
+                ref.data = mapping + chunkNo * CHUNK_SIZE;
+                break;
+            case Mode::CACHE: {
+                ChunkCache::Data cached = cachedChunk(chunkNo, ref.size);
+                ref.data = cached->data();
+                ref.owned = std::move(cached);
+                break;
+            }
+            case Mode::DIRECT:
+                readDirect(ref);
+                break;
+        }
+        return ref;
+    }
+
+    /* A client reading sequentially gets its next chunk prefetched. A chunk
+       read out of order has the kernel's readahead switched off for its own
+       range only, as it would pull in neighbours nobody asked for; the
+       advice follows every request, so other clients and later sequential
+       reads of the same range are unaffected. */
+    void willRead(u_int64_t chunkNo, u_int64_t previousChunk) override {
+        if (mode != Mode::MMAP)
+            return;
+        const bool sequential = chunkNo == previousChunk + 1;
+        u_int8_t *chunk = const_cast<u_int8_t *>(mapping) + chunkNo * CHUNK_SIZE;
+        const u_int64_t left = dataSize - chunkNo * CHUNK_SIZE;
+        madvise(chunk, std::min<u_int64_t>(CHUNK_SIZE, left), sequential ? MADV_NORMAL : MADV_RANDOM);
+        const u_int64_t adviseChunks = sequential ? 2 : 1;
+        madvise(chunk, std::min<u_int64_t>(adviseChunks * CHUNK_SIZE, left), MADV_WILLNEED);
+    }
+
+    /* Blocks of the original file, for delta sync. */
+    void setBlocks(BlockStore *blockStore) {
+        blocks = blockStore;
+    }
+
+    bool tryEncodeHashes(std::vector<u_int8_t> &out) override {
+        if (blocks == nullptr)
+            return ChunkSource::tryEncodeHashes(out);
+        return blocks->tryEncodeHashes(out);
+    }
+
+    bool tryAcquireRaw(u_int64_t rawChunkNo, ChunkRef &ref) override {
+        if (blocks == nullptr)
+            return ChunkSource::tryAcquireRaw(rawChunkNo, ref);
+        return blocks->tryAcquireRaw(rawChunkNo, ref);
+    }
+
+    void subscribe(ReadyQueue *queue) override {
+        if (blocks != nullptr)
+            blocks->subscribe(queue);
+    }
+
+    void unsubscribe(ReadyQueue *queue) override {
+        if (blocks != nullptr)
+            blocks->unsubscribe(queue);
+    }
+
+    const u_int8_t *bytes(const ChunkRef &ref, u_int64_t offset, size_t &len, u_int8_t *scratch) override {
+        if (offset + len > ref.size)
+            len = ref.size - offset;
+        if (ref.data != nullptr)
+            return ref.data + offset;
+
+        const u_int64_t start = ref.chunkNo * CHUNK_SIZE;
+        ssize_t rv = timedPread(scratch, len, start + offset);
+        if (rv <= 0)
+            throw std::runtime_error("Cannot read requested chunk");
+        len = static_cast<size_t>(rv);
+        if (mode == Mode::NOCACHE && offset + len == ref.size)
+            posix_fadvise(dataFd, static_cast<off_t>(start), static_cast<off_t>(ref.size), POSIX_FADV_DONTNEED);
+        return scratch;
+    }
+
+    static Mode parseMode(const std::string &name) {
+        if (name == "read")
+            return Mode::READ;
+        if (name == "mmap")
+            return Mode::MMAP;
+        if (name == "cache")
+            return Mode::CACHE;
+        if (name == "nocache")
+            return Mode::NOCACHE;
+        if (name == "direct")
+            return Mode::DIRECT;
+        throw std::runtime_error("Unknown io mode: " + name);
+    }
+
+private:
+    ssize_t timedPread(u_int8_t *buf, size_t len, u_int64_t offset) {
+        const auto start = steady_clock::now();
+        ssize_t rv = pread(dataFd, buf, len, static_cast<off_t>(offset));
+        const u_int64_t readNs = elapsedNs(start);
+        if (rv < 0) {
+            LOG_ERROR("pread: %s", strerror(errno));
+            return rv;
+        }
+        Stats::add(Counter::DISK_BLOCKED_NS, readNs);
+        Stats::add(Counter::DISK_BYTES, static_cast<u_int64_t>(rv));
+        Stats::record(Hist::DISK_READ_US, readNs / 1000);
+        return rv;
+    }
+
+    void readDirect(ChunkRef &ref) {
+        std::shared_ptr<u_int8_t> buffer = directPool.take();
+        /* Reads stay aligned: only the last one, at the end of the file,
+           comes back short. */
+        u_int8_t *data = buffer.get();
+        const size_t alignedSize = DiskIo::alignUp(ref.size);
+        u_int64_t readBytes{0};
+        while (readBytes < ref.size) {
+            ssize_t rv = timedPread(data + readBytes, alignedSize - readBytes,
+                                    ref.chunkNo * CHUNK_SIZE + readBytes);
+            if (rv <= 0)
+                throw std::runtime_error("Cannot read requested chunk");
+            readBytes += rv;
+        }
+        ref.data = data;
+        ref.owned = std::move(buffer);
+    }
+
+    ChunkCache::Data cachedChunk(u_int64_t chunkNo, u_int64_t size) {
+        ChunkCache::Data cached = cache.get(chunkNo);
+        if (cached)
+            return cached;
+
+        auto data = std::make_shared<std::vector<u_int8_t>>(size);
+        u_int64_t readBytes{0};
+        while (readBytes < size) {
+            ssize_t rv = timedPread(data->data() + readBytes, size - readBytes, chunkNo * CHUNK_SIZE + readBytes);
+            if (rv <= 0)
+                throw std::runtime_error("Cannot read requested chunk");
+            readBytes += rv;
+        }
+        cache.put(chunkNo, data);
+        return data;
+    }
+
+    const u_int64_t dataSize;
+    Mode mode;
+    int dataFd{-1};
+    AvailabilityLog log;
+
+    BlockStore *blocks{nullptr};
+
+    const u_int8_t *mapping{nullptr};
+
+    ChunkCache cache;
+
+    /* Idle 4 MiB buffers DIRECT keeps for the next chunks. */
+    static const size_t MAX_IDLE_DIRECT_BUFFERS{8};
+    /* Buffers of chunks being sent with DIRECT. */
+    BufferPool directPool{CHUNK_SIZE, MAX_IDLE_DIRECT_BUFFERS};
+};
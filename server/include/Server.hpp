@@ -1,174 +1,319 @@
+#include <atomic>
+#include <csignal>
 #include <iostream>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <fcntl.h>
-#include <netdb.h>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <thread>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "BlockStore.hpp"
+#include "ChunkServer.hpp"
+#include "ChunkStore.hpp"
 #include "Gzip.hpp"
+#include "Log.hpp"
 #include "MsgMetadata.hpp"
+#include "RateLimiter.hpp"
+#include "Stats.hpp"
+#include "TreePacker.hpp"
 #include "utils.hpp"
 
 class Server {
 public:
     Server(int argc, char **argv) {
-        std::cout << "Loading settings" << std::endl;
+        LOG_INFO("Loading settings");
         load_settings(argc, argv);
         validate_settings();
-        std::cout << "Preparing data" << std::endl;
+        LOG_INFO("Preparing data");
         prepare_data();
         initSocket();
         handleConnections();
     }
 
     ~Server() {
-        close(dataFd);
-        close(serverSock);
+        shutdown();
     }
 
 private:
+    /* Stops the threads the server owns, the stats reporter and the block
+       workers, so that none of them runs into the static destructors. */
+    void shutdown() {
+        for (Reactor &reactor : reactors) {
+            reactor.chunkServer.reset();
+            if (reactor.epFd != -1)
+                close(reactor.epFd);
+            reactor.epFd = -1;
+        }
+        if (stopFd != -1)
+            close(stopFd);
+        stopFd = -1;
+        chunkStore.reset();
+        blockStore.reset();
+        statsReporter.reset();
+    }
+
+    /* exit() skips ~Server(). Only on the main thread, with no reactor
+       running. */
+    [[noreturn]] void fail() {
+        shutdown();
+        exit(EXIT_FAILURE);
+    }
+
     void prepare_data() {
-        const std::string data_path = get_data_path();
-        if (doesFileExists(data_path)) {
-            std::cout << "Compressed data (" << data_path << ") already exists."
-                      << std::endl;
+        servedName = base_name(filepath);
+        if (isDirectory(filepath))
+            packTree();
+        const u_int64_t rawSize = static_cast<u_int64_t>(getFileSize(filepath));
+        try {
+            blockStore = std::make_unique<BlockStore>(filepath, rawSize, cacheBytes, COMPRESSION_LEVEL);
+            blockStore->prepareHashes();
+        } catch (const std::runtime_error &e) {
+            LOG_ERROR("%s", e.what());
+            fail();
+        }
+        const bool stored = shouldStore();
+        if (onDemand) {
+            dataSize = rawSize;
+            chunks = blockStore->getBlocks();
+            metadataFlags |= MsgMetadata::BLOCKS;
+            blockStore->setStoreOnly(stored);
+            if (stored)
+                LOG_INFO("Serving %lu blocks uncompressed", chunks);
+            else
+                LOG_INFO("Compressing on demand: %lu blocks, zlib %s", chunks, zlibVersion());
+            if (!chunkRanges.empty()) {
+                blockStore->restrictTo(ChunkBitmap::fromRanges(chunkRanges, chunks));
+                LOG_INFO("Serving %lu of %lu blocks (%s)", blockStore->availability().version(), chunks,
+                         chunkRanges.c_str());
+            }
+            chunkSource = blockStore.get();
+            return;
+        }
+
+        std::string data_path = get_data_path();
+        if (stored) {
+            /* The file itself is the artifact. */
+            data_path = filepath;
+            metadataFlags |= MsgMetadata::STORED;
+            LOG_INFO("Serving %s uncompressed", filepath.c_str());
+        } else if (doesFileExists(data_path)) {
+            LOG_INFO("Compressed data (%s) already exists.", data_path.c_str());
         } else {
-            std::cout << "Compressing data (" << data_path << ")." << std::endl;
+            LOG_INFO("Compressing data (%s) with zlib %s.", data_path.c_str(), zlibVersion());
             try {
+                PhaseTimer phase("compress");
                 Gzip::compress(filepath, COMPRESSION_LEVEL, data_path);
             } catch (const std::runtime_error &e) {
-                std::cout << e.what() << std::endl;
-                exit(EXIT_FAILURE);
+                LOG_ERROR("%s", e.what());
+                fail();
             }
         }
         dataSize = getFileSize(data_path);
         chunks = getNumberOfChunks(dataSize, CHUNK_SIZE);
-        std::cout << "Compressed data has " << dataSize << " bytes (" << chunks
-                  << " chunks)" << std::endl;
-        dataFd = open(data_path.c_str(), O_RDONLY, 0);
+        LOG_INFO("Served data has %lu bytes (%lu chunks)", dataSize, chunks);
+        try {
+            chunkStore = std::make_unique<ChunkStore>(data_path, dataSize, ioMode, cacheBytes);
+            chunkStore->setBlocks(blockStore.get());
+            if (!chunkRanges.empty()) {
+                chunkStore->restrictTo(ChunkBitmap::fromRanges(chunkRanges, chunks));
+                LOG_INFO("Serving %lu of %lu chunks (%s)", chunkStore->availability().version(), chunks,
+                         chunkRanges.c_str());
+            }
+            chunkSource = chunkStore.get();
+        } catch (const std::runtime_error &e) {
+            LOG_ERROR("%s", e.what());
+            fail();
+        }
     }
 
-    void initSocket() {
-        addrinfo hints{}, *serverInfo;
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
-        hints.ai_flags = AI_PASSIVE;
-        int rv;
-        if ((rv = getaddrinfo(nullptr, port.c_str(), &hints, &serverInfo)) != 0) {
-            fprintf(stderr, "getaddinfo: %s\n", gai_strerror(rv));
-            exit(1);
-        }
-
-        addrinfo *rp;
-        for (rp = serverInfo; rp != nullptr; rp = rp->ai_next) {
-            if ((serverSock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1) {
-                perror("socket");
-                continue;
+    /* A directory is served as its pack file plus a manifest; from here on
+       `filepath` is the pack. A rewritten pack makes an old compressed
+       artifact of it stale. */
+    void packTree() {
+        try {
+            PhaseTimer phase("pack");
+            TreePacker packer(filepath);
+            LOG_INFO("Tree %s: %lu entries, %lu files, %lu bytes", filepath.c_str(), packer.getEntries().size(),
+                     packer.getFiles(), packer.getTotalSize());
+            filepath = packer.getPackPath();
+            if (packer.writePack()) {
+                LOG_INFO("Packed the tree into %s", filepath.c_str());
+                unlink(get_data_path().c_str());
+            } else {
+                LOG_INFO("Pack (%s) is up to date.", filepath.c_str());
             }
+            manifest = packer.getEntries();
+        } catch (const std::runtime_error &e) {
+            LOG_ERROR("%s", e.what());
+            fail();
+        }
+        metadataFlags |= MsgMetadata::TREE;
+    }
 
-            int enable = 1;
-            if (setsockopt(serverSock, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT,
-                           &enable, sizeof(enable)) == -1) {
-                perror("setsockopt");
-                exit(EXIT_FAILURE);
-            }
+    /* Whether to skip compression: --compression=never, or auto and a sample
+       of the input hardly compresses (media, archives). */
+    bool shouldStore() {
+        if (compression != Compression::AUTO)
+            return compression == Compression::NEVER;
+        const auto start = steady_clock::now();
+        double ratio;
+        try {
+            ratio = Gzip::sampleRatio(filepath);
+        } catch (const std::runtime_error &e) {
+            LOG_ERROR("%s", e.what());
+            fail();
+        }
+        const bool store = ratio > STORE_RATIO;
+        LOG_INFO("Sampled compression ratio %.3f in %lu ms: %s", ratio, elapsedUs(start) / 1000,
+                 store ? "not worth compressing" : "compressing");
+        return store;
+    }
 
-            if (bind(serverSock, rp->ai_addr, rp->ai_addrlen) == 0)
-                break;
-            perror("bind");
+    /* One reactor per --threads: its own epoll set and SO_REUSEPORT
+       listening socket, so the kernel spreads incoming connections across
+       them. They share the chunk source and the global rate limit. */
+    void initSocket() {
+        auto bucket = std::make_shared<SharedTokenBucket>();
+        stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (stopFd == -1) {
+            LOG_ERROR("eventfd: %s", strerror(errno));
+            fail();
         }
+        reactors.resize(threads);
+        for (Reactor &reactor : reactors) {
+            reactor.epFd = epoll_create1(0);
+            epoll_event stopEvent{};
+            stopEvent.events = EPOLLIN;
+            stopEvent.data.fd = stopFd;
+            if (reactor.epFd == -1 || epoll_ctl(reactor.epFd, EPOLL_CTL_ADD, stopFd, &stopEvent) == -1) {
+                LOG_ERROR("epoll: %s", strerror(errno));
+                fail();
+            }
 
-        if (rp == nullptr) {
-            fprintf(stderr, "Could not bind\n");
-            exit(EXIT_FAILURE);
+            reactor.chunkServer = std::make_unique<ChunkServer>(reactor.epFd, *chunkSource);
+            if (metadataFlags & MsgMetadata::TREE)
+                reactor.chunkServer->setManifest(manifest);
+            reactor.chunkServer->setMetadata(servedName, dataSize, metadataFlags);
+            reactor.chunkServer->shareGlobalBucket(bucket);
+            reactor.chunkServer->setLimits(limits);
+            reactor.chunkServer->setSocketOptions(socketOptions);
+            try {
+                reactor.chunkServer->listenOn(port);
+            } catch (const std::exception &e) {
+                LOG_ERROR("%s", e.what());
+                fail();
+            }
         }
-        freeaddrinfo(serverInfo);
     }
 
+    /* Reactor 0 runs on the main thread and is the only one to see SIGHUP;
+       the others pick new limits up through limitsVersion. Reactors only
+       return once one of them failed, and the process exits after all of
+       them are joined: exit() on a reactor thread would run the static
+       destructors under the others. */
     void handleConnections() {
-        if (listen(serverSock, 5) < 0) {
-            perror("listen");
-            exit(EXIT_FAILURE);
-        }
-        std::cout << "Waiting for connections." << std::endl;
+        installReloadHandler();
+        sigset_t hangup, previous;
+        sigemptyset(&hangup);
+        sigaddset(&hangup, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &hangup, &previous);
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < reactors.size(); ++i)
+            workers.emplace_back(&Server::runReactor, this, std::ref(reactors[i]));
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+
+        LOG_INFO("Waiting for connections (%zu reactor threads).", reactors.size());
+        runReactor(reactors[0]);
+        for (std::thread &worker : workers)
+            worker.join();
+        fail();
+    }
 
-        int clientSock;
-        sockaddr clientAddr{};
-        socklen_t addrlen = sizeof(clientAddr);
+    struct Reactor {
+        int epFd{-1};
+        std::unique_ptr<ChunkServer> chunkServer;
+        unsigned limitsSeen{0};
+    };
 
+    /* A reactor that fails wakes the others through stopFd, which stays
+       readable, so they return too. */
+    void runReactor(Reactor &reactor) {
+        try {
+            serve(reactor);
+        } catch (const std::exception &e) {
+            LOG_ERROR("Reactor failed: %s", e.what());
+        }
+        const u_int64_t one{1};
+        if (write(stopFd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            LOG_ERROR("eventfd write: %s", strerror(errno));
+    }
+
+    void serve(Reactor &reactor) {
+        const bool main = &reactor == &reactors[0];
+        epoll_event events[MAX_EVENTS];
         while (true) {
-            if ((clientSock = accept(serverSock, &clientAddr, &addrlen)) < 0) {
-                perror("accept");
-                exit(EXIT_FAILURE);
+            if (main && reloadRequested) {
+                reloadRequested = 0;
+                reloadLimits();
             }
-
-            const std::string clientIpStr = ipToStr(&clientAddr);
-            try {
-                handleClient(clientSock, clientAddr);
-            } catch (const ClientDisconnected&) {
-                std::cout << "(" << clientIpStr << ") - Client disconnected" << std::endl;
-            } catch (const std::exception& e) {
-                std::cerr << "(" << clientIpStr << ") - " << e.what() << std::endl;
+            if (reactor.limitsSeen != limitsVersion.load(std::memory_order_acquire)) {
+                std::lock_guard<std::mutex> lock(limitsMutex);
+                reactor.limitsSeen = limitsVersion.load(std::memory_order_relaxed);
+                reactor.chunkServer->setLimits(limits);
             }
 
-            try {
-                tryClose(clientSock, "Cannot close client socket");
-            } catch (const std::exception& e){
-                std::cerr << "(" << clientIpStr << ") - " << e.what() << std::endl;
+            /* Others are not woken by SIGHUP, so they poll for new limits. */
+            int timeoutMs = reactor.chunkServer->nextTimeoutMs();
+            if (!main && (timeoutMs == -1 || timeoutMs > LIMITS_POLL_MS))
+                timeoutMs = LIMITS_POLL_MS;
+            int readyCount = epoll_wait(reactor.epFd, events, MAX_EVENTS, timeoutMs);
+            if (readyCount == -1) {
+                if (errno == EINTR)
+                    continue;
+                LOG_ERROR("epoll_wait: %s", strerror(errno));
+                return;
             }
-        }
-    }
 
-    void handleClient(int clientSock, const sockaddr& clientAddr) {
-        std::cout << "Client connected: " << ipToStr(&clientAddr) << std::endl;
-        sendMetadata(clientSock);
-
-        while (true) {
-            u_int64_t requestedChunk = receiveChunkReq(clientSock);
-
-            lseek(dataFd, CHUNK_SIZE * requestedChunk, SEEK_SET);
-            uint8_t buf[BUF_SIZE];
-
-            u_int64_t readBytes{0};
-            while (readBytes < getSizeOfChunk(dataSize, requestedChunk, CHUNK_SIZE)) {
-                ssize_t rv = read(dataFd, buf, BUF_SIZE);
-                if (rv < 0) {
-                    perror("read");
-                    throw std::runtime_error("Cannot read requested chunk");
-                } else if (rv == 0) {
-                    break;
-                }
-
-                readBytes += rv;
-                try {
-                    tryWriteAll(clientSock, buf, static_cast<size_t>(rv));
-                } catch (const std::exception& e) {
-                    throw std::runtime_error("Cannot send requested chunk");
-                }
+            for (int i = 0; i < readyCount; ++i) {
+                if (events[i].data.fd == stopFd)
+                    return;
+                reactor.chunkServer->handleEvent(events[i].data.fd, events[i].events);
             }
+            reactor.chunkServer->serveActive();
         }
     }
 
-    void sendMetadata(int clientSock) {
-        MsgMetadata msg(base_name(filepath), static_cast<u_int64_t>(dataSize));
-        tryWriteAll(clientSock, msg.generateMsg(), MsgMetadata::MSG_SIZE);
+    void installReloadHandler() {
+        struct sigaction action{};
+        action.sa_handler = [](int) { reloadRequested = 1; };
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGHUP, &action, nullptr);
     }
 
-    u_int64_t receiveChunkReq(int clientSock) {
-        u_int64_t requestedChunk;
-        ssize_t r = read(clientSock, &requestedChunk, sizeof(requestedChunk));
-        if (r == -1) {
-            perror("read");
-            throw std::runtime_error("Cannot receive chunk req");
-        } else if (r == 0) {
-            throw ClientDisconnected();
+    /* SIGHUP re-reads --limits-file. */
+    void reloadLimits() {
+        if (limitsFile.empty()) {
+            LOG_WARN("SIGHUP received but no --limits-file was given");
+            return;
         }
+        {
+            std::lock_guard<std::mutex> lock(limitsMutex);
+            try {
+                limits.load(limitsFile);
+            } catch (const std::exception &e) {
+                LOG_ERROR("%s", e.what());
+                return;
+            }
+        }
+        applyLimits();
+    }
 
-        if (requestedChunk > chunks)
-            throw std::runtime_error("Invalid chunk requested. Dropping connection");
-
-        std::cout << "Chunk " << requestedChunk << " requested"<< std::endl;
-        return requestedChunk;
+    /* Every reactor applies the current limits on its next iteration. */
+    void applyLimits() {
+        limitsVersion.fetch_add(1, std::memory_order_release);
+        LOG_INFO("Rate limits: global %lu B/s, per client %lu B/s (0 = unlimited)",
+                 limits.globalRate, limits.clientRate);
     }
 
     std::string get_data_path() const {
@@ -181,33 +326,162 @@ private:
             exit(EXIT_FAILURE);
         }
 
-        filepath = argv[1];
-        if (argc == 3)
-            port = argv[2];
+        std::vector<std::string> positional;
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg(argv[i]);
+            if (arg.compare(0, 2, "--") == 0)
+                apply_option(arg, argv[0]);
+            else
+                positional.push_back(arg);
+        }
+        if (positional.empty() || positional.size() > 2) {
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+
+        filepath = positional[0];
+        while (filepath.size() > 1 && filepath.back() == '/')
+            filepath.pop_back();
+        if (positional.size() == 2)
+            port = positional[1];
+        if (onDemand && ioMode != ChunkStore::Mode::READ) {
+            std::cerr << "--io does not apply to --on-demand, which reads blocks into its own cache" << std::endl;
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        if (!limitsFile.empty())
+            limits.load(limitsFile);
+        applyLimits();
+        statsReporter = std::make_unique<StatsReporter>(statsInterval);
+    }
+
+    /* Unknown options and malformed values print the usage and exit. */
+    void apply_option(const std::string& arg, const char *name) {
+        try {
+            if (parse_option(arg))
+                return;
+            std::cerr << "Unknown option: " << arg << std::endl;
+        } catch (const std::exception &e) {
+            std::cerr << "Invalid option " << arg << ": " << e.what() << std::endl;
+        }
+        print_usage(name);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Returns false for an unknown option, throws for a malformed value. */
+    bool parse_option(const std::string& arg) {
+        std::string value;
+        if (matchOption(arg, "stats-interval", value)) {
+            statsInterval = static_cast<unsigned>(std::stoul(value));
+        } else if (matchOption(arg, "log-level", value)) {
+            Log::setLevel(value);
+        } else if (matchOption(arg, "io", value)) {
+            ioMode = ChunkStore::parseMode(value);
+        } else if (matchOption(arg, "cache-mb", value)) {
+            cacheBytes = std::stoul(value) * 1024 * 1024;
+        } else if (matchOption(arg, "rate", value)) {
+            limits.globalRate = RateLimits::parseRate(value);
+        } else if (matchOption(arg, "client-rate", value)) {
+            limits.clientRate = RateLimits::parseRate(value);
+        } else if (matchOption(arg, "limits-file", value)) {
+            limitsFile = value;
+        } else if (matchOption(arg, "chunks", value)) {
+            chunkRanges = value;
+        } else if (arg == "--on-demand") {
+            onDemand = true;
+        } else if (matchOption(arg, "threads", value)) {
+            threads = std::max<unsigned long>(1, std::stoul(value));
+        } else if (matchOption(arg, "compression", value)) {
+            compression = parseCompression(value);
+        } else if (!socketOptions.parse(arg)) {
+            return false;
+        }
+        return true;
+    }
+
+    enum class Compression { AUTO, ALWAYS, NEVER };
+
+    static Compression parseCompression(const std::string &name) {
+        if (name == "auto")
+            return Compression::AUTO;
+        if (name == "always")
+            return Compression::ALWAYS;
+        if (name == "never")
+            return Compression::NEVER;
+        throw std::runtime_error("Unknown compression mode: " + name);
     }
 
     void validate_settings() {
+        if (isDirectory(filepath)) {
+            LOG_INFO("Provided path is a directory, serving the whole tree");
+            return;
+        }
         off_t fileSize = getFileSize(filepath);
-        std::cout << "Provided file has " << fileSize << " bytes" << std::endl;
+        LOG_INFO("Provided file has %ld bytes", fileSize);
     }
 
     void print_usage(const char *name) {
-        std::cout << "Usage: " << name << " <filepath> <port>" << std::endl;
+        std::cout << "Usage: " << name << " [options] <filepath> <port>" << std::endl
+                  << "<filepath> may be a directory: the tree is packed into <filepath>.pack and sent whole." << std::endl
+                  << "Options:" << std::endl
+                  << "  --stats-interval=<sec>  print a stats line every <sec> seconds, 0 disables (default 5)" << std::endl
+                  << "  --log-level=<level>     debug, info, warn or error (default info)" << std::endl
+                  << "  --io=<mode>             read, mmap, cache, nocache or direct: how chunks are read; nocache" << std::endl
+                  << "                          drops served chunks from the page cache, direct uses O_DIRECT (default read);" << std::endl
+                  << "                          not with --on-demand" << std::endl
+                  << "  --cache-mb=<size>       memory bound of the chunk cache for --io=cache and --on-demand (default 256)" << std::endl
+                  << "  --rate=<bytes/s>        total send rate limit, K/M/G suffixes allowed (default unlimited)" << std::endl
+                  << "  --client-rate=<bytes/s> send rate limit of each client (default unlimited)" << std::endl
+                  << "  --limits-file=<path>    'rate=' and 'client-rate=' lines, re-read on SIGHUP" << std::endl
+                  << "  --chunks=<ranges>       partial mirror: only serve these chunks, e.g. 0-99,150- (default all)" << std::endl
+                  << "  --on-demand             skip the upfront compression: compress each block when first requested" << std::endl
+                  << "  --threads=<n>           reactor threads, each accepting on its own SO_REUSEPORT socket (default 1)" << std::endl
+                  << "  --compression=<mode>    auto, always or never; auto samples the file and sends it" << std::endl
+                  << "                          uncompressed if it hardly compresses (default auto)" << std::endl
+                  << SocketOptions::USAGE
+                  << "Send SIGUSR1 for a JSON stats dump, SIGUSR2 for Prometheus text." << std::endl;
     }
 
     std::string base_name(const std::string &path) {
         return path.substr(path.find_last_of('/') + 1);
     }
 
-    struct ClientDisconnected : std::exception {};
+    static volatile sig_atomic_t reloadRequested;
 
     const int COMPRESSION_LEVEL{6};
-    const size_t BUF_SIZE{8192};
+    /* Compressed/raw size above which compressing is not worth it. */
+    static constexpr double STORE_RATIO{0.95};
+    static const int MAX_EVENTS{64};
+    static const int LIMITS_POLL_MS{1000};
 
     std::string filepath;
+    /* Name sent to clients: the file or directory given. */
+    std::string servedName;
+    std::vector<MsgManifest::Entry> manifest;
     std::string port = "8000";
+    unsigned statsInterval{5};
+    std::unique_ptr<StatsReporter> statsReporter;
     u_int64_t chunks;
     u_int64_t dataSize;
-    int serverSock;
-    int dataFd;
+    RateLimits limits;
+    /* Guards limits once the reactors run. */
+    std::mutex limitsMutex;
+    std::atomic<unsigned> limitsVersion{0};
+    std::string limitsFile;
+    std::string chunkRanges;
+    ChunkStore::Mode ioMode{ChunkStore::Mode::READ};
+    size_t cacheBytes{256 * 1024 * 1024};
+    size_t threads{1};
+    bool onDemand{false};
+    Compression compression{Compression::AUTO};
+    u_int64_t metadataFlags{0};
+    SocketOptions socketOptions;
+    std::unique_ptr<BlockStore> blockStore;
+    std::unique_ptr<ChunkStore> chunkStore;
+    ChunkSource *chunkSource{nullptr};
+    std::vector<Reactor> reactors;
+    /* Readable once a reactor failed. */
+    int stopFd{-1};
 };
+
+volatile sig_atomic_t Server::reloadRequested{0};
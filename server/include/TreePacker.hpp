@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+#include "Log.hpp"
+#include "MsgManifest.hpp"
+#include "utils.hpp"
+
+/* Serves a directory tree as one file: the contents of its regular files
+   concatenated in path order (<dir>.pack next to the directory), described
+   by a manifest. Small files end up sharing chunks, large ones still span
+   many, so both are fetched in parallel like any other file. The path,
+   size, mtime and ctime of every entry packed are kept in <dir>.pack.manifest;
+   the pack is rebuilt unless that list matches the tree exactly. Symlinks
+   and special files are skipped. */
+class TreePacker {
+public:
+    TreePacker(const std::string &root) : root(root) {
+        struct stat st{};
+        if (stat(root.c_str(), &st) != 0)
+            throw std::runtime_error("Cannot stat " + root);
+        walk("");
+    }
+
+    const std::vector<MsgManifest::Entry> &getEntries() const {
+        return entries;
+    }
+
+    u_int64_t getTotalSize() const {
+        return totalSize;
+    }
+
+    u_int64_t getFiles() const {
+        return files;
+    }
+
+    std::string getPackPath() const {
+        return root + ".pack";
+    }
+
+    std::string getManifestPath() const {
+        return getPackPath() + ".manifest";
+    }
+
+    /* Brings the pack up to date. Returns true if it had to be rewritten. */
+    bool writePack() const {
+        const std::string packPath = getPackPath();
+        const std::string manifestPath = getManifestPath();
+        struct stat st{};
+        if (stat(packPath.c_str(), &st) == 0 && static_cast<u_int64_t>(st.st_size) == totalSize &&
+            readFile(manifestPath) == listing)
+            return false;
+
+        /* Written aside and renamed, so a partial pack never looks current;
+           servers starting on the same tree at once each write their own.
+           The manifest goes last: until it is renamed the old one does not
+           match the tree and the next start packs again. */
+        const std::string tmpPath = packPath + ".tmp" + std::to_string(getpid());
+        int packFd = createFile(tmpPath);
+        std::vector<u_int8_t> buf(BUF_SIZE);
+        for (const MsgManifest::Entry &entry : entries)
+            if (!entry.isDirectory())
+                append(packFd, entry, buf);
+        tryClose(packFd, "Cannot close " + tmpPath);
+        replaceFile(tmpPath, packPath);
+
+        const std::string tmpManifestPath = manifestPath + ".tmp" + std::to_string(getpid());
+        int manifestFd = createFile(tmpManifestPath);
+        tryWriteAll(manifestFd, listing.data(), listing.size());
+        tryClose(manifestFd, "Cannot close " + tmpManifestPath);
+        replaceFile(tmpManifestPath, manifestPath);
+        return true;
+    }
+
+private:
+    /* Directories come before their contents, entries sorted by name. */
+    void walk(const std::string &relative) {
+        const std::string dirPath = relative.empty() ? root : root + "/" + relative;
+        DIR *dir = opendir(dirPath.c_str());
+        if (dir == nullptr) {
+            LOG_ERROR("opendir: %s: %s", dirPath.c_str(), strerror(errno));
+            throw std::runtime_error("Cannot read " + dirPath);
+        }
+        std::vector<std::string> names;
+        while (dirent *item = readdir(dir)) {
+            if (strcmp(item->d_name, ".") != 0 && strcmp(item->d_name, "..") != 0)
+                names.emplace_back(item->d_name);
+        }
+        closedir(dir);
+        std::sort(names.begin(), names.end());
+
+        for (const std::string &name : names) {
+            const std::string path = relative.empty() ? name : relative + "/" + name;
+            struct stat st{};
+            if (lstat((root + "/" + path).c_str(), &st) != 0) {
+                LOG_WARN("Skipping %s: %s", path.c_str(), strerror(errno));
+                continue;
+            }
+            if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+                LOG_WARN("Skipping %s: not a regular file or directory", path.c_str());
+                continue;
+            }
+            list(path, st);
+
+            MsgManifest::Entry entry;
+            entry.path = path;
+            entry.mode = st.st_mode;
+            if (S_ISDIR(st.st_mode)) {
+                entries.push_back(std::move(entry));
+                walk(path);
+            } else {
+                entry.size = static_cast<u_int64_t>(st.st_size);
+                totalSize += entry.size;
+                ++files;
+                entries.push_back(std::move(entry));
+            }
+
+        }
+    }
+
+    /* One line per entry, the path last and length-prefixed so any name
+       reads back unambiguously. The ctime catches edits that kept the size
+       and put the old mtime back. */
+    void list(const std::string &path, const struct stat &st) {
+        const u_int64_t size = S_ISDIR(st.st_mode) ? 0 : static_cast<u_int64_t>(st.st_size);
+        listing += std::to_string(st.st_mode) + " " + std::to_string(size) + " " +
+                   std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec) + " " +
+                   std::to_string(st.st_ctim.tv_sec) + "." + std::to_string(st.st_ctim.tv_nsec) + " " +
+                   std::to_string(path.size()) + " " + path + "\n";
+    }
+
+    /* Copies exactly the size listed in the manifest. */
+    void append(int packFd, const MsgManifest::Entry &entry, std::vector<u_int8_t> &buf) const {
+        const std::string path = root + "/" + entry.path;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            LOG_ERROR("open: %s: %s", path.c_str(), strerror(errno));
+            throw std::runtime_error("Cannot open " + path);
+        }
+        u_int64_t copied{0};
+        while (copied < entry.size) {
+            const u_int64_t wanted = std::min<u_int64_t>(buf.size(), entry.size - copied);
+            ssize_t rv = read(fd, buf.data(), wanted);
+            if (rv <= 0) {
+                close(fd);
+                throw std::runtime_error(path + " changed while packing");
+            }
+            tryWriteAll(packFd, buf.data(), static_cast<size_t>(rv));
+            copied += rv;
+        }
+        tryClose(fd, "Cannot close " + path);
+    }
+
+    static int createFile(const std::string &path) {
+        int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd == -1) {
+            LOG_ERROR("open: %s: %s", path.c_str(), strerror(errno));
+            throw std::runtime_error("Cannot create " + path);
+        }
+        return fd;
+    }
+
+    static void replaceFile(const std::string &tmpPath, const std::string &path) {
+        if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+            LOG_ERROR("rename: %s: %s", tmpPath.c_str(), strerror(errno));
+            throw std::runtime_error("Cannot create " + path);
+        }
+    }
+
+    /* Empty if the file cannot be read. */
+    static std::string readFile(const std::string &path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    static const size_t BUF_SIZE{1024 * 1024};
+
+    const std::string root;
+    std::vector<MsgManifest::Entry> entries;
+    u_int64_t totalSize{0};
+    u_int64_t files{0};
+    /* What <dir>.pack.manifest holds for the tree as it is now. */
+    std::string listing;
+};
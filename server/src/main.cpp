@@ -1,5 +1,10 @@
 #include "Server.hpp"
 
 int main(int argc, char **argv) {
-    Server server(argc, argv);
+    try {
+        Server server(argc, argv);
+    } catch (const std::exception &e) {
+        LOG_ERROR("%s", e.what());
+    }
+    return EXIT_FAILURE;
 }
@@ -0,0 +1,175 @@
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <sys/wait.h>
+#include <thread>
+#include "NetProxy.hpp"
+
+/* bench_netproxy's fault scripts: the parser, and byte triggers firing at
+   exactly their byte through a real proxy process. */
+
+static int failures{0};
+
+#define CHECK(cond)                                                                   \
+    do {                                                                              \
+        if (!(cond)) {                                                                \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);  \
+            ++failures;                                                               \
+        }                                                                             \
+    } while (0)
+
+static const char *SCRIPT_PATH{"netproxy_test.faults"};
+static const u_int16_t UPSTREAM_PORT{19711};
+static const char *PROXY_PORT{"19712"};
+static const size_t UPSTREAM_BYTES{3 * 1024 * 1024};
+
+static std::vector<NetProxy::Fault> load(const std::string &script) {
+    std::ofstream(SCRIPT_PATH) << script;
+    return NetProxy::loadScript(SCRIPT_PATH);
+}
+
+/* The error loading `script` gives, without the path. */
+static std::string loadError(const std::string &script) {
+    try {
+        load(script);
+    } catch (const std::exception &e) {
+        const std::string message(e.what());
+        return message.compare(0, strlen(SCRIPT_PATH), SCRIPT_PATH) == 0 ? message.substr(strlen(SCRIPT_PATH))
+                                                                          : message;
+    }
+    return "no error";
+}
+
+static void testParser() {
+    using Fault = NetProxy::Fault;
+    const std::vector<Fault> faults = load("# comment\n"
+                                           "\n"
+                                           "* 0ms rate 8M\n"
+                                           "2 500ms delay 50  # trailing comment\n"
+                                           "0 6M disconnect\n"
+                                           "1 1000 freeze\n"
+                                           "1 1500ms thaw\n");
+    CHECK(faults.size() == 5);
+    if (faults.size() != 5)
+        return;
+    CHECK(faults[0].connection == Fault::ALL && !faults[0].byBytes && faults[0].at == 0);
+    CHECK(faults[0].action == Fault::RATE && faults[0].value == 8 * 1024 * 1024);
+    CHECK(faults[1].connection == 2 && !faults[1].byBytes && faults[1].at == 500);
+    CHECK(faults[1].action == Fault::DELAY && faults[1].value == 50);
+    CHECK(faults[2].connection == 0 && faults[2].byBytes && faults[2].at == 6 * 1024 * 1024);
+    CHECK(faults[2].action == Fault::DISCONNECT);
+    CHECK(faults[3].connection == 1 && faults[3].byBytes && faults[3].at == 1000);
+    CHECK(faults[3].action == Fault::FREEZE);
+    CHECK(faults[4].action == Fault::THAW && faults[4].at == 1500);
+
+    CHECK(loadError("x 0ms freeze\n") == ":1: invalid connection 'x'");
+    CHECK(loadError("-1 0ms freeze\n") == ":1: invalid connection '-1'");
+    CHECK(loadError("\n\n0 soon freeze\n") == ":3: invalid byte count 'soon'");
+    CHECK(loadError("0 12xms freeze\n") == ":1: invalid time '12x'");
+    CHECK(loadError("0 0ms delay fast\n") == ":1: invalid delay 'fast'");
+    CHECK(loadError("0 0ms rate 5Q\n") == ":1: invalid rate '5Q'");
+    CHECK(loadError("0 0ms delay\n") == ":1: delay needs a value");
+    CHECK(loadError("0 0ms\n") == ":1: missing fields");
+    CHECK(loadError("0 0ms explode\n") == ":1: unknown action explode");
+}
+
+static int listenUpstream() {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int enable = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(UPSTREAM_PORT);
+    if (bind(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1 || listen(sock, 8) == -1)
+        throw std::runtime_error("Cannot listen upstream");
+    return sock;
+}
+
+/* Sends UPSTREAM_BYTES to each of `connections` clients. */
+static void serveUpstream(int listenSock, int connections) {
+    std::vector<u_int8_t> data(UPSTREAM_BYTES, 'x');
+    for (int i = 0; i < connections; ++i) {
+        int sock = accept(listenSock, nullptr, nullptr);
+        if (sock == -1)
+            return;
+        size_t sent{0};
+        while (sent < data.size()) {
+            ssize_t rv = send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (rv <= 0)
+                break;
+            sent += static_cast<size_t>(rv);
+        }
+        close(sock);
+    }
+}
+
+/* Bytes received through the proxy until it closes the connection. */
+static size_t download() {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<u_int16_t>(std::stoul(PROXY_PORT)));
+    int sock{-1};
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0)
+            break;
+        close(sock);
+        sock = -1;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    if (sock == -1)
+        throw std::runtime_error("Cannot connect to the proxy");
+    size_t received{0};
+    u_int8_t buf[64 * 1024];
+    ssize_t rv;
+    while ((rv = recv(sock, buf, sizeof(buf), 0)) > 0)
+        received += static_cast<size_t>(rv);
+    close(sock);
+    return received;
+}
+
+static void testByteTriggers() {
+    NetProxy::Options options;
+    options.listenPort = PROXY_PORT;
+    options.upstreamHost = "127.0.0.1";
+    options.upstreamPort = std::to_string(UPSTREAM_PORT);
+    options.faults = load("0 1M disconnect\n"
+                          "1 1000 disconnect\n"
+                          "* 0ms rate 64M\n");
+
+    const int listenSock = listenUpstream();
+    const pid_t proxy = fork();
+    if (proxy == 0) {
+        close(listenSock);
+        try {
+            NetProxy(options).run();
+        } catch (const std::exception &e) {
+            fprintf(stderr, "proxy: %s\n", e.what());
+        }
+        _exit(EXIT_FAILURE);
+    }
+    std::thread upstream(serveUpstream, listenSock, 2);
+
+    CHECK(download() == 1024 * 1024);
+    CHECK(download() == 1000);
+
+    kill(proxy, SIGTERM);
+    waitpid(proxy, nullptr, 0);
+    upstream.join();
+    close(listenSock);
+}
+
+int main() {
+    testParser();
+    testByteTriggers();
+    unlink(SCRIPT_PATH);
+    if (failures != 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All checks passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,46 @@
+#!/bin/bash
+# End-to-end check: serves a file of <bytes> random bytes with haserver on
+# <port>, downloads it with haclient and compares. HASERVER and HACLIENT
+# name the binaries, as for the bench targets.
+#   transfer.sh <work dir> <bytes> <port> [server options] [-- client options]
+set -eu
+
+WORK=$1
+BYTES=$2
+PORT=$3
+shift 3
+server_args=()
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    server_args+=("$1")
+    shift
+done
+[ $# -gt 0 ] && shift
+client_args=("$@")
+
+mkdir -p "$WORK"
+cd "$WORK"
+rm -rf client ./*.log
+input=input-$BYTES.bin
+rm -f "$input" "$input.gzip"
+head -c "$BYTES" /dev/urandom > "$input"
+
+server_pid=
+trap '[ -n "$server_pid" ] && kill "$server_pid" 2>/dev/null; wait 2>/dev/null || true' EXIT
+"$HASERVER" "$input" "$PORT" --stats-interval=0 ${server_args[@]+"${server_args[@]}"} > server.log 2>&1 &
+server_pid=$!
+for ((i = 0; i < 100; ++i)); do
+    bash -c "</dev/tcp/127.0.0.1/$PORT" 2>/dev/null && break
+    kill -0 "$server_pid" 2>/dev/null || { cat server.log; exit 1; }
+    sleep 0.1
+done
+
+mkdir client
+status=0
+(cd client && timeout 60 "$HACLIENT" --stats-interval=0 ${client_args[@]+"${client_args[@]}"} "127.0.0.1:$PORT" \
+    > ../client.log 2>&1) || status=$?
+if [ "$status" != 0 ] || ! cmp "client/$input" "$input"; then
+    echo "Transfer failed (haclient exit status $status)"
+    cat client.log
+    exit 1
+fi
+echo "Transferred $BYTES bytes"